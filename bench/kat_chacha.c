@@ -0,0 +1,292 @@
+/*
+ * Known answer tests of chacha.c, built once per CHACHA_LANES variant by
+ * 'make check': the all zero key vector, a vector across the wrap of the
+ * low counter word, and comparisons against a plain one block at a time
+ * ChaCha20 for every length up to a few batches, misaligned input and
+ * output, in place operation, messages split over several calls and
+ * every batch position of the counter wrap.
+ *
+ * Exits with 0 if everything matches, prints each mismatch otherwise.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "libssh2_priv.h"
+#include "chacha.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the same selection as chacha.c */
+#if defined(CHACHA_LANES)
+#define KAT_VARIANT "scalar (forced)"
+#elif defined(__AVX2__)
+#define KAT_VARIANT "AVX2, 8 lanes"
+#elif defined(__SSE2__)
+#define KAT_VARIANT "SSE2, 4 lanes"
+#elif defined(__ARM_NEON)
+#define KAT_VARIANT "NEON, 4 lanes"
+#else
+#define KAT_VARIANT "scalar"
+#endif
+
+#define KAT_MAXLEN  (64 * 24 + 63)  /* three AVX2 batches and a tail */
+
+/* keystream of the all zero key and nonce, blocks 0 and 1 */
+static const char zero_key_stream[] =
+    "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+    "da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586"
+    "9f07e7be5551387a98ba977c732d080dcb0f29a048e3656912c6533e32ee7aed"
+    "29b721769ce64e43d57133b074d839d531ed1f28510afb45ace10a1f4b794d6f";
+
+/* key 00..1f, nonce 00..07, blocks 0x1fffffffd to 0x200000001 */
+static const unsigned char wrap_ctr[CHACHA_CTRLEN] = {
+    0xfd, 0xff, 0xff, 0xff, 0x01, 0x00, 0x00, 0x00
+};
+static const char wrap_stream[] =
+    "02f5ae757c848bdaba4cdc844daadd0840aaacd98d263becba70c7ec7011fd43"
+    "7c612553d5a8ef2cbd0853496f51400d63cb42cf276fa808512ee983f044673b"
+    "c711fe0db1f2d4aebef938c3bf92a4a6bd3f8d855a5d9842661749d0ffa8afe3"
+    "b328364e651b2099fa97d4e2725393ce4c7509190a5e4f36859ec876c9fdbf01"
+    "02832f3fdb2267677365340ee220f8bcf6caabcd422883d57cdfec069fe324d9"
+    "b93a67147ed155aa13acc2d7b8a39e7b597eafa8e204d92f680985f06fc481cc"
+    "fe584de3c01c3348fd5358bf78e6d5ceaf9269d6307ac03b759a8a1aaa290495"
+    "79bbe6eb3715080039c3125f9f8d52e12bf29aed9dd6fe139ecfae9c101bc1a2"
+    "d25581d526b0e2810c9d3d3c9a0f855f23bee47a7a0d49c15b453a4b5e4ab442"
+    "2236caba9159af0aec37c95146ea8f20d541ec8865eeef705da40580dc7fc223";
+
+static int failures;
+
+static size_t
+unhex(unsigned char *out, const char *hex)
+{
+    size_t len = strlen(hex) / 2;
+    size_t i;
+    unsigned int byte;
+
+    for(i = 0; i < len; i++) {
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (unsigned char)byte;
+    }
+    return len;
+}
+
+static void
+fail(const char *what, size_t len, size_t in_off, size_t out_off)
+{
+    failures++;
+    printf("FAIL %s: length %u, input offset %u, output offset %u\n",
+           what, (unsigned int)len, (unsigned int)in_off,
+           (unsigned int)out_off);
+}
+
+/*
+ * Reference ChaCha20 with the 64 bit block counter of the original
+ * design, one block at a time and straight from the specification.
+ */
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+    a += b; d = ROTL32(d ^ a, 16); \
+    c += d; b = ROTL32(b ^ c, 12); \
+    a += b; d = ROTL32(d ^ a, 8); \
+    c += d; b = ROTL32(b ^ c, 7);
+
+static uint32_t
+load32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+ref_xor(const unsigned char key[32], const unsigned char iv[8],
+        uint64_t ctr, const unsigned char *m, unsigned char *c, size_t len)
+{
+    static const unsigned char sigma[16] = "expand 32-byte k";
+    uint32_t s[16], x[16];
+    unsigned char ks[64];
+    size_t i, n;
+    int r;
+
+    for(i = 0; i < 4; i++)
+        s[i] = load32(sigma + 4 * i);
+    for(i = 0; i < 8; i++)
+        s[4 + i] = load32(key + 4 * i);
+    s[14] = load32(iv);
+    s[15] = load32(iv + 4);
+
+    while(len) {
+        s[12] = (uint32_t)ctr;
+        s[13] = (uint32_t)(ctr >> 32);
+        memcpy(x, s, sizeof(x));
+        for(r = 0; r < 10; r++) {
+            QR(x[0], x[4], x[8], x[12])
+            QR(x[1], x[5], x[9], x[13])
+            QR(x[2], x[6], x[10], x[14])
+            QR(x[3], x[7], x[11], x[15])
+            QR(x[0], x[5], x[10], x[15])
+            QR(x[1], x[6], x[11], x[12])
+            QR(x[2], x[7], x[8], x[13])
+            QR(x[3], x[4], x[9], x[14])
+        }
+        for(i = 0; i < 16; i++) {
+            uint32_t v = x[i] + s[i];
+            ks[4 * i] = (unsigned char)v;
+            ks[4 * i + 1] = (unsigned char)(v >> 8);
+            ks[4 * i + 2] = (unsigned char)(v >> 16);
+            ks[4 * i + 3] = (unsigned char)(v >> 24);
+        }
+        n = len < 64 ? len : 64;
+        for(i = 0; i < n; i++)
+            c[i] = m[i] ^ ks[i];
+        m += n;
+        c += n;
+        len -= n;
+        ctr++;
+    }
+}
+
+static void
+setup(struct chacha_ctx *ctx, const unsigned char key[32],
+      const unsigned char iv[8], uint64_t ctr)
+{
+    unsigned char cb[CHACHA_CTRLEN];
+    int i;
+
+    for(i = 0; i < CHACHA_CTRLEN; i++)
+        cb[i] = (unsigned char)(ctr >> (8 * i));
+    chacha_keysetup(ctx, key, 256);
+    chacha_ivsetup(ctx, iv, cb);
+}
+
+static unsigned char key[32], iv[8];
+static unsigned char msg[KAT_MAXLEN];
+static unsigned char in[KAT_MAXLEN + 8], out[KAT_MAXLEN + 8];
+static unsigned char want[KAT_MAXLEN];
+
+static void
+kat_fixed(void)
+{
+    struct chacha_ctx ctx;
+    unsigned char zero[128], stream[320];
+    size_t len;
+
+    memset(zero, 0, sizeof(zero));
+    memset(key, 0, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+    len = unhex(want, zero_key_stream);
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup(&ctx, iv, NULL);
+    chacha_encrypt_bytes(&ctx, zero, out, (u_int)len);
+    if(memcmp(out, want, len))
+        fail("all zero key", len, 0, 0);
+    ref_xor(key, iv, 0, zero, out, len);
+    if(memcmp(out, want, len))
+        fail("all zero key, reference", len, 0, 0);
+
+    for(len = 0; len < sizeof(key); len++)
+        key[len] = (unsigned char)len;
+    for(len = 0; len < sizeof(iv); len++)
+        iv[len] = (unsigned char)len;
+    memset(stream, 0, sizeof(stream));
+    len = unhex(want, wrap_stream);
+    chacha_keysetup(&ctx, key, 256);
+    chacha_ivsetup(&ctx, iv, wrap_ctr);
+    chacha_encrypt_bytes(&ctx, stream, out, (u_int)len);
+    if(memcmp(out, want, len))
+        fail("counter wrap", len, 0, 0);
+    ref_xor(key, iv, 0x1fffffffdULL, stream, out, len);
+    if(memcmp(out, want, len))
+        fail("counter wrap, reference", len, 0, 0);
+}
+
+/* every length, with input and output at every offset within a word */
+static void
+kat_lengths(void)
+{
+    struct chacha_ctx ctx;
+    size_t len, in_off, out_off;
+
+    for(len = 0; len <= KAT_MAXLEN; len++) {
+        ref_xor(key, iv, 5, msg, want, len);
+        for(in_off = 0; in_off < 4; in_off++) {
+            for(out_off = 0; out_off < 4; out_off++) {
+                memcpy(in + in_off, msg, len);
+                setup(&ctx, key, iv, 5);
+                chacha_encrypt_bytes(&ctx, in + in_off, out + out_off,
+                                     (u_int)len);
+                if(memcmp(out + out_off, want, len))
+                    fail("length", len, in_off, out_off);
+            }
+            /* in place, as the chacha20-poly1305 cipher uses it */
+            memcpy(in + in_off, msg, len);
+            setup(&ctx, key, iv, 5);
+            chacha_encrypt_bytes(&ctx, in + in_off, in + in_off,
+                                 (u_int)len);
+            if(memcmp(in + in_off, want, len))
+                fail("in place", len, in_off, in_off);
+        }
+    }
+}
+
+/* one message over several calls of whole blocks, the last one partial */
+static void
+kat_split(void)
+{
+    static const size_t blocks[] = { 1, 3, 7, 2, 9, 4, 1, 8, 5, 16 };
+    struct chacha_ctx ctx;
+    size_t pos, n, i;
+
+    ref_xor(key, iv, 0xfffffff0ULL, msg, want, KAT_MAXLEN);
+    setup(&ctx, key, iv, 0xfffffff0ULL);
+    for(pos = 0, i = 0; pos < KAT_MAXLEN; pos += n, i++) {
+        n = 64 * blocks[i % (sizeof(blocks) / sizeof(blocks[0]))];
+        if(n > KAT_MAXLEN - pos)
+            n = KAT_MAXLEN - pos;
+        chacha_encrypt_bytes(&ctx, msg + pos, out + pos, (u_int)n);
+    }
+    if(memcmp(out, want, KAT_MAXLEN))
+        fail("split", KAT_MAXLEN, 0, 0);
+}
+
+/* the low counter word wrapping at every block of a batch */
+static void
+kat_wrap(void)
+{
+    struct chacha_ctx ctx;
+    uint64_t ctr;
+    size_t len = 64 * 20 + 13;
+    int d;
+
+    for(d = 0; d <= 17; d++) {
+        ctr = (7ULL << 32) | (uint32_t)(0xffffffffU - (uint32_t)d);
+        ref_xor(key, iv, ctr, msg, want, len);
+        setup(&ctx, key, iv, ctr);
+        chacha_encrypt_bytes(&ctx, msg, out, (u_int)len);
+        if(memcmp(out, want, len)) {
+            failures++;
+            printf("FAIL counter wrap %d blocks after the start\n", d + 1);
+        }
+    }
+}
+
+int
+main(void)
+{
+    size_t i;
+
+    kat_fixed();
+
+    for(i = 0; i < sizeof(msg); i++)
+        msg[i] = (unsigned char)(i * 131 + 17);
+
+    kat_lengths();
+    kat_split();
+    kat_wrap();
+
+    printf("chacha known answer tests, %s: %s\n", KAT_VARIANT,
+           failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
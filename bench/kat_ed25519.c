@@ -0,0 +1,215 @@
+/*
+ * Known answer tests of the X25519 and Ed25519 code of ed25519.c: the
+ * vectors of RFC 7748 sections 5.2 (including the 1 and 1000 iteration
+ * ladders) and 6.1, and RFC 8032 section 7.1 (TEST 1, 2, 3 and SHA(abc)).
+ *
+ * Exits with 0 if every vector matches, prints each mismatch otherwise.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "libssh2_priv.h"
+#include "ed25519.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+    const char *scalar;
+    const char *u;
+    const char *out;
+} x25519_vectors[] = {
+    /* RFC 7748 5.2 */
+    { "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+      "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+      "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552" },
+    { "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+      "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493",
+      "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957" },
+};
+
+/* RFC 7748 5.2, k after 1 and 1000 iterations of k, u = X25519(k, u), k */
+static const char x25519_iter1[] =
+    "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079";
+static const char x25519_iter1000[] =
+    "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51";
+
+/* RFC 7748 6.1 */
+static const struct {
+    const char *priv;
+    const char *pub;
+} x25519_dh[] = {
+    { "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+      "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a" },
+    { "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb",
+      "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f" },
+};
+static const char x25519_dh_shared[] =
+    "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742";
+
+/* RFC 8032 7.1 */
+static const struct {
+    const char *name;
+    const char *seed;
+    const char *pk;
+    const char *msg;
+    const char *sig;
+} ed25519_vectors[] = {
+    { "TEST 1",
+      "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+      "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a",
+      "",
+      "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e06522490155"
+      "5fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b" },
+    { "TEST 2",
+      "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+      "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c",
+      "72",
+      "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da"
+      "085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00" },
+    { "TEST 3",
+      "c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7",
+      "fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025",
+      "af82",
+      "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac"
+      "18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a" },
+    { "TEST SHA(abc)",
+      "833fe62409237b9d62ec77587520911e9a759cec1d19755b7da901b96dca3d42",
+      "ec172b93ad5e563bf4932c70e1245034c35467ef2efd4d64ebf819683467e2bf",
+      "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+      "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f",
+      "dc2a4459e7369633a52b1bf277839a00201009a3efbf3ecb69bea2186c26b589"
+      "09351fc9ac90b3ecfdfbc7c66431e0303dca179c138ac17ad9bef1177331a704" },
+};
+
+static int failures;
+
+static size_t
+unhex(unsigned char *out, size_t size, const char *hex)
+{
+    size_t len = strlen(hex) / 2;
+    size_t i;
+    unsigned int byte;
+
+    if(len > size) {
+        fprintf(stderr, "vector too long: %s\n", hex);
+        exit(2);
+    }
+    for(i = 0; i < len; i++) {
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (unsigned char)byte;
+    }
+    return len;
+}
+
+static void
+check(const char *what, const unsigned char *got, const char *hex)
+{
+    unsigned char want[ED25519_SIGLEN];
+    size_t len = unhex(want, sizeof(want), hex);
+    size_t i;
+
+    if(!memcmp(got, want, len))
+        return;
+    failures++;
+    printf("FAIL %s\n  want %s\n  got  ", what, hex);
+    for(i = 0; i < len; i++)
+        printf("%02x", got[i]);
+    printf("\n");
+}
+
+static void
+kat_x25519(void)
+{
+    unsigned char k[CURVE25519_KEYLEN], u[CURVE25519_KEYLEN];
+    unsigned char out[CURVE25519_KEYLEN];
+    unsigned char priv[2][CURVE25519_KEYLEN], pub[2][CURVE25519_KEYLEN];
+    int i;
+
+    for(i = 0; i < (int)(sizeof(x25519_vectors) /
+                         sizeof(x25519_vectors[0])); i++) {
+        unhex(k, sizeof(k), x25519_vectors[i].scalar);
+        unhex(u, sizeof(u), x25519_vectors[i].u);
+        if(x25519_scalarmult(out, k, u))
+            memset(out, 0, sizeof(out));
+        check("x25519 RFC 7748 5.2", out, x25519_vectors[i].out);
+    }
+
+    memset(k, 0, sizeof(k));
+    k[0] = 9;
+    memcpy(u, k, sizeof(u));
+    for(i = 1; i <= 1000; i++) {
+        x25519_scalarmult(out, k, u);
+        memcpy(u, k, sizeof(u));
+        memcpy(k, out, sizeof(k));
+        if(i == 1)
+            check("x25519 RFC 7748 5.2, 1 iteration", k, x25519_iter1);
+    }
+    check("x25519 RFC 7748 5.2, 1000 iterations", k, x25519_iter1000);
+
+    for(i = 0; i < 2; i++) {
+        unhex(priv[i], sizeof(priv[i]), x25519_dh[i].priv);
+        x25519_scalarmult_base(pub[i], priv[i]);
+        check("x25519 RFC 7748 6.1 public key", pub[i], x25519_dh[i].pub);
+    }
+    for(i = 0; i < 2; i++) {
+        if(x25519_scalarmult(out, priv[i], pub[1 - i]))
+            memset(out, 0, sizeof(out));
+        check("x25519 RFC 7748 6.1 shared secret", out, x25519_dh_shared);
+    }
+
+    /* a point of small order gives an all zero result, which is refused */
+    memset(u, 0, sizeof(u));
+    if(x25519_scalarmult(out, priv[0], u) != -1) {
+        failures++;
+        printf("FAIL x25519 accepted the all zero point\n");
+    }
+}
+
+static void
+kat_ed25519(void)
+{
+    unsigned char seed[ED25519_SEEDLEN], pk[ED25519_PUBLICKEYLEN];
+    unsigned char sig[ED25519_SIGLEN], msg[64];
+    size_t mlen;
+    int i;
+
+    for(i = 0; i < (int)(sizeof(ed25519_vectors) /
+                         sizeof(ed25519_vectors[0])); i++) {
+        const char *name = ed25519_vectors[i].name;
+
+        unhex(seed, sizeof(seed), ed25519_vectors[i].seed);
+        mlen = unhex(msg, sizeof(msg), ed25519_vectors[i].msg);
+
+        ed25519_public_key(pk, seed);
+        check(name, pk, ed25519_vectors[i].pk);
+
+        if(ed25519_sign(sig, msg, mlen, seed, pk)) {
+            failures++;
+            printf("FAIL %s: sign failed\n", name);
+            continue;
+        }
+        check(name, sig, ed25519_vectors[i].sig);
+
+        if(ed25519_verify(sig, msg, mlen, pk)) {
+            failures++;
+            printf("FAIL %s: valid signature refused\n", name);
+        }
+        sig[0] ^= 1;
+        if(!ed25519_verify(sig, msg, mlen, pk)) {
+            failures++;
+            printf("FAIL %s: altered signature accepted\n", name);
+        }
+    }
+}
+
+int
+main(void)
+{
+    kat_x25519();
+    kat_ed25519();
+
+    printf("ed25519 known answer tests: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,992 @@
+/*
+ * Host benchmark of the libssh2 transport: every cipher and MAC method
+ * through the real packet send and receive paths, the MAC methods on
+ * their own, the key generation and agreement of every key exchange
+ * method, and whole sessions with every cipher against the in-process
+ * server of loopback.c, over a link with the latency and bandwidth given.
+ *
+ * Reports MB/s, ns/packet and allocations/packet for a range of packet
+ * sizes, as a table or, with -j, as one JSON object per line.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "libssh2_priv.h"
+#include "mac.h"
+#include "transport.h"
+#include "loopback.h"
+
+#include <libssh2_sftp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define BENCH_BATCH     32  /* packets sent before reading them back */
+
+#define BENCH_XFER      (4 * 1024 * 1024)   /* bytes per session transfer */
+#define BENCH_CHUNK     (1024 * 1024)       /* bytes per write or read call */
+
+static const size_t bench_sizes[] = {
+    64, 256, 1024, 4096, 16384, 32768
+};
+
+static struct {
+    int json;
+    double seconds;         /* minimum time per measurement */
+    const char *filter;     /* only run methods whose name contains it */
+    double latency;         /* one way, of the loopback link */
+    double bandwidth;       /* of the loopback link, 0 for unlimited */
+    int stats;              /* print the session counters of transfers */
+} opt = { 0, 0.2, NULL, 0, 0, 0 };
+
+/* allocation counters of the benchmark session */
+static struct {
+    unsigned long allocs;
+} mem;
+
+/* the bytes on the "wire" between sending and reading them back */
+static struct {
+    unsigned char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;
+} wire;
+
+static unsigned long ignored;   /* SSH_MSG_IGNORE packets received */
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int
+selected(const char *name)
+{
+    return !opt.filter || strstr(name, opt.filter);
+}
+
+static LIBSSH2_ALLOC_FUNC(bench_alloc)
+{
+    (void)abstract;
+    mem.allocs++;
+    return malloc(count);
+}
+
+static LIBSSH2_REALLOC_FUNC(bench_realloc)
+{
+    (void)abstract;
+    mem.allocs++;
+    return realloc(ptr, count);
+}
+
+static LIBSSH2_FREE_FUNC(bench_free)
+{
+    (void)abstract;
+    free(ptr);
+}
+
+static LIBSSH2_SEND_FUNC(bench_send)
+{
+    (void)socket;
+    (void)flags;
+    (void)abstract;
+
+    if(wire.len + length > wire.size) {
+        size_t size = (wire.len + length) * 2;
+        unsigned char *buf = realloc(wire.buf, size);
+        if(!buf)
+            return -ENOMEM;
+        wire.buf = buf;
+        wire.size = size;
+    }
+    memcpy(wire.buf + wire.len, buffer, length);
+    wire.len += length;
+
+    return (ssize_t)length;
+}
+
+static LIBSSH2_RECV_FUNC(bench_recv)
+{
+    size_t left = wire.len - wire.pos;
+
+    (void)socket;
+    (void)flags;
+    (void)abstract;
+
+    if(!left)
+        return -EAGAIN;
+    if(length > left)
+        length = left;
+    memcpy(buffer, wire.buf + wire.pos, length);
+    wire.pos += length;
+    if(wire.pos == wire.len)
+        wire.pos = wire.len = 0;
+
+    return (ssize_t)length;
+}
+
+static LIBSSH2_IGNORE_FUNC(bench_ignore)
+{
+    (void)session;
+    (void)message;
+    (void)message_len;
+    (void)abstract;
+    ignored++;
+}
+
+static void
+report(const char *bench, const char *name, const char *mac,
+       const char *what, size_t size, double seconds, unsigned long ops,
+       unsigned long allocs)
+{
+    double ns = seconds * 1e9 / (double)ops;
+    double mbps = size ? (double)size * (double)ops / seconds / 1e6 : 0;
+    double apo = (double)allocs / (double)ops;
+
+    if(opt.json) {
+        printf("{\"bench\":\"%s\",\"name\":\"%s\"", bench, name);
+        if(mac)
+            printf(",\"mac\":\"%s\"", mac);
+        printf(",\"op\":\"%s\",\"size\":%lu,\"ops\":%lu,"
+               "\"mb_per_s\":%.2f,\"ns_per_op\":%.0f,"
+               "\"allocs_per_op\":%.2f}\n",
+               what, (unsigned long)size, ops, mbps, ns, apo);
+    }
+    else {
+        char label[96];
+
+        snprintf(label, sizeof(label), "%s%s%s", name,
+                 mac ? " + " : "", mac ? mac : "");
+        printf("%-7s %-52s %-6s %6lu %9.2f %12.0f %8.2f\n", bench, label,
+               what, (unsigned long)size, mbps, ns, apo);
+    }
+    fflush(stdout);
+}
+
+/* the counters libssh2 kept during a session measurement, to stderr */
+static void
+report_stats(LIBSSH2_SESSION *session, const char *bench, const char *what)
+{
+    LIBSSH2_SESSION_STATS st;
+
+    if(!opt.stats)
+        return;
+    libssh2_session_get_stats(session, &st);
+    fprintf(stderr, "  %s %s: sent %lu bytes in %lu packets, received "
+            "%lu in %lu; crypt %.1f ms, mac %.1f ms, comp %.1f ms, "
+            "wait %.1f ms, window stall %.1f ms; EAGAIN %lu/%lu\n",
+            bench, what,
+            (unsigned long)st.bytes_sent, (unsigned long)st.packets_sent,
+            (unsigned long)st.bytes_recv, (unsigned long)st.packets_recv,
+            (double)st.crypt_time / 1e3, (double)st.mac_time / 1e3,
+            (double)st.comp_time / 1e3, (double)st.wait_time / 1e3,
+            (double)st.window_stall_time / 1e3,
+            (unsigned long)st.eagain_send, (unsigned long)st.eagain_recv);
+}
+
+/* key material for a method, the same for both directions */
+static int
+init_crypt(LIBSSH2_SESSION *session, const LIBSSH2_CRYPT_METHOD *method,
+           int encrypt, void **abstract)
+{
+    unsigned char *iv, *secret;
+    int free_iv = 0, free_secret = 0;
+    int rc;
+
+    if(!method->init)
+        return 0;
+
+    iv = LIBSSH2_ALLOC(session, method->iv_len > 0 ? method->iv_len : 1);
+    secret = LIBSSH2_ALLOC(session, method->secret_len);
+    if(!iv || !secret) {
+        if(iv)
+            LIBSSH2_FREE(session, iv);
+        if(secret)
+            LIBSSH2_FREE(session, secret);
+        return -1;
+    }
+    memset(iv, 0x11, method->iv_len > 0 ? method->iv_len : 1);
+    memset(secret, 0x22, method->secret_len);
+
+    rc = method->init(session, method, iv, &free_iv, secret, &free_secret,
+                      encrypt, abstract);
+    if(rc || free_iv)
+        LIBSSH2_FREE(session, iv);
+    if(rc || free_secret)
+        LIBSSH2_FREE(session, secret);
+
+    return rc;
+}
+
+static int
+init_mac(LIBSSH2_SESSION *session, const LIBSSH2_MAC_METHOD *method,
+         void **abstract)
+{
+    unsigned char *key;
+    int free_key = 0;
+
+    key = LIBSSH2_ALLOC(session, method->key_len);
+    if(!key)
+        return -1;
+    memset(key, 0x33, method->key_len);
+
+    if(method->init(session, key, &free_key, abstract)) {
+        LIBSSH2_FREE(session, key);
+        return -1;
+    }
+    if(free_key)
+        LIBSSH2_FREE(session, key);
+
+    return 0;
+}
+
+/*
+ * A session set up as if the key exchange had picked 'crypt' and 'mac' in
+ * both directions, with the same keys, so that whatever it sends it can
+ * read back.
+ */
+static LIBSSH2_SESSION *
+packet_session(const LIBSSH2_CRYPT_METHOD *crypt,
+               const LIBSSH2_MAC_METHOD *mac)
+{
+    LIBSSH2_SESSION *session;
+
+    session = libssh2_session_init_ex(bench_alloc, bench_free,
+                                      bench_realloc, NULL);
+    if(!session)
+        return NULL;
+
+    wire.len = wire.pos = 0;
+    libssh2_session_set_blocking(session, 0);
+    libssh2_session_callback_set2(session, LIBSSH2_CALLBACK_SEND,
+                                  (libssh2_cb_generic *)bench_send);
+    libssh2_session_callback_set2(session, LIBSSH2_CALLBACK_RECV,
+                                  (libssh2_cb_generic *)bench_recv);
+    libssh2_session_callback_set2(session, LIBSSH2_CALLBACK_IGNORE,
+                                  (libssh2_cb_generic *)bench_ignore);
+
+    session->local.crypt = crypt;
+    session->remote.crypt = crypt;
+    session->local.mac = mac;
+    session->remote.mac = mac;
+    session->state |= LIBSSH2_STATE_NEWKEYS;
+
+    if(_libssh2_transport_init(session) ||
+       init_crypt(session, crypt, 1, &session->local.crypt_abstract) ||
+       init_crypt(session, crypt, 0, &session->remote.crypt_abstract) ||
+       init_mac(session, mac, &session->local.mac_abstract) ||
+       init_mac(session, mac, &session->remote.mac_abstract)) {
+        libssh2_session_free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static int
+bench_packets(const LIBSSH2_CRYPT_METHOD *crypt,
+              const LIBSSH2_MAC_METHOD *mac)
+{
+    LIBSSH2_SESSION *session;
+    unsigned char *payload;
+    const char *mac_name = mac->name;
+    size_t max_payload;
+    size_t i;
+    int rc = 0;
+
+    session = packet_session(crypt, mac);
+    if(!session) {
+        fprintf(stderr, "%s: cannot set up session\n", crypt->name);
+        return -1;
+    }
+    max_payload = _libssh2_transport_max_payload(session);
+    if(crypt->flags & (LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC |
+                       LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET))
+        mac_name = NULL;   /* authenticated by the cipher */
+
+    payload = malloc(max_payload);
+    if(!payload) {
+        libssh2_session_free(session);
+        return -1;
+    }
+    memset(payload, 0x5a, max_payload);
+
+    for(i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        size_t size = LIBSSH2_MIN(bench_sizes[i], max_payload);
+        double t_send = 0, t_recv = 0, t;
+        unsigned long sent = 0, received = 0;
+        unsigned long a_send = 0, a_recv = 0, a;
+        unsigned char *s = payload;
+        int n;
+
+        /* SSH_MSG_IGNORE with a string filling the payload */
+        *s++ = SSH_MSG_IGNORE;
+        _libssh2_store_u32(&s, (uint32_t)(size - 5));
+
+        do {
+            a = mem.allocs;
+            t = now();
+            for(n = 0; n < BENCH_BATCH; n++) {
+                rc = _libssh2_transport_send(session, payload, size,
+                                             NULL, 0);
+                if(rc)
+                    break;
+            }
+            t_send += now() - t;
+            a_send += mem.allocs - a;
+            if(rc) {
+                fprintf(stderr, "%s: send failed: %d\n", crypt->name, rc);
+                goto done;
+            }
+            sent += BENCH_BATCH;
+
+            ignored = 0;
+            a = mem.allocs;
+            t = now();
+            /* the transport may ask for more with data still on the wire
+               when it has just refilled its buffer */
+            do {
+                rc = _libssh2_transport_read(session);
+            } while(rc >= 0 || (rc == LIBSSH2_ERROR_EAGAIN && wire.len));
+            t_recv += now() - t;
+            a_recv += mem.allocs - a;
+            if(rc != LIBSSH2_ERROR_EAGAIN || ignored != BENCH_BATCH) {
+                fprintf(stderr, "%s: read back %lu of %d packets: %d\n",
+                        crypt->name, ignored, BENCH_BATCH, rc);
+                rc = -1;
+                goto done;
+            }
+            rc = 0;
+            received += ignored;
+        } while(t_send + t_recv < opt.seconds);
+
+        report("packet", crypt->name, mac_name, "send", size,
+               t_send, sent, a_send);
+        report("packet", crypt->name, mac_name, "recv", size,
+               t_recv, received, a_recv);
+    }
+
+done:
+    free(payload);
+    libssh2_session_free(session);
+    return rc;
+}
+
+static int
+bench_mac(const LIBSSH2_MAC_METHOD *method)
+{
+    LIBSSH2_SESSION *session;
+    void *abstract = NULL;
+    unsigned char *packet;
+    unsigned char buf[MAX_MACSIZE];
+    size_t i;
+    int rc = 0;
+
+    session = libssh2_session_init_ex(bench_alloc, bench_free,
+                                      bench_realloc, NULL);
+    if(!session)
+        return -1;
+    packet = malloc(bench_sizes[sizeof(bench_sizes) /
+                                sizeof(bench_sizes[0]) - 1]);
+    if(!packet || init_mac(session, method, &abstract)) {
+        free(packet);
+        libssh2_session_free(session);
+        return -1;
+    }
+
+    for(i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        size_t size = bench_sizes[i];
+        unsigned long ops = 0, a = mem.allocs;
+        double t = now(), elapsed;
+        uint32_t seqno = 0;
+
+        memset(packet, 0x5a, size);
+        do {
+            int n;
+            for(n = 0; n < BENCH_BATCH; n++) {
+                if(method->hash(session, buf, seqno++, packet, size,
+                                NULL, 0, &abstract)) {
+                    rc = -1;
+                    goto done;
+                }
+            }
+            ops += BENCH_BATCH;
+            elapsed = now() - t;
+        } while(elapsed < opt.seconds);
+
+        report("mac", method->name, NULL, "hash", size, elapsed, ops,
+               mem.allocs - a);
+    }
+
+done:
+    if(method->dtor)
+        method->dtor(session, &abstract);
+    free(packet);
+    libssh2_session_free(session);
+    return rc;
+}
+
+/* one key pair, or one shared secret from it */
+enum { KEX_KEYGEN, KEX_AGREE };
+
+static int
+kex_dh(LIBSSH2_SESSION *session, int bits, int op)
+{
+    _libssh2_bn *p = _libssh2_bn_init();
+    _libssh2_bn *g = _libssh2_bn_init();
+    _libssh2_bn *e = _libssh2_bn_init();
+    _libssh2_bn *f = _libssh2_bn_init();
+    _libssh2_bn *k = _libssh2_bn_init();
+    _libssh2_bn_ctx *ctx = _libssh2_bn_ctx_new();
+    _libssh2_dh_ctx x;
+    _libssh2_dh_ctx y;
+    unsigned char modulus[LIBSSH2_DH_MAX_MODULUS_BITS / 8];
+    int bytes = bits / 8;
+    int rc = -1;
+
+    (void)session;
+    (void)ctx; /* not used by every backend */
+    libssh2_dh_init(&x);
+    libssh2_dh_init(&y);
+
+    /* the cost of the exponentiations only depends on the size of the
+       modulus, any odd one of the group's size does */
+    if(!p || !g || !e || !f || !k ||
+       _libssh2_random(modulus, bytes))
+        goto out;
+    modulus[0] |= 0x80;
+    modulus[bytes - 1] |= 1;
+    if(_libssh2_bn_from_bin(p, bytes, modulus) ||
+       _libssh2_bn_set_word(g, 2))
+        goto out;
+
+    if(op == KEX_KEYGEN) {
+        rc = libssh2_dh_key_pair(&x, e, g, p, bytes, ctx);
+    }
+    else {
+        if(libssh2_dh_key_pair(&y, f, g, p, bytes, ctx) ||
+           libssh2_dh_key_pair(&x, e, g, p, bytes, ctx))
+            goto out;
+        rc = libssh2_dh_secret(&x, k, f, p, ctx);
+    }
+
+out:
+    libssh2_dh_dtor(&x);
+    libssh2_dh_dtor(&y);
+    _libssh2_bn_free(p);
+    _libssh2_bn_free(g);
+    _libssh2_bn_free(e);
+    _libssh2_bn_free(f);
+    _libssh2_bn_free(k);
+    _libssh2_bn_ctx_free(ctx);
+    return rc;
+}
+
+#if LIBSSH2_ECDSA
+static int
+kex_ecdh(LIBSSH2_SESSION *session, libssh2_curve_type curve, int op)
+{
+    _libssh2_ec_key *priv = NULL, *peer = NULL;
+    unsigned char *pub = NULL, *peer_pub = NULL;
+    size_t pub_len, peer_pub_len;
+    _libssh2_bn *k = NULL;
+    int rc = -1;
+
+    if(_libssh2_ecdsa_create_key(session, &priv, &pub, &pub_len, curve))
+        goto out;
+    if(op == KEX_KEYGEN) {
+        rc = 0;
+        goto out;
+    }
+    if(_libssh2_ecdsa_create_key(session, &peer, &peer_pub, &peer_pub_len,
+                                 curve))
+        goto out;
+    k = _libssh2_bn_init();
+    if(k)
+        rc = _libssh2_ecdh_gen_k(&k, priv, peer_pub, peer_pub_len);
+
+out:
+    if(priv)
+        _libssh2_ecdsa_free(priv);
+    if(peer)
+        _libssh2_ecdsa_free(peer);
+    if(pub)
+        LIBSSH2_FREE(session, pub);
+    if(peer_pub)
+        LIBSSH2_FREE(session, peer_pub);
+    if(k)
+        _libssh2_bn_free(k);
+    return rc;
+}
+#endif
+
+#if LIBSSH2_ED25519
+static int
+kex_curve25519(LIBSSH2_SESSION *session, int op)
+{
+    unsigned char *pub = NULL, *priv = NULL;
+    unsigned char *peer_pub = NULL, *peer_priv = NULL;
+    _libssh2_bn *k = NULL;
+    int rc = -1;
+
+    if(_libssh2_curve25519_new(session, &pub, &priv))
+        goto out;
+    if(op == KEX_KEYGEN) {
+        rc = 0;
+        goto out;
+    }
+    if(_libssh2_curve25519_new(session, &peer_pub, &peer_priv))
+        goto out;
+    k = _libssh2_bn_init();
+    if(k)
+        rc = _libssh2_curve25519_gen_k(&k, priv, peer_pub);
+
+out:
+    if(pub)
+        LIBSSH2_FREE(session, pub);
+    if(priv)
+        LIBSSH2_FREE(session, priv);
+    if(peer_pub)
+        LIBSSH2_FREE(session, peer_pub);
+    if(peer_priv)
+        LIBSSH2_FREE(session, peer_priv);
+    if(k)
+        _libssh2_bn_free(k);
+    return rc;
+}
+#endif
+
+static int
+kex_run(LIBSSH2_SESSION *session, const char *name, int op)
+{
+    int bits = 0;
+
+    if(!strncmp(name, "curve25519-sha256", 17)) {
+#if LIBSSH2_ED25519
+        return kex_curve25519(session, op);
+#endif
+    }
+#if LIBSSH2_ECDSA
+    else if(!strcmp(name, "ecdh-sha2-nistp256"))
+        return kex_ecdh(session, LIBSSH2_EC_CURVE_NISTP256, op);
+    else if(!strcmp(name, "ecdh-sha2-nistp384"))
+        return kex_ecdh(session, LIBSSH2_EC_CURVE_NISTP384, op);
+    else if(!strcmp(name, "ecdh-sha2-nistp521"))
+        return kex_ecdh(session, LIBSSH2_EC_CURVE_NISTP521, op);
+#endif
+    else if(!strncmp(name, "diffie-hellman-group1-", 22))
+        bits = 1024;
+    else if(!strncmp(name, "diffie-hellman-group14-", 23))
+        bits = 2048;
+    else if(!strncmp(name, "diffie-hellman-group16-", 23))
+        bits = 4096;
+    else if(!strncmp(name, "diffie-hellman-group18-", 23))
+        bits = 8192;
+    else if(!strncmp(name, "diffie-hellman-group-exchange-", 30))
+        bits = LIBSSH2_DH_GEX_OPTGROUP;
+
+    if(bits)
+        return kex_dh(session, bits, op);
+
+    return 1;   /* not a key exchange we know how to run */
+}
+
+static int
+bench_kex(LIBSSH2_SESSION *session, const char *name)
+{
+    static const char *ops[] = { "keygen", "agree" };
+    int op;
+
+    for(op = KEX_KEYGEN; op <= KEX_AGREE; op++) {
+        unsigned long n = 0, a = mem.allocs;
+        double t = now(), elapsed;
+        int rc;
+
+        do {
+            rc = kex_run(session, name, op);
+            if(rc)
+                return rc;
+            n++;
+            elapsed = now() - t;
+        } while(elapsed < opt.seconds || n < 3);
+
+        report("kex", name, NULL, ops[op], 0, elapsed, n, mem.allocs - a);
+    }
+
+    return 0;
+}
+
+/* retries a non-blocking call for as long as the loopback link is busy */
+#define LB_CALL(lb, rc, call) \
+    do { \
+        (rc) = (call); \
+    } while((rc) == LIBSSH2_ERROR_EAGAIN && !loopback_wait(lb))
+
+#define LB_CALL_PTR(lb, session, ptr, call) \
+    do { \
+        (ptr) = (call); \
+    } while(!(ptr) && \
+            libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN && \
+            !loopback_wait(lb))
+
+/* a session with 'crypt' and 'mac', logged in to a loopback server */
+static LIBSSH2_SESSION *
+session_connect(struct loopback **lbp, const char *crypt, const char *mac,
+                double *seconds)
+{
+    struct loopback_config config;
+    struct loopback *lb;
+    LIBSSH2_SESSION *session;
+    double t;
+    int rc;
+
+    memset(&config, 0, sizeof(config));
+    config.crypt = crypt;
+    config.mac = mac;
+    config.latency = opt.latency;
+    config.bandwidth = opt.bandwidth;
+    config.file_size = BENCH_XFER;
+
+    lb = loopback_new(&config);
+    if(!lb)
+        return NULL;
+    session = libssh2_session_init_ex(bench_alloc, bench_free,
+                                      bench_realloc, NULL);
+    if(!session || loopback_attach(lb, session)) {
+        if(session)
+            libssh2_session_free(session);
+        loopback_free(lb);
+        return NULL;
+    }
+
+    t = loopback_now(lb);
+    LB_CALL(lb, rc, libssh2_session_handshake(session, loopback_socket(lb)));
+    if(!rc)
+        LB_CALL(lb, rc, libssh2_userauth_password(session, "bench", "bench"));
+    if(rc) {
+        char *msg;
+
+        libssh2_session_last_error(session, &msg, NULL, 0);
+        fprintf(stderr, "%s: cannot log in: %d %s\n", crypt, rc, msg);
+        libssh2_session_free(session);
+        loopback_free(lb);
+        return NULL;
+    }
+    if(seconds)
+        *seconds = loopback_now(lb) - t;
+
+    *lbp = lb;
+    return session;
+}
+
+static void
+session_close(struct loopback *lb, LIBSSH2_SESSION *session)
+{
+    int rc;
+
+    LB_CALL(lb, rc, libssh2_session_disconnect(session, "done"));
+    libssh2_session_free(session);
+    loopback_free(lb);
+}
+
+/* runs 'command' on a new channel, writing BENCH_XFER bytes to it or
+   reading all it writes */
+static int
+session_channel(struct loopback *lb, LIBSSH2_SESSION *session,
+                const char *command, unsigned char *buf, int writing)
+{
+    LIBSSH2_CHANNEL *channel;
+    size_t left = BENCH_XFER;
+    ssize_t n;
+    int rc;
+
+    LB_CALL_PTR(lb, session, channel, libssh2_channel_open_session(session));
+    if(!channel)
+        return -1;
+    LB_CALL(lb, rc, libssh2_channel_exec(channel, command));
+
+    while(!rc && left) {
+        if(writing)
+            LB_CALL(lb, n, libssh2_channel_write(channel, (char *)buf,
+                                                 LIBSSH2_MIN(left,
+                                                             BENCH_CHUNK)));
+        else
+            LB_CALL(lb, n, libssh2_channel_read(channel, (char *)buf,
+                                                BENCH_CHUNK));
+        if(n <= 0)
+            rc = n ? (int)n : -1;
+        else
+            left -= (size_t)n;
+    }
+
+    if(!rc && writing)
+        LB_CALL(lb, rc, libssh2_channel_send_eof(channel));
+    if(!rc)
+        LB_CALL(lb, rc, libssh2_channel_wait_eof(channel));
+    if(!rc)
+        LB_CALL(lb, rc, libssh2_channel_wait_closed(channel));
+    LB_CALL(lb, n, libssh2_channel_free(channel));
+
+    return rc;
+}
+
+/* writes BENCH_XFER bytes to a file, or reads them from one */
+static int
+session_sftp(struct loopback *lb, LIBSSH2_SESSION *session,
+             unsigned char *buf, int writing)
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    size_t left = BENCH_XFER;
+    ssize_t n;
+    int rc = 0;
+
+    LB_CALL_PTR(lb, session, sftp, libssh2_sftp_init(session));
+    if(!sftp)
+        return -1;
+    LB_CALL_PTR(lb, session, handle,
+                libssh2_sftp_open(sftp, "/bench",
+                                  writing ? LIBSSH2_FXF_WRITE |
+                                  LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC :
+                                  LIBSSH2_FXF_READ, 0644));
+    if(!handle)
+        rc = -1;
+
+    while(!rc && left) {
+        if(writing)
+            LB_CALL(lb, n, libssh2_sftp_write(handle, (char *)buf,
+                                              LIBSSH2_MIN(left,
+                                                          BENCH_CHUNK)));
+        else
+            LB_CALL(lb, n, libssh2_sftp_read(handle, (char *)buf,
+                                             BENCH_CHUNK));
+        if(n <= 0)
+            rc = n ? (int)n : -1;
+        else
+            left -= (size_t)n;
+    }
+
+    if(handle)
+        LB_CALL(lb, n, libssh2_sftp_close_handle(handle));
+    LB_CALL(lb, n, libssh2_sftp_shutdown(sftp));
+
+    return rc;
+}
+
+static int
+bench_session(const char *crypt, const char *mac)
+{
+    static const char *ops[] = { "write", "read" };
+    struct loopback *lb;
+    LIBSSH2_SESSION *session;
+    unsigned char *buf;
+    char source[32];
+    double t, elapsed = 0, seconds;
+    unsigned long n = 0, a = mem.allocs;
+    int writing;
+    int rc = 0;
+
+    /* connecting: key exchange and password authentication */
+    do {
+        session = session_connect(&lb, crypt, mac, &seconds);
+        if(!session)
+            return -1;
+        session_close(lb, session);
+        elapsed += seconds;
+        n++;
+    } while(elapsed < opt.seconds || n < 3);
+    report("session", crypt, mac, "login", 0, elapsed, n, mem.allocs - a);
+
+    buf = malloc(BENCH_CHUNK);
+    if(!buf)
+        return -1;
+    memset(buf, 0x5a, BENCH_CHUNK);
+    snprintf(source, sizeof(source), "source %d", BENCH_XFER);
+    session = session_connect(&lb, crypt, mac, NULL);
+    if(!session) {
+        free(buf);
+        return -1;
+    }
+
+    for(writing = 1; writing >= 0 && !rc; writing--) {
+        n = 0;
+        a = mem.allocs;
+        t = loopback_now(lb);
+        libssh2_session_reset_stats(session);
+        do {
+            rc = session_channel(lb, session, writing ? "sink" : source,
+                                 buf, writing);
+            if(rc)
+                break;
+            n++;
+            elapsed = loopback_now(lb) - t;
+        } while(elapsed < opt.seconds);
+        if(!rc) {
+            report("channel", crypt, mac, ops[1 - writing], BENCH_XFER,
+                   elapsed, n, mem.allocs - a);
+            report_stats(session, "channel", ops[1 - writing]);
+        }
+    }
+
+    for(writing = 1; writing >= 0 && !rc; writing--) {
+        n = 0;
+        a = mem.allocs;
+        t = loopback_now(lb);
+        libssh2_session_reset_stats(session);
+        do {
+            rc = session_sftp(lb, session, buf, writing);
+            if(rc)
+                break;
+            n++;
+            elapsed = loopback_now(lb) - t;
+        } while(elapsed < opt.seconds);
+        if(!rc) {
+            report("sftp", crypt, mac, ops[1 - writing], BENCH_XFER,
+                   elapsed, n, mem.allocs - a);
+            report_stats(session, "sftp", ops[1 - writing]);
+        }
+    }
+
+    if(rc) {
+        char *msg;
+
+        libssh2_session_last_error(session, &msg, NULL, 0);
+        fprintf(stderr, "%s: session transfer failed: %d %s\n", crypt, rc,
+                msg);
+    }
+    session_close(lb, session);
+    free(buf);
+    return rc;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-j] [-s] [-t seconds] [-l ms] [-b MB/s] [filter]\n"
+            "  -j          one JSON object per result line\n"
+            "  -s          session counters of each transfer, to stderr\n"
+            "  -t seconds  minimum time per measurement (default 0.2)\n"
+            "  -l ms       one way latency of the session link\n"
+            "  -b MB/s     bandwidth of the session link\n"
+            "  filter      only methods whose name contains this\n",
+            name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const LIBSSH2_CRYPT_METHOD **crypt;
+    const LIBSSH2_MAC_METHOD **mac;
+    const LIBSSH2_MAC_METHOD *default_mac = NULL;
+    LIBSSH2_SESSION *session;
+    const char **algs = NULL;
+    int i, n;
+    int rc = 0;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-j"))
+            opt.json = 1;
+        else if(!strcmp(argv[i], "-s"))
+            opt.stats = 1;
+        else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+            opt.seconds = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+            opt.latency = atof(argv[++i]) / 1e3;
+        else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+            opt.bandwidth = atof(argv[++i]) * 1e6;
+        else if(argv[i][0] != '-' && !opt.filter)
+            opt.filter = argv[i];
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if(libssh2_init(0)) {
+        fprintf(stderr, "libssh2_init failed\n");
+        return 1;
+    }
+
+    if(!opt.json)
+        printf("%-7s %-52s %-6s %6s %9s %12s %8s\n", "bench", "method",
+               "op", "size", "MB/s", "ns/op", "allocs");
+
+    /* ciphers with the first MAC, or the one they bring along */
+    for(mac = _libssh2_mac_methods(); *mac && (*mac)->name; mac++) {
+        if(strcmp((*mac)->name, "none")) {
+            default_mac = *mac;
+            break;
+        }
+    }
+    for(crypt = libssh2_crypt_methods(); *crypt && (*crypt)->name;
+        crypt++) {
+        const LIBSSH2_MAC_METHOD *m = _libssh2_mac_override(*crypt);
+        if(!selected((*crypt)->name))
+            continue;
+        if(bench_packets(*crypt, m ? m : default_mac))
+            rc = 1;
+    }
+
+    /* MACs on their own, and behind the first plain cipher */
+    for(mac = _libssh2_mac_methods(); *mac && (*mac)->name; mac++) {
+        if(!selected((*mac)->name) || !strcmp((*mac)->name, "none"))
+            continue;
+        if(bench_mac(*mac))
+            rc = 1;
+        for(crypt = libssh2_crypt_methods(); *crypt && (*crypt)->name;
+            crypt++) {
+            if(!((*crypt)->flags & (LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC |
+                                    LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET))
+               && !_libssh2_mac_override(*crypt)) {
+                if(*mac != default_mac && bench_packets(*crypt, *mac))
+                    rc = 1;
+                break;
+            }
+        }
+    }
+
+    /* whole sessions, every cipher with the first MAC */
+    for(crypt = libssh2_crypt_methods(); *crypt && (*crypt)->name;
+        crypt++) {
+        const char *m = NULL;
+        if(!selected((*crypt)->name) || !strcmp((*crypt)->name, "none"))
+            continue;
+        if(!((*crypt)->flags & (LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC |
+                                LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET)))
+            m = default_mac->name;
+        if(bench_session((*crypt)->name, m))
+            rc = 1;
+    }
+
+    /* key exchanges */
+    session = libssh2_session_init_ex(bench_alloc, bench_free,
+                                      bench_realloc, NULL);
+    if(session) {
+        n = libssh2_session_supported_algs(session, LIBSSH2_METHOD_KEX,
+                                           &algs);
+        for(i = 0; i < n; i++) {
+            if(!selected(algs[i]))
+                continue;
+            if(bench_kex(session, algs[i]) < 0) {
+                fprintf(stderr, "%s: key exchange failed\n", algs[i]);
+                rc = 1;
+            }
+        }
+        if(algs)
+            libssh2_free(session, (void *)algs);
+        libssh2_session_free(session);
+    }
+
+    free(wire.buf);
+    libssh2_exit();
+
+    return rc;
+}
@@ -0,0 +1,1710 @@
+/*
+ * In-process stand-in for an SSH server, see loopback.h.
+ *
+ * The server side reuses the library's cipher and MAC methods and its
+ * X25519 and Ed25519 code, but has a transport of its own: it always has
+ * whole packets in front of it, so it can en/decrypt each one in a single
+ * pass.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "libssh2_priv.h"
+#include "mac.h"
+#include "ed25519.h"
+#include "loopback.h"
+
+#include <libssh2_sftp.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define LB_BANNER       "SSH-2.0-libssh2_loopback"
+#define LB_KEX          "curve25519-sha256,curve25519-sha256@libssh.org"
+#define LB_HOSTKEY      "ssh-ed25519"
+#define LB_CHANNELS     8
+#define LB_HANDLES      16
+#define LB_CHUNK        32768   /* most data the server puts in a packet */
+#define LB_SFTP_READ    65536   /* most data in an SFTP read reply */
+#define LB_SFTP_MAXLEN  (256 * 1024)    /* largest SFTP request */
+#define LB_SNDBUF_MIN   (2 * LIBSSH2_PACKET_MAXPAYLOAD)
+
+/* the part of SFTP version 3 the server speaks */
+#define SSH_FXP_INIT        1
+#define SSH_FXP_VERSION     2
+#define SSH_FXP_OPEN        3
+#define SSH_FXP_CLOSE       4
+#define SSH_FXP_READ        5
+#define SSH_FXP_WRITE       6
+#define SSH_FXP_LSTAT       7
+#define SSH_FXP_FSTAT       8
+#define SSH_FXP_REALPATH    16
+#define SSH_FXP_STAT        17
+#define SSH_FXP_STATUS      101
+#define SSH_FXP_HANDLE      102
+#define SSH_FXP_DATA        103
+#define SSH_FXP_NAME        104
+#define SSH_FXP_ATTRS       105
+
+struct lb_buf {
+    unsigned char *data;
+    size_t pos;         /* first byte not used yet */
+    size_t len;
+    size_t size;
+};
+
+/* the bytes written up to 'end' arrive at 'due' */
+struct lb_mark {
+    size_t end;
+    double due;
+};
+
+/* one direction of the link */
+struct lb_pipe {
+    struct lb_buf buf;
+    size_t ready;           /* the bytes up to here have arrived */
+    struct lb_mark *marks;  /* the ones still on their way */
+    size_t first;
+    size_t nmarks;
+    size_t marks_size;
+    double busy_until;      /* the link is busy sending until then */
+};
+
+/* one direction of the server's transport */
+struct lb_keys {
+    const LIBSSH2_CRYPT_METHOD *crypt;
+    void *crypt_abstract;
+    const LIBSSH2_MAC_METHOD *mac;
+    void *mac_abstract;
+    uint32_t seqno;
+};
+
+enum {
+    LB_FREE = 0,
+    LB_OPEN,            /* no command yet */
+    LB_SINK,
+    LB_SOURCE,
+    LB_ECHO,
+    LB_SFTP
+};
+
+struct lb_channel {
+    int mode;
+    uint32_t id;                /* the client's number for it */
+    uint32_t window;            /* what the client may still send */
+    uint32_t consumed;          /* taken in since the last adjust */
+    uint32_t peer_window;       /* what the server may still send */
+    uint32_t peer_max_packet;
+    libssh2_uint64_t source;    /* bytes "source" has left to write */
+    struct lb_buf in;           /* SFTP requests not complete yet */
+    struct lb_buf out;          /* data waiting for window */
+    int eof;                    /* the client sent EOF */
+    int closed;                 /* the server sent CLOSE */
+};
+
+enum {
+    LB_STATE_BANNER = 0,
+    LB_STATE_RUN,
+    LB_STATE_FAILED
+};
+
+struct loopback {
+    struct loopback_config config;
+    LIBSSH2_SESSION *ctx;       /* for the server's crypto methods */
+    libssh2_socket_t fds[2];
+    double skew;                /* virtual clock minus the real one */
+    int state;
+
+    struct lb_pipe up;          /* client to server */
+    struct lb_pipe down;        /* server to client */
+
+    char *crypt_list;
+    char *mac_list;
+
+    /* key exchange */
+    char *client_banner;
+    unsigned char *client_kexinit;
+    size_t client_kexinit_len;
+    unsigned char *kexinit;
+    size_t kexinit_len;
+    int skip_guess;             /* the client guessed wrong */
+    unsigned char session_id[SHA256_DIGEST_LENGTH];
+    int have_session_id;
+    unsigned char host_seed[ED25519_SEEDLEN];
+    unsigned char host_pub[ED25519_PUBLICKEYLEN];
+
+    struct lb_keys in;
+    struct lb_keys out;
+    struct lb_keys next_in;     /* in use after the client's NEWKEYS */
+    struct lb_keys next_out;    /* in use after the server's NEWKEYS */
+    uint32_t rx_len;            /* length of a packet whose first block has
+                                   been decrypted already, or 0 */
+
+    unsigned char *msg;         /* payload being put together */
+    struct lb_buf pkt;          /* packet being put together */
+
+    struct lb_channel channels[LB_CHANNELS];
+    unsigned char handles[LB_HANDLES];
+    libssh2_uint64_t received;
+};
+
+static unsigned char lb_pattern[LB_SFTP_READ];
+
+static double
+lb_mono(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+double
+loopback_now(struct loopback *lb)
+{
+    return lb_mono() + lb->skew;
+}
+
+static int
+buf_reserve(struct lb_buf *b, size_t more)
+{
+    unsigned char *data;
+    size_t size;
+
+    if(b->len + more <= b->size)
+        return 0;
+
+    /* make room at the front first */
+    if(b->pos) {
+        memmove(b->data, b->data + b->pos, b->len - b->pos);
+        b->len -= b->pos;
+        b->pos = 0;
+        if(b->len + more <= b->size)
+            return 0;
+    }
+
+    size = LIBSSH2_MAX(b->size * 2, b->len + more);
+    data = realloc(b->data, size);
+    if(!data)
+        return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+static int
+buf_add(struct lb_buf *b, const void *data, size_t len)
+{
+    if(buf_reserve(b, len))
+        return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void
+buf_consume(struct lb_buf *b, size_t len)
+{
+    b->pos += len;
+    if(b->pos == b->len)
+        b->pos = b->len = 0;
+}
+
+static void
+buf_free(struct lb_buf *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* bytes written and not taken out at the other end yet */
+static size_t
+pipe_pending(struct lb_pipe *p)
+{
+    return p->buf.len - p->buf.pos;
+}
+
+static int
+pipe_write(struct loopback *lb, struct lb_pipe *p, const void *data,
+           size_t len)
+{
+    size_t pos = p->buf.pos;
+    double now = loopback_now(lb);
+    double due;
+    size_t i;
+
+    if(buf_add(&p->buf, data, len))
+        return -1;
+
+    /* the buffer may have been compacted */
+    if(pos != p->buf.pos) {
+        p->ready -= pos;
+        for(i = p->first; i < p->nmarks; i++)
+            p->marks[i].end -= pos;
+    }
+
+    if(p->busy_until < now)
+        p->busy_until = now;
+    if(lb->config.bandwidth > 0)
+        p->busy_until += (double)len / lb->config.bandwidth;
+    due = p->busy_until + lb->config.latency;
+
+    if(p->first == p->nmarks && due <= now) {
+        p->first = p->nmarks = 0;
+        p->ready = p->buf.len;
+        return 0;
+    }
+
+    if(p->nmarks == p->marks_size) {
+        if(p->first) {
+            memmove(p->marks, p->marks + p->first,
+                    (p->nmarks - p->first) * sizeof(*p->marks));
+            p->nmarks -= p->first;
+            p->first = 0;
+        }
+        else {
+            size_t size = p->marks_size ? p->marks_size * 2 : 64;
+            struct lb_mark *marks = realloc(p->marks,
+                                            size * sizeof(*marks));
+            if(!marks)
+                return -1;
+            p->marks = marks;
+            p->marks_size = size;
+        }
+    }
+    p->marks[p->nmarks].end = p->buf.len;
+    p->marks[p->nmarks].due = due;
+    p->nmarks++;
+    return 0;
+}
+
+/* moves 'ready' past what has arrived by now */
+static void
+pipe_update(struct loopback *lb, struct lb_pipe *p)
+{
+    double now;
+
+    if(p->first == p->nmarks)
+        return;
+
+    now = loopback_now(lb);
+    while(p->first < p->nmarks && p->marks[p->first].due <= now)
+        p->ready = p->marks[p->first++].end;
+    if(p->first == p->nmarks)
+        p->first = p->nmarks = 0;
+}
+
+static void
+pipe_consume(struct lb_pipe *p, size_t len)
+{
+    p->buf.pos += len;
+    if(p->buf.pos == p->buf.len && p->first == p->nmarks) {
+        p->buf.pos = p->buf.len = 0;
+        p->ready = 0;
+    }
+}
+
+static void
+pipe_free(struct lb_pipe *p)
+{
+    buf_free(&p->buf);
+    free(p->marks);
+    memset(p, 0, sizeof(*p));
+}
+
+static void
+keys_free(struct loopback *lb, struct lb_keys *k)
+{
+    if(k->crypt && k->crypt->dtor)
+        k->crypt->dtor(lb->ctx, &k->crypt_abstract);
+    if(k->mac && k->mac->dtor)
+        k->mac->dtor(lb->ctx, &k->mac_abstract);
+    memset(k, 0, sizeof(*k));
+}
+
+/* puts the keys agreed on in use, the sequence numbers carry on */
+static void
+keys_switch(struct loopback *lb, struct lb_keys *k, struct lb_keys *next)
+{
+    uint32_t seqno = k->seqno;
+
+    keys_free(lb, k);
+    *k = *next;
+    k->seqno = seqno;
+    memset(next, 0, sizeof(*next));
+}
+
+/*
+ * The packet layer
+ */
+
+static size_t
+keys_tag_len(const struct lb_keys *k)
+{
+    if(!k->crypt)
+        return 0;
+    if(k->crypt->flags & (LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC |
+                          LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET))
+        return k->crypt->auth_len;
+    return k->mac->mac_len;
+}
+
+/* sends a packet of 'data' followed by 'data2' */
+static int
+lb_send2(struct loopback *lb, const unsigned char *data, size_t data_len,
+         const unsigned char *data2, size_t data2_len)
+{
+    struct lb_keys *k = &lb->out;
+    const LIBSSH2_CRYPT_METHOD *crypt = k->crypt;
+    int etm = k->mac ? k->mac->etm : 0;
+    size_t blocksize = crypt ? LIBSSH2_MAX(crypt->blocksize, 8) : 8;
+    size_t tag_len = keys_tag_len(k);
+    size_t offset, packet_len, padding;
+    unsigned char *p;
+    int rc = 0;
+
+    /* the length field takes no part in the padding when it is not
+       encrypted with the rest */
+    offset = (crypt && (etm || (crypt->flags &
+                                (LIBSSH2_CRYPT_FLAG_PKTLEN_AAD |
+                                 LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET))))
+             ? 4 : 0;
+    packet_len = 4 + 1 + data_len + data2_len;
+    padding = blocksize - (packet_len - offset) % blocksize;
+    if(padding < 4)
+        padding += blocksize;
+    packet_len += padding;
+
+    lb->pkt.pos = lb->pkt.len = 0;
+    if(buf_reserve(&lb->pkt, packet_len + tag_len))
+        return -1;
+    p = lb->pkt.data;
+    _libssh2_htonu32(p, (uint32_t)(packet_len - 4));
+    p[4] = (unsigned char)padding;
+    memcpy(p + 5, data, data_len);
+    if(data2_len)
+        memcpy(p + 5 + data_len, data2, data2_len);
+    memset(p + 5 + data_len + data2_len, 0, padding);
+
+    if(!crypt)
+        ;
+    else if(crypt->flags & LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET)
+        rc = crypt->crypt(lb->ctx, k->seqno, p, packet_len,
+                          &k->crypt_abstract, 0);
+    else if(crypt->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC)
+        rc = crypt->crypt(lb->ctx, 0, p, packet_len + tag_len,
+                          &k->crypt_abstract, FIRST_BLOCK | LAST_BLOCK);
+    else if(etm)
+        rc = crypt->crypt(lb->ctx, 0, p + 4, packet_len - 4,
+                          &k->crypt_abstract, FIRST_BLOCK | LAST_BLOCK) ||
+             k->mac->hash(lb->ctx, p + packet_len, k->seqno, p, packet_len,
+                          NULL, 0, &k->mac_abstract);
+    else
+        rc = k->mac->hash(lb->ctx, p + packet_len, k->seqno, p, packet_len,
+                          NULL, 0, &k->mac_abstract) ||
+             crypt->crypt(lb->ctx, 0, p, packet_len, &k->crypt_abstract,
+                          FIRST_BLOCK | LAST_BLOCK);
+    if(rc)
+        return -1;
+
+    k->seqno++;
+    return pipe_write(lb, &lb->down, p, packet_len + tag_len);
+}
+
+static int
+lb_send(struct loopback *lb, const unsigned char *data, size_t len)
+{
+    return lb_send2(lb, data, len, NULL, 0);
+}
+
+/*
+ * Takes the next packet off the bytes that have arrived from the client.
+ * Returns 1 and its payload if there is one, 0 if it has not arrived in
+ * full yet and -1 on error. The payload stays valid until the client
+ * sends again.
+ */
+static int
+lb_recv(struct loopback *lb, unsigned char **payload, size_t *payload_len)
+{
+    struct lb_keys *k = &lb->in;
+    const LIBSSH2_CRYPT_METHOD *crypt = k->crypt;
+    unsigned char *p = lb->up.buf.data + lb->up.buf.pos;
+    size_t avail = lb->up.ready - lb->up.buf.pos;
+    size_t tag_len = keys_tag_len(k);
+    int etm = k->mac ? k->mac->etm : 0;
+    unsigned char macbuf[MAX_MACSIZE];
+    unsigned char *body = p + 4;
+    uint32_t packet_len;
+    size_t total;
+
+    if(!crypt || etm || (crypt->flags & LIBSSH2_CRYPT_FLAG_PKTLEN_AAD)) {
+        if(avail < 4)
+            return 0;
+        packet_len = _libssh2_ntohu32(p);
+    }
+    else if(crypt->get_len) {
+        unsigned int len;
+
+        if(avail < 4)
+            return 0;
+        if(crypt->get_len(lb->ctx, k->seqno, p, avail, &len,
+                          &k->crypt_abstract))
+            return -1;
+        packet_len = len;
+    }
+    else {
+        /* the length is in the first cipher block, which is decrypted in
+           place once */
+        if(!lb->rx_len) {
+            if(avail < (size_t)crypt->blocksize)
+                return 0;
+            if(crypt->crypt(lb->ctx, 0, p, crypt->blocksize,
+                            &k->crypt_abstract, FIRST_BLOCK))
+                return -1;
+            lb->rx_len = _libssh2_ntohu32(p);
+            if(!lb->rx_len)
+                return -1;
+        }
+        packet_len = lb->rx_len;
+    }
+
+    if(packet_len < 5 || packet_len > LIBSSH2_PACKET_MAXPAYLOAD)
+        return -1;
+    total = 4 + packet_len + tag_len;
+    if(avail < total)
+        return 0;
+    lb->rx_len = 0;
+
+    if(!crypt)
+        ;
+    else if(crypt->flags & LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET) {
+        /* this leaves the plain packet at the start, without length */
+        if(crypt->crypt(lb->ctx, k->seqno, p, packet_len,
+                        &k->crypt_abstract, 0))
+            return -1;
+        body = p;
+    }
+    else if(crypt->flags & LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC) {
+        if(crypt->crypt(lb->ctx, 0, p, total, &k->crypt_abstract,
+                        FIRST_BLOCK | LAST_BLOCK))
+            return -1;
+    }
+    else if(etm) {
+        if(k->mac->hash(lb->ctx, macbuf, k->seqno, p, 4 + packet_len,
+                        NULL, 0, &k->mac_abstract) ||
+           memcmp(macbuf, p + 4 + packet_len, tag_len) ||
+           crypt->crypt(lb->ctx, 0, p + 4, packet_len, &k->crypt_abstract,
+                        FIRST_BLOCK | LAST_BLOCK))
+            return -1;
+    }
+    else {
+        size_t done = crypt->blocksize;
+
+        if(4 + packet_len > done &&
+           crypt->crypt(lb->ctx, 0, p + done, 4 + packet_len - done,
+                        &k->crypt_abstract, LAST_BLOCK))
+            return -1;
+        if(k->mac->hash(lb->ctx, macbuf, k->seqno, p, 4 + packet_len,
+                        NULL, 0, &k->mac_abstract) ||
+           memcmp(macbuf, p + 4 + packet_len, tag_len))
+            return -1;
+    }
+
+    if(body[0] >= packet_len)
+        return -1;
+    *payload = body + 1;
+    *payload_len = packet_len - 1 - body[0];
+
+    k->seqno++;
+    pipe_consume(&lb->up, total);
+    return 1;
+}
+
+/*
+ * Key exchange
+ */
+
+/* the first name on the client's list that is also on the server's */
+static int
+lb_agree(const unsigned char *client, size_t client_len,
+         const char *server, char *name, size_t name_size)
+{
+    const unsigned char *end = client + client_len;
+
+    while(client < end) {
+        const unsigned char *comma = memchr(client, ',', end - client);
+        size_t len = (comma ? comma : end) - client;
+
+        if(len < name_size &&
+           _libssh2_kex_agree_instr((unsigned char *)server,
+                                    strlen(server), client, len)) {
+            memcpy(name, client, len);
+            name[len] = '\0';
+            return 0;
+        }
+        client += len + 1;
+    }
+
+    return -1;
+}
+
+static int
+lb_first_is(const unsigned char *list, size_t len, const char *name)
+{
+    size_t n = strlen(name);
+
+    return len >= n && !memcmp(list, name, n) &&
+           (len == n || list[n] == ',');
+}
+
+static const LIBSSH2_CRYPT_METHOD *
+lb_crypt(const char *name)
+{
+    const LIBSSH2_CRYPT_METHOD **m;
+
+    for(m = libssh2_crypt_methods(); *m && (*m)->name; m++) {
+        if(!strcmp((*m)->name, name))
+            return *m;
+    }
+    return NULL;
+}
+
+static const LIBSSH2_MAC_METHOD *
+lb_mac(const char *name)
+{
+    const LIBSSH2_MAC_METHOD **m;
+
+    for(m = _libssh2_mac_methods(); *m && (*m)->name; m++) {
+        if(!strcmp((*m)->name, name))
+            return *m;
+    }
+    return NULL;
+}
+
+/* picks the cipher and MAC of one direction */
+static int
+lb_agree_keys(struct loopback *lb, struct lb_keys *k,
+              const unsigned char *crypts, size_t crypts_len,
+              const unsigned char *macs, size_t macs_len)
+{
+    char name[64];
+
+    if(lb_agree(crypts, crypts_len, lb->crypt_list, name, sizeof(name)))
+        return -1;
+    k->crypt = lb_crypt(name);
+    if(!k->crypt)
+        return -1;
+
+    /* the AEAD ciphers authenticate on their own */
+    if(k->crypt->flags & (LIBSSH2_CRYPT_FLAG_INTEGRATED_MAC |
+                          LIBSSH2_CRYPT_FLAG_REQUIRES_FULL_PACKET)) {
+        k->mac = NULL;
+        return 0;
+    }
+    if(lb_agree(macs, macs_len, lb->mac_list, name, sizeof(name)))
+        return -1;
+    k->mac = lb_mac(name);
+    return k->mac ? 0 : -1;
+}
+
+static int
+lb_kexinit(struct loopback *lb, unsigned char *data, size_t len)
+{
+    struct string_buf buf;
+    unsigned char *list[10];
+    size_t list_len[10];
+    unsigned char follows;
+    char name[64];
+    int i;
+
+    buf.data = data;
+    buf.dataptr = data + 1 + 16;    /* message number and cookie */
+    buf.len = len;
+    if(len < 17)
+        return -1;
+    for(i = 0; i < 10; i++) {
+        if(_libssh2_get_string(&buf, &list[i], &list_len[i]))
+            return -1;
+    }
+    if(_libssh2_get_boolean(&buf, &follows))
+        return -1;
+
+    if(lb_agree(list[0], list_len[0], LB_KEX, name, sizeof(name)) ||
+       lb_agree(list[1], list_len[1], LB_HOSTKEY, name, sizeof(name)) ||
+       lb_agree(list[6], list_len[6], "none", name, sizeof(name)) ||
+       lb_agree(list[7], list_len[7], "none", name, sizeof(name)))
+        return -1;
+
+    keys_free(lb, &lb->next_in);
+    keys_free(lb, &lb->next_out);
+    if(lb_agree_keys(lb, &lb->next_in, list[2], list_len[2],
+                     list[4], list_len[4]) ||
+       lb_agree_keys(lb, &lb->next_out, list[3], list_len[3],
+                     list[5], list_len[5]))
+        return -1;
+
+    /* a guessed key exchange packet is dropped unless both guesses are
+       what was agreed */
+    lb->skip_guess = follows &&
+        !((lb_first_is(list[0], list_len[0], "curve25519-sha256") ||
+           lb_first_is(list[0], list_len[0],
+                       "curve25519-sha256@libssh.org")) &&
+          lb_first_is(list[1], list_len[1], LB_HOSTKEY));
+
+    free(lb->client_kexinit);
+    lb->client_kexinit = malloc(len);
+    if(!lb->client_kexinit)
+        return -1;
+    memcpy(lb->client_kexinit, data, len);
+    lb->client_kexinit_len = len;
+    return 0;
+}
+
+static int
+lb_send_kexinit(struct loopback *lb)
+{
+    const char *lists[10];
+    size_t len = 1 + 16 + 5;
+    unsigned char *s;
+    int i;
+
+    lists[0] = LB_KEX;
+    lists[1] = LB_HOSTKEY;
+    lists[2] = lists[3] = lb->crypt_list;
+    lists[4] = lists[5] = lb->mac_list;
+    lists[6] = lists[7] = "none";
+    lists[8] = lists[9] = "";
+    for(i = 0; i < 10; i++)
+        len += 4 + strlen(lists[i]);
+
+    free(lb->kexinit);
+    lb->kexinit = malloc(len);
+    if(!lb->kexinit)
+        return -1;
+    s = lb->kexinit;
+    *s++ = SSH_MSG_KEXINIT;
+    if(_libssh2_random(s, 16))
+        return -1;
+    s += 16;
+    for(i = 0; i < 10; i++)
+        _libssh2_store_str(&s, lists[i], strlen(lists[i]));
+    *s++ = 0;                       /* first_kex_packet_follows */
+    _libssh2_store_u32(&s, 0);      /* reserved */
+    lb->kexinit_len = len;
+
+    return lb_send(lb, lb->kexinit, len);
+}
+
+/* K_n = HASH(K || H || X || session_id), extended with HASH(K || H || ..) */
+static unsigned char *
+lb_derive(struct loopback *lb, const unsigned char *k, size_t k_len,
+          const unsigned char *h, char letter, size_t need)
+{
+    unsigned char *key;
+    size_t have = 0;
+
+    key = LIBSSH2_ALLOC(lb->ctx, LIBSSH2_MAX(need, 1) +
+                        SHA256_DIGEST_LENGTH);
+    if(!key)
+        return NULL;
+
+    while(have < need) {
+        libssh2_sha256_ctx ctx;
+        int ok;
+
+        if(!libssh2_sha256_init(&ctx)) {
+            LIBSSH2_FREE(lb->ctx, key);
+            return NULL;
+        }
+        ok = libssh2_sha256_update(ctx, k, k_len) &&
+             libssh2_sha256_update(ctx, h, SHA256_DIGEST_LENGTH);
+        if(have)
+            ok = ok && libssh2_sha256_update(ctx, key, have);
+        else
+            ok = ok && libssh2_sha256_update(ctx, &letter, 1) &&
+                 libssh2_sha256_update(ctx, lb->session_id,
+                                       SHA256_DIGEST_LENGTH);
+        if(!libssh2_sha256_final(ctx, key + have) || !ok) {
+            LIBSSH2_FREE(lb->ctx, key);
+            return NULL;
+        }
+        have += SHA256_DIGEST_LENGTH;
+    }
+
+    return key;
+}
+
+static int
+lb_keys_init(struct loopback *lb, struct lb_keys *keys, int encrypt,
+             const unsigned char *k, size_t k_len, const unsigned char *h,
+             char iv_letter, char key_letter, char mac_letter)
+{
+    const LIBSSH2_CRYPT_METHOD *crypt = keys->crypt;
+    unsigned char *iv, *secret, *mac_key;
+    int free_iv = 0, free_secret = 0, free_mac_key = 0;
+    int rc;
+
+    iv = lb_derive(lb, k, k_len, h, iv_letter,
+                   crypt->iv_len > 0 ? crypt->iv_len : 0);
+    secret = lb_derive(lb, k, k_len, h, key_letter, crypt->secret_len);
+    if(!iv || !secret) {
+        if(iv)
+            LIBSSH2_FREE(lb->ctx, iv);
+        if(secret)
+            LIBSSH2_FREE(lb->ctx, secret);
+        return -1;
+    }
+    rc = crypt->init(lb->ctx, crypt, iv, &free_iv, secret, &free_secret,
+                     encrypt, &keys->crypt_abstract);
+    if(rc || free_iv)
+        LIBSSH2_FREE(lb->ctx, iv);
+    if(rc || free_secret)
+        LIBSSH2_FREE(lb->ctx, secret);
+    if(rc) {
+        keys->crypt = NULL;
+        return -1;
+    }
+
+    if(!keys->mac)
+        return 0;
+    mac_key = lb_derive(lb, k, k_len, h, mac_letter, keys->mac->key_len);
+    if(!mac_key)
+        return -1;
+    rc = keys->mac->init(lb->ctx, mac_key, &free_mac_key,
+                         &keys->mac_abstract);
+    if(rc || free_mac_key)
+        LIBSSH2_FREE(lb->ctx, mac_key);
+    return rc ? -1 : 0;
+}
+
+static void
+lb_store_mpint(unsigned char **s, const unsigned char *n, size_t len)
+{
+    while(len && !*n) {
+        n++;
+        len--;
+    }
+    if(len && (*n & 0x80)) {
+        _libssh2_store_u32(s, (uint32_t)(len + 1));
+        *(*s)++ = 0;
+        memcpy(*s, n, len);
+        *s += len;
+    }
+    else
+        _libssh2_store_str(s, (const char *)n, len);
+}
+
+static int
+lb_ecdh(struct loopback *lb, struct string_buf *req)
+{
+    unsigned char secret[CURVE25519_KEYLEN];
+    unsigned char q_s[CURVE25519_KEYLEN];
+    unsigned char shared[CURVE25519_KEYLEN];
+    unsigned char k[5 + CURVE25519_KEYLEN];
+    unsigned char h[SHA256_DIGEST_LENGTH];
+    unsigned char sig[ED25519_SIGLEN];
+    unsigned char hostkey[4 + 11 + 4 + ED25519_PUBLICKEYLEN];
+    unsigned char sigblob[4 + 11 + 4 + ED25519_SIGLEN];
+    unsigned char *q_c, *data, *s;
+    size_t q_c_len, k_len, len;
+    int rc;
+
+    if(!lb->client_kexinit ||
+       _libssh2_get_string(req, &q_c, &q_c_len) ||
+       q_c_len != CURVE25519_KEYLEN)
+        return -1;
+
+    if(_libssh2_random(secret, sizeof(secret)))
+        return -1;
+    x25519_scalarmult_base(q_s, secret);
+    rc = x25519_scalarmult(shared, secret, q_c);
+    _libssh2_explicit_zero(secret, sizeof(secret));
+    if(rc)
+        return -1;
+
+    s = k;
+    lb_store_mpint(&s, shared, sizeof(shared));
+    k_len = s - k;
+    _libssh2_explicit_zero(shared, sizeof(shared));
+
+    s = hostkey;
+    _libssh2_store_str(&s, LB_HOSTKEY, 11);
+    _libssh2_store_str(&s, (const char *)lb->host_pub,
+                       ED25519_PUBLICKEYLEN);
+
+    /* H = HASH(V_C || V_S || I_C || I_S || K_S || Q_C || Q_S || K) */
+    len = 4 + strlen(lb->client_banner) + 4 + strlen(LB_BANNER) +
+          4 + lb->client_kexinit_len + 4 + lb->kexinit_len +
+          4 + sizeof(hostkey) + 4 + q_c_len + 4 + sizeof(q_s) + k_len;
+    data = malloc(len);
+    if(!data)
+        return -1;
+    s = data;
+    _libssh2_store_str(&s, lb->client_banner, strlen(lb->client_banner));
+    _libssh2_store_str(&s, LB_BANNER, strlen(LB_BANNER));
+    _libssh2_store_str(&s, (const char *)lb->client_kexinit,
+                       lb->client_kexinit_len);
+    _libssh2_store_str(&s, (const char *)lb->kexinit, lb->kexinit_len);
+    _libssh2_store_str(&s, (const char *)hostkey, sizeof(hostkey));
+    _libssh2_store_str(&s, (const char *)q_c, q_c_len);
+    _libssh2_store_str(&s, (const char *)q_s, sizeof(q_s));
+    memcpy(s, k, k_len);
+    rc = libssh2_sha256(data, len, h);
+    free(data);
+    if(rc)
+        return -1;
+
+    if(!lb->have_session_id) {
+        memcpy(lb->session_id, h, sizeof(h));
+        lb->have_session_id = 1;
+    }
+
+    if(ed25519_sign(sig, h, sizeof(h), lb->host_seed, lb->host_pub))
+        return -1;
+    s = sigblob;
+    _libssh2_store_str(&s, LB_HOSTKEY, 11);
+    _libssh2_store_str(&s, (const char *)sig, sizeof(sig));
+
+    s = lb->msg;
+    *s++ = SSH2_MSG_KEX_ECDH_REPLY;
+    _libssh2_store_str(&s, (const char *)hostkey, sizeof(hostkey));
+    _libssh2_store_str(&s, (const char *)q_s, sizeof(q_s));
+    _libssh2_store_str(&s, (const char *)sigblob, sizeof(sigblob));
+    if(lb_send(lb, lb->msg, s - lb->msg))
+        return -1;
+
+    if(lb_keys_init(lb, &lb->next_in, 0, k, k_len, h, 'A', 'C', 'E') ||
+       lb_keys_init(lb, &lb->next_out, 1, k, k_len, h, 'B', 'D', 'F'))
+        return -1;
+    _libssh2_explicit_zero(k, sizeof(k));
+
+    /* NEWKEYS is the last packet with the old keys */
+    lb->msg[0] = SSH_MSG_NEWKEYS;
+    if(lb_send(lb, lb->msg, 1))
+        return -1;
+    keys_switch(lb, &lb->out, &lb->next_out);
+    return 0;
+}
+
+/*
+ * Authentication: any password or public key will do
+ */
+
+static int
+lb_userauth(struct loopback *lb, struct string_buf *req)
+{
+    unsigned char *user, *service, *method, *alg, *blob;
+    size_t user_len, service_len, method_len, alg_len, blob_len;
+    unsigned char has_sig;
+    unsigned char *s = lb->msg;
+
+    if(_libssh2_get_string(req, &user, &user_len) ||
+       _libssh2_get_string(req, &service, &service_len) ||
+       _libssh2_get_string(req, &method, &method_len))
+        return -1;
+
+    if(method_len == 8 && !memcmp(method, "password", 8)) {
+        *s++ = SSH_MSG_USERAUTH_SUCCESS;
+    }
+    else if(method_len == 9 && !memcmp(method, "publickey", 9)) {
+        if(_libssh2_get_boolean(req, &has_sig) ||
+           _libssh2_get_string(req, &alg, &alg_len) ||
+           _libssh2_get_string(req, &blob, &blob_len))
+            return -1;
+        if(has_sig) {
+            /* the signature is not checked */
+            *s++ = SSH_MSG_USERAUTH_SUCCESS;
+        }
+        else {
+            *s++ = SSH_MSG_USERAUTH_PK_OK;
+            _libssh2_store_str(&s, (const char *)alg, alg_len);
+            _libssh2_store_str(&s, (const char *)blob, blob_len);
+        }
+    }
+    else {
+        *s++ = SSH_MSG_USERAUTH_FAILURE;
+        _libssh2_store_str(&s, "publickey,password", 18);
+        *s++ = 0;
+    }
+
+    return lb_send(lb, lb->msg, s - lb->msg);
+}
+
+/*
+ * Channels
+ */
+
+static struct lb_channel *
+lb_channel(struct loopback *lb, struct string_buf *req)
+{
+    uint32_t n;
+
+    if(_libssh2_get_u32(req, &n) || n >= LB_CHANNELS ||
+       lb->channels[n].mode == LB_FREE)
+        return NULL;
+    return &lb->channels[n];
+}
+
+/* a message with nothing but the channel number */
+static int
+lb_channel_msg(struct loopback *lb, struct lb_channel *ch, unsigned char type)
+{
+    lb->msg[0] = type;
+    _libssh2_htonu32(lb->msg + 1, ch->id);
+    return lb_send(lb, lb->msg, 5);
+}
+
+static int
+lb_channel_open(struct loopback *lb, struct string_buf *req)
+{
+    unsigned char *type;
+    size_t type_len;
+    uint32_t id, window, max_packet;
+    unsigned char *s = lb->msg;
+    uint32_t n;
+
+    if(_libssh2_get_string(req, &type, &type_len) ||
+       _libssh2_get_u32(req, &id) ||
+       _libssh2_get_u32(req, &window) ||
+       _libssh2_get_u32(req, &max_packet))
+        return -1;
+
+    for(n = 0; n < LB_CHANNELS && lb->channels[n].mode != LB_FREE; n++)
+        ;
+    if(n == LB_CHANNELS || type_len != 7 || memcmp(type, "session", 7)) {
+        *s++ = SSH_MSG_CHANNEL_OPEN_FAILURE;
+        _libssh2_store_u32(&s, id);
+        _libssh2_store_u32(&s, n == LB_CHANNELS ?
+                           SSH_OPEN_RESOURCE_SHORTAGE :
+                           SSH_OPEN_UNKNOWN_CHANNELTYPE);
+        _libssh2_store_str(&s, "", 0);
+        _libssh2_store_str(&s, "", 0);
+    }
+    else {
+        struct lb_channel *ch = &lb->channels[n];
+
+        memset(ch, 0, sizeof(*ch));
+        ch->mode = LB_OPEN;
+        ch->id = id;
+        ch->window = lb->config.window;
+        ch->peer_window = window;
+        ch->peer_max_packet = max_packet;
+
+        *s++ = SSH_MSG_CHANNEL_OPEN_CONFIRMATION;
+        _libssh2_store_u32(&s, id);
+        _libssh2_store_u32(&s, n);
+        _libssh2_store_u32(&s, lb->config.window);
+        _libssh2_store_u32(&s, lb->config.max_packet);
+    }
+
+    return lb_send(lb, lb->msg, s - lb->msg);
+}
+
+static int
+lb_channel_request(struct loopback *lb, struct string_buf *req)
+{
+    struct lb_channel *ch = lb_channel(lb, req);
+    unsigned char *type, *arg;
+    size_t type_len, arg_len;
+    unsigned char want_reply;
+    int ok = 0;
+
+    if(!ch ||
+       _libssh2_get_string(req, &type, &type_len) ||
+       _libssh2_get_boolean(req, &want_reply))
+        return -1;
+
+    if(ch->mode != LB_OPEN)
+        ;
+    else if(type_len == 4 && !memcmp(type, "exec", 4)) {
+        if(_libssh2_get_string(req, &arg, &arg_len))
+            return -1;
+        if(arg_len == 4 && !memcmp(arg, "sink", 4)) {
+            ch->mode = LB_SINK;
+            ok = 1;
+        }
+        else if(arg_len == 4 && !memcmp(arg, "echo", 4)) {
+            ch->mode = LB_ECHO;
+            ok = 1;
+        }
+        else if(arg_len > 7 && arg_len < 40 && !memcmp(arg, "source ", 7)) {
+            char num[40];
+
+            memcpy(num, arg + 7, arg_len - 7);
+            num[arg_len - 7] = '\0';
+            ch->mode = LB_SOURCE;
+            ch->source = strtoull(num, NULL, 10);
+            ok = 1;
+        }
+    }
+    else if(type_len == 9 && !memcmp(type, "subsystem", 9)) {
+        if(_libssh2_get_string(req, &arg, &arg_len))
+            return -1;
+        if(arg_len == 4 && !memcmp(arg, "sftp", 4)) {
+            ch->mode = LB_SFTP;
+            ok = 1;
+        }
+    }
+    else if(type_len == 5 && !memcmp(type, "shell", 5)) {
+        ch->mode = LB_ECHO;
+        ok = 1;
+    }
+    else if((type_len == 7 && !memcmp(type, "pty-req", 7)) ||
+            (type_len == 3 && !memcmp(type, "env", 3))) {
+        ok = 1;
+    }
+
+    if(!want_reply)
+        return 0;
+    return lb_channel_msg(lb, ch, ok ? SSH_MSG_CHANNEL_SUCCESS :
+                          SSH_MSG_CHANNEL_FAILURE);
+}
+
+/* exit status, EOF and CLOSE, once */
+static int
+lb_channel_close(struct loopback *lb, struct lb_channel *ch)
+{
+    unsigned char *s = lb->msg;
+
+    if(ch->closed)
+        return 0;
+    ch->closed = 1;
+
+    if(ch->mode != LB_OPEN) {
+        *s++ = SSH_MSG_CHANNEL_REQUEST;
+        _libssh2_store_u32(&s, ch->id);
+        _libssh2_store_str(&s, "exit-status", 11);
+        *s++ = 0;
+        _libssh2_store_u32(&s, 0);
+        if(lb_send(lb, lb->msg, s - lb->msg) ||
+           lb_channel_msg(lb, ch, SSH_MSG_CHANNEL_EOF))
+            return -1;
+    }
+
+    return lb_channel_msg(lb, ch, SSH_MSG_CHANNEL_CLOSE);
+}
+
+/* appends an SFTP packet of 'len' bytes, 'data' is its start */
+static int
+lb_sftp_reply(struct lb_channel *ch, const unsigned char *data, size_t len,
+              size_t start_len)
+{
+    unsigned char n[4];
+
+    _libssh2_htonu32(n, (uint32_t)len);
+    return buf_add(&ch->out, n, 4) || buf_add(&ch->out, data, start_len);
+}
+
+static int
+lb_sftp_status(struct lb_channel *ch, uint32_t id, uint32_t code)
+{
+    unsigned char reply[1 + 4 + 4 + 4 + 4];
+    unsigned char *s = reply;
+
+    *s++ = SSH_FXP_STATUS;
+    _libssh2_store_u32(&s, id);
+    _libssh2_store_u32(&s, code);
+    _libssh2_store_str(&s, "", 0);
+    _libssh2_store_str(&s, "", 0);
+    return lb_sftp_reply(ch, reply, sizeof(reply), sizeof(reply));
+}
+
+static int
+lb_sftp_attrs(struct loopback *lb, struct lb_channel *ch, uint32_t id)
+{
+    unsigned char reply[1 + 4 + 4 + 8 + 4];
+    unsigned char *s = reply;
+
+    *s++ = SSH_FXP_ATTRS;
+    _libssh2_store_u32(&s, id);
+    _libssh2_store_u32(&s, LIBSSH2_SFTP_ATTR_SIZE |
+                       LIBSSH2_SFTP_ATTR_PERMISSIONS);
+    _libssh2_store_u64(&s, lb->config.file_size);
+    _libssh2_store_u32(&s, LIBSSH2_SFTP_S_IFREG | 0644);
+    return lb_sftp_reply(ch, reply, sizeof(reply), sizeof(reply));
+}
+
+static int
+lb_sftp_handle(struct loopback *lb, struct string_buf *req, uint32_t *n)
+{
+    unsigned char *handle;
+    size_t len;
+
+    if(_libssh2_get_string(req, &handle, &len) || len != 4)
+        return -1;
+    *n = _libssh2_ntohu32(handle);
+    return *n < LB_HANDLES && lb->handles[*n] ? 0 : -1;
+}
+
+static int
+lb_sftp_request(struct loopback *lb, struct lb_channel *ch,
+                unsigned char *data, size_t len)
+{
+    struct string_buf req;
+    unsigned char type;
+    uint32_t id, n;
+    unsigned char reply[64];
+    unsigned char *s = reply;
+    unsigned char *str;
+    size_t str_len;
+    libssh2_uint64_t offset;
+
+    req.data = req.dataptr = data;
+    req.len = len;
+    if(_libssh2_get_byte(&req, &type))
+        return -1;
+
+    if(type == SSH_FXP_INIT) {
+        *s++ = SSH_FXP_VERSION;
+        _libssh2_store_u32(&s, 3);
+        return lb_sftp_reply(ch, reply, s - reply, s - reply);
+    }
+
+    if(_libssh2_get_u32(&req, &id))
+        return -1;
+
+    switch(type) {
+    case SSH_FXP_OPEN:
+        for(n = 0; n < LB_HANDLES && lb->handles[n]; n++)
+            ;
+        if(n == LB_HANDLES)
+            return lb_sftp_status(ch, id, LIBSSH2_FX_FAILURE);
+        lb->handles[n] = 1;
+        *s++ = SSH_FXP_HANDLE;
+        _libssh2_store_u32(&s, id);
+        _libssh2_store_u32(&s, 4);
+        _libssh2_store_u32(&s, n);
+        return lb_sftp_reply(ch, reply, s - reply, s - reply);
+
+    case SSH_FXP_CLOSE:
+        if(lb_sftp_handle(lb, &req, &n))
+            return lb_sftp_status(ch, id, LIBSSH2_FX_FAILURE);
+        lb->handles[n] = 0;
+        return lb_sftp_status(ch, id, LIBSSH2_FX_OK);
+
+    case SSH_FXP_READ: {
+        uint32_t want;
+        size_t got;
+
+        if(lb_sftp_handle(lb, &req, &n) ||
+           _libssh2_get_u64(&req, &offset) ||
+           _libssh2_get_u32(&req, &want))
+            return lb_sftp_status(ch, id, LIBSSH2_FX_FAILURE);
+        if(offset >= lb->config.file_size)
+            return lb_sftp_status(ch, id, LIBSSH2_FX_EOF);
+        got = (size_t)LIBSSH2_MIN((libssh2_uint64_t)want,
+                                  lb->config.file_size - offset);
+        got = LIBSSH2_MIN(got, LB_SFTP_READ);
+        *s++ = SSH_FXP_DATA;
+        _libssh2_store_u32(&s, id);
+        _libssh2_store_u32(&s, (uint32_t)got);
+        return lb_sftp_reply(ch, reply, (s - reply) + got, s - reply) ||
+               buf_add(&ch->out, lb_pattern, got);
+    }
+
+    case SSH_FXP_WRITE:
+        if(lb_sftp_handle(lb, &req, &n) ||
+           _libssh2_get_u64(&req, &offset) ||
+           _libssh2_get_string(&req, &str, &str_len))
+            return lb_sftp_status(ch, id, LIBSSH2_FX_FAILURE);
+        lb->received += str_len;
+        return lb_sftp_status(ch, id, LIBSSH2_FX_OK);
+
+    case SSH_FXP_FSTAT:
+        if(lb_sftp_handle(lb, &req, &n))
+            return lb_sftp_status(ch, id, LIBSSH2_FX_FAILURE);
+        return lb_sftp_attrs(lb, ch, id);
+
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+        return lb_sftp_attrs(lb, ch, id);
+
+    case SSH_FXP_REALPATH:
+        *s++ = SSH_FXP_NAME;
+        _libssh2_store_u32(&s, id);
+        _libssh2_store_u32(&s, 1);
+        _libssh2_store_str(&s, "/", 1);
+        _libssh2_store_str(&s, "/", 1);
+        _libssh2_store_u32(&s, 0);
+        return lb_sftp_reply(ch, reply, s - reply, s - reply);
+    }
+
+    return lb_sftp_status(ch, id, LIBSSH2_FX_OP_UNSUPPORTED);
+}
+
+static int
+lb_channel_data(struct loopback *lb, struct string_buf *req, int extended)
+{
+    struct lb_channel *ch = lb_channel(lb, req);
+    unsigned char *data;
+    size_t len;
+    uint32_t code;
+
+    if(!ch || (extended && _libssh2_get_u32(req, &code)) ||
+       _libssh2_get_string(req, &data, &len) || len > ch->window)
+        return -1;
+    ch->window -= (uint32_t)len;
+    ch->consumed += (uint32_t)len;
+
+    if(ch->mode == LB_ECHO && !extended) {
+        if(buf_add(&ch->out, data, len))
+            return -1;
+    }
+    else if(ch->mode == LB_SFTP && !extended) {
+        if(buf_add(&ch->in, data, len))
+            return -1;
+        while(ch->in.len - ch->in.pos >= 4) {
+            unsigned char *p = ch->in.data + ch->in.pos;
+            size_t plen = _libssh2_ntohu32(p);
+
+            if(plen > LB_SFTP_MAXLEN)
+                return -1;
+            if(ch->in.len - ch->in.pos < 4 + plen)
+                break;
+            if(lb_sftp_request(lb, ch, p + 4, plen))
+                return -1;
+            buf_consume(&ch->in, 4 + plen);
+        }
+    }
+    else
+        lb->received += len;
+
+    /* hand the window back once half of it is used up */
+    if(ch->consumed >= lb->config.window / 2) {
+        unsigned char *s = lb->msg;
+
+        *s++ = SSH_MSG_CHANNEL_WINDOW_ADJUST;
+        _libssh2_store_u32(&s, ch->id);
+        _libssh2_store_u32(&s, ch->consumed);
+        ch->window += ch->consumed;
+        ch->consumed = 0;
+        return lb_send(lb, lb->msg, s - lb->msg);
+    }
+    return 0;
+}
+
+/* sends what the channels have to send, as far as the windows allow */
+static int
+lb_pump(struct loopback *lb)
+{
+    int n;
+
+    for(n = 0; n < LB_CHANNELS; n++) {
+        struct lb_channel *ch = &lb->channels[n];
+
+        if(ch->mode == LB_FREE || ch->closed)
+            continue;
+
+        while(ch->peer_window &&
+              (!lb->config.sndbuf ||
+               pipe_pending(&lb->down) < lb->config.sndbuf)) {
+            unsigned char *s = lb->msg;
+            const unsigned char *data;
+            size_t len = ch->out.len - ch->out.pos;
+
+            if(len)
+                data = ch->out.data + ch->out.pos;
+            else if(ch->source) {
+                data = lb_pattern;
+                len = (size_t)LIBSSH2_MIN(ch->source, LB_CHUNK);
+            }
+            else
+                break;
+            len = LIBSSH2_MIN(len, ch->peer_window);
+            len = LIBSSH2_MIN(len, ch->peer_max_packet);
+            len = LIBSSH2_MIN(len, LB_CHUNK);
+
+            *s++ = SSH_MSG_CHANNEL_DATA;
+            _libssh2_store_u32(&s, ch->id);
+            _libssh2_store_u32(&s, (uint32_t)len);
+            if(lb_send2(lb, lb->msg, s - lb->msg, data, len))
+                return -1;
+
+            ch->peer_window -= (uint32_t)len;
+            if(ch->out.len - ch->out.pos)
+                buf_consume(&ch->out, len);
+            else
+                ch->source -= len;
+        }
+
+        /* done once everything is out and there is no more to come */
+        if(ch->out.len == ch->out.pos && !ch->source &&
+           (ch->mode == LB_SOURCE || ch->eof) &&
+           lb_channel_close(lb, ch))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+lb_handle(struct loopback *lb, unsigned char *data, size_t len)
+{
+    struct string_buf req;
+    struct lb_channel *ch;
+    unsigned char type;
+    unsigned char *s;
+    uint32_t n;
+
+    req.data = req.dataptr = data;
+    req.len = len;
+    if(_libssh2_get_byte(&req, &type))
+        return -1;
+
+    if(lb->skip_guess && type >= 30 && type <= 49) {
+        lb->skip_guess = 0;
+        return 0;
+    }
+
+    switch(type) {
+    case SSH_MSG_DISCONNECT:
+    case SSH_MSG_IGNORE:
+    case SSH_MSG_DEBUG:
+    case SSH_MSG_UNIMPLEMENTED:
+        return 0;
+
+    case SSH_MSG_KEXINIT:
+        return lb_kexinit(lb, data, len);
+
+    case SSH2_MSG_KEX_ECDH_INIT:
+        return lb_ecdh(lb, &req);
+
+    case SSH_MSG_NEWKEYS:
+        if(!lb->next_in.crypt)
+            return -1;
+        keys_switch(lb, &lb->in, &lb->next_in);
+        return 0;
+
+    case SSH_MSG_SERVICE_REQUEST:
+        data[0] = SSH_MSG_SERVICE_ACCEPT;
+        return lb_send(lb, data, len);
+
+    case SSH_MSG_USERAUTH_REQUEST:
+        return lb_userauth(lb, &req);
+
+    case SSH_MSG_GLOBAL_REQUEST:
+        lb->msg[0] = SSH_MSG_REQUEST_FAILURE;
+        if(_libssh2_get_string(&req, &s, NULL) ||
+           _libssh2_get_boolean(&req, &type))
+            return -1;
+        return type ? lb_send(lb, lb->msg, 1) : 0;
+
+    case SSH_MSG_CHANNEL_OPEN:
+        return lb_channel_open(lb, &req);
+
+    case SSH_MSG_CHANNEL_REQUEST:
+        return lb_channel_request(lb, &req);
+
+    case SSH_MSG_CHANNEL_DATA:
+        return lb_channel_data(lb, &req, 0);
+
+    case SSH_MSG_CHANNEL_EXTENDED_DATA:
+        return lb_channel_data(lb, &req, 1);
+
+    case SSH_MSG_CHANNEL_WINDOW_ADJUST:
+        ch = lb_channel(lb, &req);
+        if(!ch || _libssh2_get_u32(&req, &n))
+            return -1;
+        ch->peer_window += n;
+        return 0;
+
+    case SSH_MSG_CHANNEL_EOF:
+        ch = lb_channel(lb, &req);
+        if(!ch)
+            return -1;
+        ch->eof = 1;
+        return 0;
+
+    case SSH_MSG_CHANNEL_CLOSE:
+        ch = lb_channel(lb, &req);
+        if(!ch)
+            return -1;
+        ch->out.pos = ch->out.len;
+        ch->source = 0;
+        if(lb_channel_close(lb, ch))
+            return -1;
+        buf_free(&ch->in);
+        buf_free(&ch->out);
+        ch->mode = LB_FREE;
+        return 0;
+    }
+
+    s = lb->msg;
+    *s++ = SSH_MSG_UNIMPLEMENTED;
+    _libssh2_store_u32(&s, lb->in.seqno - 1);
+    return lb_send(lb, lb->msg, s - lb->msg);
+}
+
+/* handles whatever has arrived from the client */
+static int
+lb_run(struct loopback *lb)
+{
+    unsigned char *payload;
+    size_t len;
+    int rc;
+
+    if(lb->state == LB_STATE_FAILED)
+        return -1;
+
+    pipe_update(lb, &lb->up);
+
+    if(lb->state == LB_STATE_BANNER) {
+        unsigned char *p = lb->up.buf.data + lb->up.buf.pos;
+        size_t avail = lb->up.ready - lb->up.buf.pos;
+        unsigned char *nl = avail ? memchr(p, '\n', avail) : NULL;
+        size_t line;
+
+        if(!nl)
+            return 0;
+        line = nl - p + 1;
+        lb->client_banner = malloc(line);
+        if(!lb->client_banner)
+            goto fail;
+        memcpy(lb->client_banner, p, line - 1);
+        lb->client_banner[line - 1] = '\0';
+        if(line > 1 && lb->client_banner[line - 2] == '\r')
+            lb->client_banner[line - 2] = '\0';
+        pipe_consume(&lb->up, line);
+        lb->state = LB_STATE_RUN;
+    }
+
+    while((rc = lb_recv(lb, &payload, &len)) == 1) {
+        if(lb_handle(lb, payload, len))
+            goto fail;
+    }
+    if(rc < 0 || lb_pump(lb))
+        goto fail;
+    return 0;
+
+fail:
+    lb->state = LB_STATE_FAILED;
+    return -1;
+}
+
+/*
+ * The session's end of the link
+ */
+
+static LIBSSH2_SEND_FUNC(lb_send_cb)
+{
+    struct loopback *lb = *abstract;
+    size_t room;
+
+    (void)socket;
+    (void)flags;
+
+    if(lb->state == LB_STATE_FAILED)
+        return -ECONNRESET;
+
+    if(lb->config.sndbuf) {
+        room = lb->config.sndbuf - LIBSSH2_MIN(lb->config.sndbuf,
+                                               pipe_pending(&lb->up));
+        if(!room)
+            return -EAGAIN;
+        length = LIBSSH2_MIN(length, room);
+    }
+    if(pipe_write(lb, &lb->up, buffer, length))
+        return -ENOMEM;
+
+    return (ssize_t)length;
+}
+
+static LIBSSH2_RECV_FUNC(lb_recv_cb)
+{
+    struct loopback *lb = *abstract;
+    size_t avail;
+
+    (void)socket;
+    (void)flags;
+
+    if(lb_run(lb))
+        return -ECONNRESET;
+
+    pipe_update(lb, &lb->down);
+    avail = lb->down.ready - lb->down.buf.pos;
+    if(!avail)
+        return -EAGAIN;
+    if(length > avail)
+        length = avail;
+    memcpy(buffer, lb->down.buf.data + lb->down.buf.pos, length);
+    pipe_consume(&lb->down, length);
+
+    return (ssize_t)length;
+}
+
+int
+loopback_wait(struct loopback *lb)
+{
+    size_t taken = lb->up.buf.pos;
+    size_t given = lb->down.buf.len;
+    double next = -1;
+
+    if(lb_run(lb))
+        return -1;
+
+    /* the server had something to do already */
+    pipe_update(lb, &lb->down);
+    if(lb->up.buf.pos != taken || lb->down.buf.len != given ||
+       lb->down.ready != lb->down.buf.pos)
+        return 0;
+
+    /* else time goes by until the next bytes arrive at either end */
+    if(lb->up.first < lb->up.nmarks)
+        next = lb->up.marks[lb->up.first].due;
+    if(lb->down.first < lb->down.nmarks &&
+       (next < 0 || lb->down.marks[lb->down.first].due < next))
+        next = lb->down.marks[lb->down.first].due;
+    if(next < 0)
+        return -1;
+
+    if(next > loopback_now(lb))
+        lb->skew += next - loopback_now(lb);
+    return lb_run(lb);
+}
+
+libssh2_uint64_t
+loopback_received(struct loopback *lb)
+{
+    return lb->received;
+}
+
+libssh2_socket_t
+loopback_socket(struct loopback *lb)
+{
+    return lb->fds[0];
+}
+
+/* comma separated list of the names of 'count' methods */
+static char *
+lb_names(const char *(*name)(int n), int count)
+{
+    size_t len = 1;
+    char *list;
+    int i;
+
+    for(i = 0; i < count; i++)
+        len += strlen(name(i)) + 1;
+    list = malloc(len);
+    if(!list)
+        return NULL;
+    list[0] = '\0';
+    for(i = 0; i < count; i++) {
+        if(i)
+            strcat(list, ",");
+        strcat(list, name(i));
+    }
+    return list;
+}
+
+static const char *
+lb_crypt_name(int n)
+{
+    return libssh2_crypt_methods()[n]->name;
+}
+
+static const char *
+lb_mac_name(int n)
+{
+    return _libssh2_mac_methods()[n]->name;
+}
+
+struct loopback *
+loopback_new(const struct loopback_config *config)
+{
+    struct loopback *lb = calloc(1, sizeof(*lb));
+    int n;
+
+    if(!lb)
+        return NULL;
+    lb->fds[0] = lb->fds[1] = -1;
+
+    if(config)
+        lb->config = *config;
+    if(!lb->config.window)
+        lb->config.window = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+    if(!lb->config.max_packet)
+        lb->config.max_packet = LIBSSH2_CHANNEL_PACKET_DEFAULT;
+    if(lb->config.sndbuf)
+        lb->config.sndbuf = LIBSSH2_MAX(lb->config.sndbuf, LB_SNDBUF_MIN);
+
+    for(n = 0; libssh2_crypt_methods()[n] &&
+        libssh2_crypt_methods()[n]->name; n++)
+        ;
+    lb->crypt_list = lb->config.crypt ? strdup(lb->config.crypt) :
+        lb_names(lb_crypt_name, n);
+    for(n = 0; _libssh2_mac_methods()[n] &&
+        _libssh2_mac_methods()[n]->name; n++)
+        ;
+    lb->mac_list = lb->config.mac ? strdup(lb->config.mac) :
+        lb_names(lb_mac_name, n);
+    lb->msg = malloc(LIBSSH2_PACKET_MAXPAYLOAD);
+    lb->ctx = libssh2_session_init();
+
+    if(!lb->crypt_list || !lb->mac_list || !lb->msg || !lb->ctx ||
+       socketpair(AF_UNIX, SOCK_STREAM, 0, lb->fds) ||
+       _libssh2_random(lb->host_seed, sizeof(lb->host_seed))) {
+        loopback_free(lb);
+        return NULL;
+    }
+    ed25519_public_key(lb->host_pub, lb->host_seed);
+    memset(lb_pattern, 'x', sizeof(lb_pattern));
+
+    return lb;
+}
+
+int
+loopback_attach(struct loopback *lb, LIBSSH2_SESSION *session)
+{
+    static const char banner[] = LB_BANNER "\r\n";
+
+    *libssh2_session_abstract(session) = lb;
+    libssh2_session_set_blocking(session, 0);
+    libssh2_session_callback_set2(session, LIBSSH2_CALLBACK_SEND,
+                                  (libssh2_cb_generic *)lb_send_cb);
+    libssh2_session_callback_set2(session, LIBSSH2_CALLBACK_RECV,
+                                  (libssh2_cb_generic *)lb_recv_cb);
+
+    /* the server speaks first */
+    if(pipe_write(lb, &lb->down, banner, sizeof(banner) - 1) ||
+       lb_send_kexinit(lb))
+        return -1;
+    return 0;
+}
+
+void
+loopback_free(struct loopback *lb)
+{
+    int n;
+
+    if(!lb)
+        return;
+    for(n = 0; n < LB_CHANNELS; n++) {
+        buf_free(&lb->channels[n].in);
+        buf_free(&lb->channels[n].out);
+    }
+    if(lb->ctx) {
+        keys_free(lb, &lb->in);
+        keys_free(lb, &lb->out);
+        keys_free(lb, &lb->next_in);
+        keys_free(lb, &lb->next_out);
+        libssh2_session_free(lb->ctx);
+    }
+    pipe_free(&lb->up);
+    pipe_free(&lb->down);
+    buf_free(&lb->pkt);
+    if(lb->fds[0] != -1) {
+        close(lb->fds[0]);
+        close(lb->fds[1]);
+    }
+    free(lb->crypt_list);
+    free(lb->mac_list);
+    free(lb->client_banner);
+    free(lb->client_kexinit);
+    free(lb->kexinit);
+    free(lb->msg);
+    free(lb);
+}
@@ -0,0 +1,68 @@
+#ifndef LIBSSH2_LOOPBACK_H
+#define LIBSSH2_LOOPBACK_H
+/*
+ * An in-process stand-in for an SSH server, plugged into a session through
+ * its send and recv callbacks, for benchmarking whole sessions without a
+ * network or an sshd.
+ *
+ * It does curve25519-sha256 with an ssh-ed25519 host key and any cipher
+ * and MAC libssh2 has, accepts any password or public key, and runs these
+ * commands on "session" channels:
+ *
+ *   sink        discards everything written to it
+ *   source N    writes N bytes, then exits
+ *   echo        writes back everything written to it
+ *
+ * and the "sftp" subsystem with open, read, write, close, stat, fstat,
+ * lstat and realpath. Every path is one file of file_size bytes, writes
+ * to it are discarded.
+ *
+ * The bytes between the two ends go through a pipe each way with a
+ * latency and a bandwidth. Time is virtual: whenever the session would
+ * have to wait for the other end the clock jumps ahead, so shaping costs
+ * no real time and loopback_now() tells how long the work would have
+ * taken over such a link. The server runs inside the callbacks, so its
+ * CPU time is part of the measurement.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <libssh2.h>
+
+struct loopback_config {
+    const char *crypt;          /* cipher to offer, NULL for all */
+    const char *mac;            /* MAC to offer, NULL for all */
+    double latency;             /* one way, in seconds */
+    double bandwidth;           /* bytes per second each way, 0 unlimited */
+    size_t sndbuf;              /* bytes in flight each way before sending
+                                   blocks, 0 for unlimited */
+    uint32_t window;            /* receive window of the server's channels */
+    uint32_t max_packet;        /* largest data packet it accepts */
+    libssh2_uint64_t file_size; /* size of the file SFTP reads see */
+};
+
+struct loopback;
+
+/* NULL config for no shaping and the libssh2 default window */
+struct loopback *loopback_new(const struct loopback_config *config);
+void loopback_free(struct loopback *lb);
+
+/* Makes 'session' talk to the loopback server. Call it before the
+   handshake, and pass loopback_socket() to libssh2_session_handshake().
+   The session is made non-blocking: a call that returns
+   LIBSSH2_ERROR_EAGAIN is retried after loopback_wait(). */
+int loopback_attach(struct loopback *lb, LIBSSH2_SESSION *session);
+libssh2_socket_t loopback_socket(struct loopback *lb);
+
+/* seconds on the virtual clock */
+double loopback_now(struct loopback *lb);
+
+/* Lets time pass until the server or the session can make progress, for
+   non-blocking sessions that got LIBSSH2_ERROR_EAGAIN. Returns -1 if
+   nothing is under way. */
+int loopback_wait(struct loopback *lb);
+
+/* channel data and SFTP write payload the server has taken in */
+libssh2_uint64_t loopback_received(struct loopback *lb);
+
+#endif /* LIBSSH2_LOOPBACK_H */
@@ -419,16 +419,26 @@ typedef struct _LIBSSH2_SK_SIG_INFO {
 #define LIBSSH2_METHOD_LANG_SC      9
 #define LIBSSH2_METHOD_SIGN_ALGO    10
 
+/* libssh2_session_methods() only: the server's preferred methods from its
+   last KEXINIT, the right guess for LIBSSH2_FLAG_KEX_GUESS next time */
+#define LIBSSH2_METHOD_KEX_SERVER       11
+#define LIBSSH2_METHOD_HOSTKEY_SERVER   12
+
 /* flags */
 #define LIBSSH2_FLAG_SIGPIPE        1
 #define LIBSSH2_FLAG_COMPRESS       2
 #define LIBSSH2_FLAG_QUOTE_PATHS    3
+/* send the init packet of the preferred key exchange right behind KEXINIT
+   (first_kex_packet_follows), saving a round trip if the server prefers
+   the same key exchange and host key methods */
+#define LIBSSH2_FLAG_KEX_GUESS      4
 
 typedef struct _LIBSSH2_SESSION                     LIBSSH2_SESSION;
 typedef struct _LIBSSH2_CHANNEL                     LIBSSH2_CHANNEL;
 typedef struct _LIBSSH2_LISTENER                    LIBSSH2_LISTENER;
 typedef struct _LIBSSH2_KNOWNHOSTS                  LIBSSH2_KNOWNHOSTS;
 typedef struct _LIBSSH2_AGENT                       LIBSSH2_AGENT;
+typedef struct _LIBSSH2_PRIVKEY                     LIBSSH2_PRIVKEY;
 
 /* SK signature callback */
 typedef struct _LIBSSH2_PRIVKEY_SK {
@@ -695,6 +705,7 @@ LIBSSH2_API int libssh2_session_method_pref(LIBSSH2_SESSION *session,
                                             const char *prefs);
 LIBSSH2_API const char *libssh2_session_methods(LIBSSH2_SESSION *session,
                                                 int method_type);
+LIBSSH2_API int libssh2_session_kex_pregenerate(LIBSSH2_SESSION *session);
 LIBSSH2_API int libssh2_session_last_error(LIBSSH2_SESSION *session,
                                            char **errmsg,
                                            int *errmsg_len, int want_buf);
@@ -788,6 +799,32 @@ libssh2_userauth_publickey_frommemory(LIBSSH2_SESSION *session,
                                       size_t privatekeyfiledata_len,
                                       const char *passphrase);
 
+/*
+ * Load and decrypt a private key once, for authenticating any number of
+ * sessions with libssh2_userauth_publickey_privkey() without parsing the
+ * key (and running the passphrase KDF) again each time. The key uses the
+ * memory functions of the session it was loaded with and must not be used
+ * by two sessions at the same time.
+ */
+LIBSSH2_API LIBSSH2_PRIVKEY *
+libssh2_privkey_frommemory(LIBSSH2_SESSION *session,
+                           const char *privatekeyfiledata,
+                           size_t privatekeyfiledata_len,
+                           const char *passphrase);
+
+LIBSSH2_API LIBSSH2_PRIVKEY *
+libssh2_privkey_fromfile(LIBSSH2_SESSION *session,
+                         const char *privatekey,
+                         const char *passphrase);
+
+LIBSSH2_API void libssh2_privkey_free(LIBSSH2_PRIVKEY *privkey);
+
+LIBSSH2_API int
+libssh2_userauth_publickey_privkey(LIBSSH2_SESSION *session,
+                                   const char *username,
+                                   size_t username_len,
+                                   LIBSSH2_PRIVKEY *privkey);
+
 /*
  * response_callback is provided with filled by library prompts array,
  * but client must allocate and fill individual responses. Responses
@@ -948,6 +985,17 @@ LIBSSH2_API ssize_t libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel,
     libssh2_channel_read_ex((channel), SSH_EXTENDED_DATA_STDERR, \
                             (buf), (buflen))
 
+LIBSSH2_API ssize_t libssh2_channel_read_borrow_ex(LIBSSH2_CHANNEL *channel,
+                                                   int stream_id,
+                                                   const char **data);
+#define libssh2_channel_read_borrow(channel, data) \
+    libssh2_channel_read_borrow_ex((channel), 0, (data))
+#define libssh2_channel_read_borrow_stderr(channel, data) \
+    libssh2_channel_read_borrow_ex((channel), SSH_EXTENDED_DATA_STDERR, \
+                                   (data))
+LIBSSH2_API int libssh2_channel_read_release(LIBSSH2_CHANNEL *channel,
+                                             size_t len);
+
 LIBSSH2_API int libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel,
                                           int extended);
 
@@ -1003,6 +1051,52 @@ LIBSSH2_API void libssh2_session_set_read_timeout(LIBSSH2_SESSION* session,
                                                   long timeout);
 LIBSSH2_API long libssh2_session_get_read_timeout(LIBSSH2_SESSION* session);
 
+LIBSSH2_API int libssh2_session_set_max_packet_size(LIBSSH2_SESSION* session,
+                                                    size_t size);
+LIBSSH2_API size_t libssh2_session_get_max_packet_size(LIBSSH2_SESSION* session);
+
+/* By default the packet pool keeps as many idle buffers as the data packets
+   of one channel with the default window, or of the whole window budget if
+   that is smaller, so that a bulk transfer stops allocating once its window
+   is full. Lower the limits to give the memory back sooner, raise them for
+   several busy channels or bigger windows. */
+LIBSSH2_API int libssh2_session_set_packet_pool(LIBSSH2_SESSION* session,
+                                                size_t max_idle,
+                                                size_t max_bytes);
+LIBSSH2_API void
+libssh2_session_get_packet_pool_stats(LIBSSH2_SESSION* session,
+                                      libssh2_uint64_t *hits,
+                                      libssh2_uint64_t *misses);
+
+LIBSSH2_API int libssh2_session_set_window_budget(LIBSSH2_SESSION* session,
+                                                  size_t bytes);
+
+/* Counters kept by every session since it was created or last reset. Times
+   are in microseconds of wall clock. The wait and window stall times can
+   overlap: a write stalled on the window usually waits on the socket for
+   the window adjustment. */
+typedef struct _LIBSSH2_SESSION_STATS {
+    libssh2_uint64_t bytes_sent;        /* on the socket */
+    libssh2_uint64_t bytes_recv;
+    libssh2_uint64_t packets_sent;      /* SSH packets */
+    libssh2_uint64_t packets_recv;
+    libssh2_uint64_t crypt_time;        /* encrypting and decrypting */
+    libssh2_uint64_t mac_time;          /* computing and checking MACs */
+    libssh2_uint64_t comp_time;         /* compressing and decompressing */
+    libssh2_uint64_t wait_time;         /* blocked waiting on the socket */
+    libssh2_uint64_t eagain_send;       /* sends the socket did not take */
+    libssh2_uint64_t eagain_recv;       /* reads with nothing to read */
+    libssh2_uint64_t window_stall_time; /* channel writes held up by a full
+                                           remote window */
+    libssh2_uint64_t kex_count;         /* completed key exchanges, the
+                                           first one included */
+    libssh2_uint64_t kex_time;          /* spent in them */
+} LIBSSH2_SESSION_STATS;
+
+LIBSSH2_API void libssh2_session_get_stats(LIBSSH2_SESSION* session,
+                                           LIBSSH2_SESSION_STATS *stats);
+LIBSSH2_API void libssh2_session_reset_stats(LIBSSH2_SESSION* session);
+
 #ifndef LIBSSH2_NO_DEPRECATED
 LIBSSH2_DEPRECATED(1.1.0, "libssh2_channel_handle_extended_data2()")
 LIBSSH2_API void libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
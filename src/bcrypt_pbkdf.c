@@ -22,6 +22,9 @@
 #ifndef HAVE_BCRYPT_PBKDF
 
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #define LIBSSH2_BCRYPT_PBKDF_C
 #include "blowfish.c"
@@ -52,9 +55,29 @@
 
 #define BCRYPT_BLOCKS 8
 #define BCRYPT_HASHSIZE (BCRYPT_BLOCKS * 4)
+#define BCRYPT_SHA2WORDS (SHA512_DIGEST_LENGTH / 4)
+
+/*
+ * The output blocks are independent of each other, with HAVE_PTHREAD_H up
+ * to LIBSSH2_BCRYPT_THREADS of them are computed at the same time. A key
+ * and IV for aes256-ctr take two blocks.
+ */
+#ifndef LIBSSH2_BCRYPT_THREADS
+#define LIBSSH2_BCRYPT_THREADS 2
+#endif
+#define BCRYPT_THREAD_STACK (16 * 1024)
+
+static void
+bcrypt_words(uint32_t *words, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len / 4; i++)
+        words[i] = _libssh2_ntohu32(data + 4 * i);
+}
 
 static void
-bcrypt_hash(uint8_t *sha2pass, uint8_t *sha2salt, uint8_t *out)
+bcrypt_hash(const uint32_t *sha2pass, const uint8_t *sha2salt, uint8_t *out)
 {
     blf_ctx state;
     uint8_t ciphertext[BCRYPT_HASHSIZE] = {
@@ -63,16 +86,19 @@ bcrypt_hash(uint8_t *sha2pass, uint8_t *sha2salt, uint8_t *out)
         'S', 'w', 'a', 't',
         'D', 'y', 'n', 'a', 'm', 'i', 't', 'e' };
     uint32_t cdata[BCRYPT_BLOCKS];
+    uint32_t salt[BCRYPT_SHA2WORDS];
     int i;
     uint16_t j;
-    uint16_t shalen = SHA512_DIGEST_LENGTH;
+
+    bcrypt_words(salt, sha2salt, SHA512_DIGEST_LENGTH);
 
     /* key expansion */
     Blowfish_initstate(&state);
-    Blowfish_expandstate(&state, sha2salt, shalen, sha2pass, shalen);
+    Blowfish_expandstate_words(&state, salt, BCRYPT_SHA2WORDS,
+                               sha2pass, BCRYPT_SHA2WORDS);
     for(i = 0; i < 64; i++) {
-        Blowfish_expand0state(&state, sha2salt, shalen);
-        Blowfish_expand0state(&state, sha2pass, shalen);
+        Blowfish_expand0state_words(&state, salt, BCRYPT_SHA2WORDS);
+        Blowfish_expand0state_words(&state, sha2pass, BCRYPT_SHA2WORDS);
     }
 
     /* encryption */
@@ -94,99 +120,177 @@ bcrypt_hash(uint8_t *sha2pass, uint8_t *sha2salt, uint8_t *out)
     /* zap */
     _libssh2_explicit_zero(ciphertext, sizeof(ciphertext));
     _libssh2_explicit_zero(cdata, sizeof(cdata));
+    _libssh2_explicit_zero(salt, sizeof(salt));
     _libssh2_explicit_zero(&state, sizeof(state));
 }
 
+/* output block 'count' (counting from 1), before mixing */
+static int
+bcrypt_block(const uint32_t *sha2pass, const uint8_t *salt, size_t saltlen,
+             uint32_t count, unsigned int rounds, uint8_t *out)
+{
+    uint8_t sha2salt[SHA512_DIGEST_LENGTH];
+    uint8_t tmpout[BCRYPT_HASHSIZE];
+    uint8_t countbuf[4];
+    libssh2_sha512_ctx ctx;
+    unsigned int i;
+    size_t j;
+
+    _libssh2_htonu32(countbuf, count);
+
+    /* first round, salt is salt */
+    if(!libssh2_sha512_init(&ctx) ||
+       !libssh2_sha512_update(ctx, salt, saltlen) ||
+       !libssh2_sha512_update(ctx, countbuf, sizeof(countbuf)) ||
+       !libssh2_sha512_final(ctx, sha2salt))
+        return -1;
+
+    bcrypt_hash(sha2pass, sha2salt, tmpout);
+    memcpy(out, tmpout, sizeof(tmpout));
+
+    for(i = 1; i < rounds; i++) {
+        /* subsequent rounds, salt is previous output */
+        if(!libssh2_sha512_init(&ctx) ||
+           !libssh2_sha512_update(ctx, tmpout, sizeof(tmpout)) ||
+           !libssh2_sha512_final(ctx, sha2salt)) {
+            _libssh2_explicit_zero(tmpout, sizeof(tmpout));
+            return -1;
+        }
+
+        bcrypt_hash(sha2pass, sha2salt, tmpout);
+        for(j = 0; j < sizeof(tmpout); j++)
+            out[j] ^= tmpout[j];
+    }
+
+    _libssh2_explicit_zero(sha2salt, sizeof(sha2salt));
+    _libssh2_explicit_zero(tmpout, sizeof(tmpout));
+
+    return 0;
+}
+
+struct bcrypt_job {
+    const uint32_t *sha2pass;
+    const uint8_t *salt;
+    size_t saltlen;
+    unsigned int rounds;
+    uint8_t *out;           /* all blocks, BCRYPT_HASHSIZE bytes each */
+    size_t first;           /* first block of this job, from 0 */
+    size_t step;            /* distance to its next block */
+    size_t blocks;          /* total number of blocks */
+    int rc;
+};
+
+static void *
+bcrypt_job_run(void *arg)
+{
+    struct bcrypt_job *job = (struct bcrypt_job *)arg;
+    size_t b;
+
+    job->rc = 0;
+    for(b = job->first; b < job->blocks; b += job->step) {
+        if(bcrypt_block(job->sha2pass, job->salt, job->saltlen,
+                        (uint32_t)(b + 1), job->rounds,
+                        job->out + b * BCRYPT_HASHSIZE)) {
+            job->rc = -1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
 static int
 bcrypt_pbkdf(const char *pass, size_t passlen, const uint8_t *salt,
              size_t saltlen,
              uint8_t *key, size_t keylen, unsigned int rounds)
 {
-    uint8_t sha2pass[SHA512_DIGEST_LENGTH];
-    uint8_t sha2salt[SHA512_DIGEST_LENGTH];
-    uint8_t out[BCRYPT_HASHSIZE];
-    uint8_t tmpout[BCRYPT_HASHSIZE];
-    uint8_t *countsalt;
-    size_t i, j, amt, stride;
-    uint32_t count;
-    size_t origkeylen = keylen;
+    uint8_t sha2pass_bytes[SHA512_DIGEST_LENGTH];
+    uint32_t sha2pass[BCRYPT_SHA2WORDS];
+    struct bcrypt_job jobs[LIBSSH2_BCRYPT_THREADS];
+#ifdef HAVE_PTHREAD_H
+    pthread_t threads[LIBSSH2_BCRYPT_THREADS];
+    int started[LIBSSH2_BCRYPT_THREADS];
+    pthread_attr_t attr;
+    int attr_ok;
+#endif
+    uint8_t *out;
+    size_t i, stride, njobs;
+    int rc = 0;
     libssh2_sha512_ctx ctx;
 
     /* nothing crazy */
     if(rounds < 1)
         return -1;
     if(passlen == 0 || saltlen == 0 || keylen == 0 ||
-       keylen > sizeof(out) * sizeof(out) || saltlen > 1 << 20)
+       keylen > BCRYPT_HASHSIZE * BCRYPT_HASHSIZE || saltlen > 1 << 20)
         return -1;
-    countsalt = calloc(1, saltlen + 4);
-    if(!countsalt)
+    stride = (keylen + BCRYPT_HASHSIZE - 1) / BCRYPT_HASHSIZE;
+    out = calloc(stride, BCRYPT_HASHSIZE);
+    if(!out)
         return -1;
-    stride = (keylen + sizeof(out) - 1) / sizeof(out);
-    amt = (keylen + stride - 1) / stride;
-
-    memcpy(countsalt, salt, saltlen);
 
     /* collapse password */
     if(!libssh2_sha512_init(&ctx) ||
        !libssh2_sha512_update(ctx, pass, passlen) ||
-       !libssh2_sha512_final(ctx, sha2pass)) {
-        free(countsalt);
+       !libssh2_sha512_final(ctx, sha2pass_bytes)) {
+        free(out);
         return -1;
     }
+    bcrypt_words(sha2pass, sha2pass_bytes, sizeof(sha2pass_bytes));
+    _libssh2_explicit_zero(sha2pass_bytes, sizeof(sha2pass_bytes));
 
-    /* generate key, sizeof(out) at a time */
-    for(count = 1; keylen > 0; count++) {
-        countsalt[saltlen + 0] = (uint8_t)((count >> 24) & 0xff);
-        countsalt[saltlen + 1] = (count >> 16) & 0xff;
-        countsalt[saltlen + 2] = (count >> 8) & 0xff;
-        countsalt[saltlen + 3] = count & 0xff;
+    /* generate the key, one block of BCRYPT_HASHSIZE per 'stride' bytes */
+    njobs = LIBSSH2_MIN(stride, LIBSSH2_BCRYPT_THREADS);
+    for(i = 0; i < njobs; i++) {
+        jobs[i].sha2pass = sha2pass;
+        jobs[i].salt = salt;
+        jobs[i].saltlen = saltlen;
+        jobs[i].rounds = rounds;
+        jobs[i].out = out;
+        jobs[i].first = i;
+        jobs[i].step = njobs;
+        jobs[i].blocks = stride;
+        jobs[i].rc = 0;
+    }
 
-        /* first round, salt is salt */
-        if(!libssh2_sha512_init(&ctx) ||
-           !libssh2_sha512_update(ctx, countsalt, saltlen + 4) ||
-           !libssh2_sha512_final(ctx, sha2salt)) {
-            _libssh2_explicit_zero(out, sizeof(out));
-            free(countsalt);
-            return -1;
-        }
+#ifdef HAVE_PTHREAD_H
+    attr_ok = njobs > 1 && !pthread_attr_init(&attr);
+    if(attr_ok)
+        pthread_attr_setstacksize(&attr, BCRYPT_THREAD_STACK);
+    for(i = 1; i < njobs; i++)
+        started[i] = attr_ok &&
+            !pthread_create(&threads[i], &attr, bcrypt_job_run, &jobs[i]);
+    bcrypt_job_run(&jobs[0]);
+    for(i = 1; i < njobs; i++) {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        else
+            bcrypt_job_run(&jobs[i]);
+    }
+    if(attr_ok)
+        pthread_attr_destroy(&attr);
+#else
+    for(i = 0; i < njobs; i++)
+        bcrypt_job_run(&jobs[i]);
+#endif
 
-        bcrypt_hash(sha2pass, sha2salt, tmpout);
-        memcpy(out, tmpout, sizeof(out));
-
-        for(i = 1; i < rounds; i++) {
-            /* subsequent rounds, salt is previous output */
-            if(!libssh2_sha512_init(&ctx) ||
-               !libssh2_sha512_update(ctx, tmpout, sizeof(tmpout)) ||
-               !libssh2_sha512_final(ctx, sha2salt)) {
-                _libssh2_explicit_zero(out, sizeof(out));
-                free(countsalt);
-                return -1;
-            }
-
-            bcrypt_hash(sha2pass, sha2salt, tmpout);
-            for(j = 0; j < sizeof(out); j++)
-                out[j] ^= tmpout[j];
-        }
+    for(i = 0; i < njobs; i++)
+        rc |= jobs[i].rc;
 
-        /*
-         * pbkdf2 deviation: output the key material non-linearly.
-         */
-        amt = LIBSSH2_MIN(amt, keylen);
-        for(i = 0; i < amt; i++) {
-            size_t dest = i * stride + (count - 1);
-            if(dest >= origkeylen) {
-                break;
-            }
-            key[dest] = out[i];
-        }
-        keylen -= i;
+    /*
+     * pbkdf2 deviation: output the key material non-linearly.
+     */
+    if(!rc) {
+        for(i = 0; i < keylen; i++)
+            key[i] = out[(i % stride) * BCRYPT_HASHSIZE + i / stride];
     }
 
     /* zap */
-    _libssh2_explicit_zero(out, sizeof(out));
-    free(countsalt);
+    _libssh2_explicit_zero(out, stride * BCRYPT_HASHSIZE);
+    _libssh2_explicit_zero(sha2pass, sizeof(sha2pass));
+    free(out);
 
-    return 0;
+    return rc ? -1 : 0;
 }
 #endif /* HAVE_BCRYPT_PBKDF */
 
@@ -79,9 +79,15 @@ static void Blowfish_encipher(blf_ctx *, uint32_t *, uint32_t *);
 static void Blowfish_decipher(blf_ctx *, uint32_t *, uint32_t *);
 #endif
 static void Blowfish_initstate(blf_ctx *);
+#ifdef _DEBUG_BLOWFISH
 static void Blowfish_expand0state(blf_ctx *, const uint8_t *, uint16_t);
-static void Blowfish_expandstate
-(blf_ctx *, const uint8_t *, uint16_t, const uint8_t *, uint16_t);
+#endif
+/* Word-oriented variants for keys and data made of whole big-endian
+ * 32-bit words, as used by bcrypt_pbkdf
+ */
+static void Blowfish_expand0state_words(blf_ctx *, const uint32_t *, uint16_t);
+static void Blowfish_expandstate_words
+(blf_ctx *, const uint32_t *, uint16_t, const uint32_t *, uint16_t);
 
 /* Standard Blowfish */
 
@@ -465,6 +471,7 @@ Blowfish_stream2word(const uint8_t *data, uint16_t databytes,
     return temp;
 }
 
+#ifdef _DEBUG_BLOWFISH
 static void
 Blowfish_expand0state(blf_ctx *c, const uint8_t *key, uint16_t keybytes)
 {
@@ -501,31 +508,28 @@ Blowfish_expand0state(blf_ctx *c, const uint8_t *key, uint16_t keybytes)
         }
     }
 }
+#endif
 
 static void
-Blowfish_expandstate(blf_ctx *c, const uint8_t *data, uint16_t databytes,
-                     const uint8_t *key, uint16_t keybytes)
+Blowfish_expand0state_words(blf_ctx *c, const uint32_t *key,
+                            uint16_t keywords)
 {
     int i;
     int k;
     uint16_t j;
-    uint32_t temp;
     uint32_t datal;
     uint32_t datar;
 
     j = 0;
     for(i = 0; i < BLF_N + 2; i++) {
-        /* Extract 4 int8 to 1 int32 from keystream */
-        temp = Blowfish_stream2word(key, keybytes, &j);
-        c->P[i] = c->P[i] ^ temp;
+        c->P[i] ^= key[j];
+        if(++j >= keywords)
+            j = 0;
     }
 
-    j = 0;
     datal = 0x00000000;
     datar = 0x00000000;
     for(i = 0; i < BLF_N + 2; i += 2) {
-        datal ^= Blowfish_stream2word(data, databytes, &j);
-        datar ^= Blowfish_stream2word(data, databytes, &j);
         Blowfish_encipher(c, &datal, &datar);
 
         c->P[i] = datal;
@@ -534,15 +538,61 @@ Blowfish_expandstate(blf_ctx *c, const uint8_t *data, uint16_t databytes,
 
     for(i = 0; i < 4; i++) {
         for(k = 0; k < 256; k += 2) {
-            datal ^= Blowfish_stream2word(data, databytes, &j);
-            datar ^= Blowfish_stream2word(data, databytes, &j);
             Blowfish_encipher(c, &datal, &datar);
 
             c->S[i][k] = datal;
             c->S[i][k + 1] = datar;
         }
     }
+}
+
+/* 'datawords' must be even */
+static void
+Blowfish_expandstate_words(blf_ctx *c, const uint32_t *data,
+                           uint16_t datawords,
+                           const uint32_t *key, uint16_t keywords)
+{
+    int i;
+    int k;
+    uint16_t j;
+    uint32_t datal;
+    uint32_t datar;
+
+    j = 0;
+    for(i = 0; i < BLF_N + 2; i++) {
+        c->P[i] ^= key[j];
+        if(++j >= keywords)
+            j = 0;
+    }
+
+    j = 0;
+    datal = 0x00000000;
+    datar = 0x00000000;
+    for(i = 0; i < BLF_N + 2; i += 2) {
+        datal ^= data[j];
+        datar ^= data[j + 1];
+        j += 2;
+        if(j >= datawords)
+            j = 0;
+        Blowfish_encipher(c, &datal, &datar);
+
+        c->P[i] = datal;
+        c->P[i + 1] = datar;
+    }
 
+    for(i = 0; i < 4; i++) {
+        for(k = 0; k < 256; k += 2) {
+            datal ^= data[j];
+            datar ^= data[j + 1];
+            j += 2;
+            if(j >= datawords)
+                j = 0;
+            Blowfish_encipher(c, &datal, &datar);
+
+            c->S[i][k] = datal;
+            c->S[i][k + 1] = datar;
+        }
+    }
 }
 
 #ifdef _DEBUG_BLOWFISH
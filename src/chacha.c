@@ -11,6 +11,29 @@
 
 #include "chacha.h"
 
+/* Bulk keystream is generated several blocks at a time, one state word of
+   every block per vector lane, where the compiler targets a SIMD unit.
+   Everything else (Xtensa, RISC-V) gets one block per call from the scalar
+   path below. Either way the message is XOR-ed a word at a time.
+   Building with -DCHACHA_LANES=1 forces the scalar path, e.g. to test it
+   on a host with SIMD. */
+#ifndef CHACHA_LANES
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CHACHA_LANES 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CHACHA_LANES 4
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CHACHA_LANES 4
+#else
+#define CHACHA_LANES 1
+#endif
+#elif CHACHA_LANES != 1
+#error "CHACHA_LANES can only be forced to 1"
+#endif
+
 /* $OpenBSD: chacha.c,v 1.1 2013/11/21 00:45:44 djm Exp $ */
 
 typedef unsigned char u8;
@@ -52,6 +75,224 @@ typedef struct chacha_ctx chacha_ctx;
   a = PLUS(a,b); d = ROTATE(XOR(d,a), 8); \
   c = PLUS(c,d); b = ROTATE(XOR(b,c), 7);
 
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CHACHA_LITTLE_ENDIAN 1
+#ifdef __GNUC__
+typedef u32 __attribute__((__may_alias__)) u32_alias;
+#else
+typedef u32 u32_alias;
+#endif
+#endif
+
+#if CHACHA_LANES > 1
+
+#if defined(__AVX2__)
+typedef __m256i chacha_vec;
+#define VADD(a, b)      _mm256_add_epi32(a, b)
+#define VXOR(a, b)      _mm256_xor_si256(a, b)
+#define VROTATE(v, n) \
+  _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define VSET1(w)        _mm256_set1_epi32((int)(w))
+#define VLANES()        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+#define VSTORE(p, v)    _mm256_storeu_si256((__m256i *)(void *)(p), v)
+#elif defined(__SSE2__)
+typedef __m128i chacha_vec;
+#define VADD(a, b)      _mm_add_epi32(a, b)
+#define VXOR(a, b)      _mm_xor_si128(a, b)
+#define VROTATE(v, n) \
+  _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define VSET1(w)        _mm_set1_epi32((int)(w))
+#define VLANES()        _mm_setr_epi32(0, 1, 2, 3)
+#define VSTORE(p, v)    _mm_storeu_si128((__m128i *)(void *)(p), v)
+#else /* __ARM_NEON */
+typedef uint32x4_t chacha_vec;
+static const u32 chacha_lanes[4] = { 0, 1, 2, 3 };
+#define VADD(a, b)      vaddq_u32(a, b)
+#define VXOR(a, b)      veorq_u32(a, b)
+#define VROTATE(v, n)   vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n))
+#define VSET1(w)        vdupq_n_u32(w)
+#define VLANES()        vld1q_u32(chacha_lanes)
+#define VSTORE(p, v)    vst1q_u32(p, v)
+#endif
+
+#define VQUARTERROUND(a,b,c,d) \
+  a = VADD(a,b); d = VROTATE(VXOR(d,a),16); \
+  c = VADD(c,d); b = VROTATE(VXOR(b,c),12); \
+  a = VADD(a,b); d = VROTATE(VXOR(d,a), 8); \
+  c = VADD(c,d); b = VROTATE(VXOR(b,c), 7);
+
+/* CHACHA_LANES blocks of keystream starting at the counter in 'input',
+   word w of block b goes to ks[w * CHACHA_LANES + b]. The caller makes
+   sure the 32 bit counter does not wrap inside the batch. */
+static void
+chacha_keystream(const u32 *input, u32 *ks)
+{
+  chacha_vec x[16], j[16];
+  int i;
+
+  for(i = 0; i < 16; i++)
+    j[i] = VSET1(input[i]);
+  j[12] = VADD(j[12], VLANES());
+
+  for(i = 0; i < 16; i++)
+    x[i] = j[i];
+
+  for(i = 20; i > 0; i -= 2) {
+    VQUARTERROUND(x[0], x[4], x[8], x[12])
+    VQUARTERROUND(x[1], x[5], x[9], x[13])
+    VQUARTERROUND(x[2], x[6], x[10], x[14])
+    VQUARTERROUND(x[3], x[7], x[11], x[15])
+    VQUARTERROUND(x[0], x[5], x[10], x[15])
+    VQUARTERROUND(x[1], x[6], x[11], x[12])
+    VQUARTERROUND(x[2], x[7], x[8], x[13])
+    VQUARTERROUND(x[3], x[4], x[9], x[14])
+  }
+
+  for(i = 0; i < 16; i++)
+    VSTORE(ks + i * CHACHA_LANES, VADD(x[i], j[i]));
+}
+
+/* c = m ^ keystream for CHACHA_LANES whole blocks */
+static void
+chacha_blocks(const u32 *input, const u8 *m, u8 *c)
+{
+  u32 ks[16 * CHACHA_LANES];
+  int b, w;
+
+  chacha_keystream(input, ks);
+
+#ifdef CHACHA_LITTLE_ENDIAN
+  if(!(((size_t)m | (size_t)c) & 3)) {
+    const u32_alias *mw = (const u32_alias *)(const void *)m;
+    u32_alias *cw = (u32_alias *)(void *)c;
+
+    for(b = 0; b < CHACHA_LANES; b++) {
+      for(w = 0; w < 16; w++)
+        cw[w] = mw[w] ^ ks[w * CHACHA_LANES + b];
+      mw += 16;
+      cw += 16;
+    }
+    return;
+  }
+#endif
+
+  for(b = 0; b < CHACHA_LANES; b++) {
+    for(w = 0; w < 16; w++) {
+      u32 v = XOR(U8TO32_LITTLE(m + 4 * w), ks[w * CHACHA_LANES + b]);
+      U32TO8_LITTLE(c + 4 * w, v);
+    }
+    m += 64;
+    c += 64;
+  }
+}
+
+#else /* CHACHA_LANES == 1 */
+
+#define XORWORD(i, v) \
+  cw[i] = XOR(mw[i], v)
+
+/* c = m ^ keystream for one block, fully in 32 bit registers */
+static void
+chacha_block_xor(const u32 *input, const u8 *m, u8 *c, int aligned)
+{
+  u32 x0 = input[0], x1 = input[1], x2 = input[2], x3 = input[3];
+  u32 x4 = input[4], x5 = input[5], x6 = input[6], x7 = input[7];
+  u32 x8 = input[8], x9 = input[9], x10 = input[10], x11 = input[11];
+  u32 x12 = input[12], x13 = input[13], x14 = input[14], x15 = input[15];
+#ifdef CHACHA_LITTLE_ENDIAN
+  const u32_alias *mw = (const u32_alias *)(const void *)m;
+  u32_alias *cw = (u32_alias *)(void *)c;
+#endif
+  int i;
+
+  for(i = 20; i > 0; i -= 4) {
+    QUARTERROUND(x0, x4, x8, x12)
+    QUARTERROUND(x1, x5, x9, x13)
+    QUARTERROUND(x2, x6, x10, x14)
+    QUARTERROUND(x3, x7, x11, x15)
+    QUARTERROUND(x0, x5, x10, x15)
+    QUARTERROUND(x1, x6, x11, x12)
+    QUARTERROUND(x2, x7, x8, x13)
+    QUARTERROUND(x3, x4, x9, x14)
+    QUARTERROUND(x0, x4, x8, x12)
+    QUARTERROUND(x1, x5, x9, x13)
+    QUARTERROUND(x2, x6, x10, x14)
+    QUARTERROUND(x3, x7, x11, x15)
+    QUARTERROUND(x0, x5, x10, x15)
+    QUARTERROUND(x1, x6, x11, x12)
+    QUARTERROUND(x2, x7, x8, x13)
+    QUARTERROUND(x3, x4, x9, x14)
+  }
+
+  x0 = PLUS(x0, input[0]);
+  x1 = PLUS(x1, input[1]);
+  x2 = PLUS(x2, input[2]);
+  x3 = PLUS(x3, input[3]);
+  x4 = PLUS(x4, input[4]);
+  x5 = PLUS(x5, input[5]);
+  x6 = PLUS(x6, input[6]);
+  x7 = PLUS(x7, input[7]);
+  x8 = PLUS(x8, input[8]);
+  x9 = PLUS(x9, input[9]);
+  x10 = PLUS(x10, input[10]);
+  x11 = PLUS(x11, input[11]);
+  x12 = PLUS(x12, input[12]);
+  x13 = PLUS(x13, input[13]);
+  x14 = PLUS(x14, input[14]);
+  x15 = PLUS(x15, input[15]);
+
+#ifdef CHACHA_LITTLE_ENDIAN
+  if(aligned) {
+    XORWORD(0, x0);
+    XORWORD(1, x1);
+    XORWORD(2, x2);
+    XORWORD(3, x3);
+    XORWORD(4, x4);
+    XORWORD(5, x5);
+    XORWORD(6, x6);
+    XORWORD(7, x7);
+    XORWORD(8, x8);
+    XORWORD(9, x9);
+    XORWORD(10, x10);
+    XORWORD(11, x11);
+    XORWORD(12, x12);
+    XORWORD(13, x13);
+    XORWORD(14, x14);
+    XORWORD(15, x15);
+    return;
+  }
+#else
+  (void)aligned;
+#endif
+
+  U32TO8_LITTLE(c + 0, XOR(x0, U8TO32_LITTLE(m + 0)));
+  U32TO8_LITTLE(c + 4, XOR(x1, U8TO32_LITTLE(m + 4)));
+  U32TO8_LITTLE(c + 8, XOR(x2, U8TO32_LITTLE(m + 8)));
+  U32TO8_LITTLE(c + 12, XOR(x3, U8TO32_LITTLE(m + 12)));
+  U32TO8_LITTLE(c + 16, XOR(x4, U8TO32_LITTLE(m + 16)));
+  U32TO8_LITTLE(c + 20, XOR(x5, U8TO32_LITTLE(m + 20)));
+  U32TO8_LITTLE(c + 24, XOR(x6, U8TO32_LITTLE(m + 24)));
+  U32TO8_LITTLE(c + 28, XOR(x7, U8TO32_LITTLE(m + 28)));
+  U32TO8_LITTLE(c + 32, XOR(x8, U8TO32_LITTLE(m + 32)));
+  U32TO8_LITTLE(c + 36, XOR(x9, U8TO32_LITTLE(m + 36)));
+  U32TO8_LITTLE(c + 40, XOR(x10, U8TO32_LITTLE(m + 40)));
+  U32TO8_LITTLE(c + 44, XOR(x11, U8TO32_LITTLE(m + 44)));
+  U32TO8_LITTLE(c + 48, XOR(x12, U8TO32_LITTLE(m + 48)));
+  U32TO8_LITTLE(c + 52, XOR(x13, U8TO32_LITTLE(m + 52)));
+  U32TO8_LITTLE(c + 56, XOR(x14, U8TO32_LITTLE(m + 56)));
+  U32TO8_LITTLE(c + 60, XOR(x15, U8TO32_LITTLE(m + 60)));
+}
+
+/* c = m ^ keystream for one whole block */
+static void
+chacha_blocks(const u32 *input, const u8 *m, u8 *c)
+{
+  chacha_block_xor(input, m, c, !(((size_t)m | (size_t)c) & 3));
+}
+
+#endif /* CHACHA_LANES */
+
 static const char sigma[17] = "expand 32-byte k";
 static const char tau[17] = "expand 16-byte k";
 
@@ -99,6 +340,23 @@ chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes)
   u8 tmp[64];
   u_int i;
 
+  if(!bytes)
+      return;
+
+  /* whole batches of blocks, the loop below does the rest */
+  while(bytes >= CHACHA_BLOCKLEN * CHACHA_LANES &&
+        x->input[12] <= U32C(0xFFFFFFFF) - (CHACHA_LANES - 1)) {
+    chacha_blocks(x->input, m, c);
+
+    x->input[12] = U32V(x->input[12] + CHACHA_LANES);
+    if(!x->input[12])
+      x->input[13] = PLUSONE(x->input[13]);
+
+    bytes -= CHACHA_BLOCKLEN * CHACHA_LANES;
+    m += CHACHA_BLOCKLEN * CHACHA_LANES;
+    c += CHACHA_BLOCKLEN * CHACHA_LANES;
+  }
+
   if(!bytes)
       return;
 
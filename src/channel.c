@@ -64,16 +64,11 @@ uint32_t
 _libssh2_channel_nextid(LIBSSH2_SESSION * session)
 {
     uint32_t id = session->next_channel;
-    LIBSSH2_CHANNEL *channel;
-
-    channel = _libssh2_list_first(&session->channels);
 
-    while(channel) {
-        if(channel->local.id > id) {
-            id = channel->local.id;
-        }
-        channel = _libssh2_list_next(&channel->node);
-    }
+    /* Ids are handed out in sequence, so a channel that is still around
+       can only be in the way once they have wrapped around */
+    while(_libssh2_channel_locate(session, id))
+        id++;
 
     /* This is a shortcut to avoid waiting for close packets on channels we've
      * forgotten about, This *could* be a problem if we request and close 4
@@ -88,6 +83,128 @@ _libssh2_channel_nextid(LIBSSH2_SESSION * session)
     return id;
 }
 
+/*
+ * channel_index_grow
+ *
+ * Move the channel index to a table twice the size. Returns non-zero if
+ * there is no memory for it.
+ */
+static int
+channel_index_grow(LIBSSH2_SESSION *session)
+{
+    struct channel_index *index = &session->channel_index;
+    size_t size = index->size ? index->size * 2 : 16;
+    LIBSSH2_CHANNEL **slots;
+    size_t i;
+
+    slots = LIBSSH2_CALLOC(session, size * sizeof(*slots));
+    if(!slots)
+        return -1;
+
+    for(i = 0; i < index->size; i++) {
+        LIBSSH2_CHANNEL *channel = index->slots[i];
+        if(channel) {
+            size_t slot = channel->local.id & (size - 1);
+            while(slots[slot])
+                slot = (slot + 1) & (size - 1);
+            slots[slot] = channel;
+        }
+    }
+
+    if(index->slots)
+        LIBSSH2_FREE(session, index->slots);
+    index->slots = slots;
+    index->size = size;
+
+    return 0;
+}
+
+/*
+ * _libssh2_channel_index_add
+ *
+ * Make a channel, which is about to be linked into the session or a
+ * listener's queue, known to _libssh2_channel_locate(). If the index can't
+ * grow the channel is left out of it and found by a scan instead.
+ */
+void
+_libssh2_channel_index_add(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    struct channel_index *index = &session->channel_index;
+    size_t slot;
+
+    /* keep it at most half full, but a fuller one still works */
+    if((index->count + 1) * 2 > index->size &&
+       channel_index_grow(session) &&
+       index->count + 1 >= index->size) {
+        index->unindexed++;
+        return;
+    }
+
+    slot = channel->local.id & (index->size - 1);
+    while(index->slots[slot])
+        slot = (slot + 1) & (index->size - 1);
+    index->slots[slot] = channel;
+    index->count++;
+}
+
+/*
+ * _libssh2_channel_index_remove
+ *
+ * Forget about a channel that is being unlinked for good
+ */
+void
+_libssh2_channel_index_remove(LIBSSH2_SESSION *session,
+                              LIBSSH2_CHANNEL *channel)
+{
+    struct channel_index *index = &session->channel_index;
+    size_t mask = index->size - 1;
+    size_t hole;
+    size_t slot;
+
+    if(!index->size) {
+        index->unindexed--;
+        return;
+    }
+
+    for(hole = channel->local.id & mask; index->slots[hole] != channel;
+        hole = (hole + 1) & mask) {
+        if(!index->slots[hole]) {
+            /* it didn't fit in when it was added */
+            index->unindexed--;
+            return;
+        }
+    }
+
+    /* Close the hole by moving back the channels after it that would
+       otherwise be cut off from their home slot */
+    index->slots[hole] = NULL;
+    index->count--;
+    for(slot = (hole + 1) & mask; index->slots[slot];
+        slot = (slot + 1) & mask) {
+        size_t home = index->slots[slot]->local.id & mask;
+        if(((slot - home) & mask) >= ((slot - hole) & mask)) {
+            index->slots[hole] = index->slots[slot];
+            index->slots[slot] = NULL;
+            hole = slot;
+        }
+    }
+}
+
+/*
+ * _libssh2_channel_index_free
+ *
+ * Free the channel index of a session
+ */
+void
+_libssh2_channel_index_free(LIBSSH2_SESSION *session)
+{
+    struct channel_index *index = &session->channel_index;
+
+    if(index->slots)
+        LIBSSH2_FREE(session, index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
 /*
  * _libssh2_channel_locate
  *
@@ -96,9 +213,26 @@ _libssh2_channel_nextid(LIBSSH2_SESSION * session)
 LIBSSH2_CHANNEL *
 _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
 {
+    struct channel_index *index = &session->channel_index;
     LIBSSH2_CHANNEL *channel;
     LIBSSH2_LISTENER *l;
 
+    if(index->size) {
+        size_t mask = index->size - 1;
+        size_t slot;
+
+        for(slot = channel_id & mask; index->slots[slot];
+            slot = (slot + 1) & mask) {
+            if(index->slots[slot]->local.id == channel_id)
+                return index->slots[slot];
+        }
+    }
+
+    if(!index->unindexed)
+        return NULL;
+
+    /* Some channels didn't make it into the index, look for it among all
+       of them */
     for(channel = _libssh2_list_first(&session->channels);
         channel;
         channel = _libssh2_list_next(&channel->node)) {
@@ -122,6 +256,198 @@ _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
     return NULL;
 }
 
+/*
+ * channel_data_packet
+ *
+ * Return the queued packet holding the next data to read from 'stream_id' of
+ * a channel, or NULL if there is none. _libssh2_packet_add() has checked the
+ * headers of all of them.
+ */
+static LIBSSH2_PACKET *
+channel_data_packet(LIBSSH2_CHANNEL *channel, int stream_id)
+{
+    LIBSSH2_PACKET *data = _libssh2_list_first(&channel->data_packets);
+    LIBSSH2_PACKET *ext = _libssh2_list_first(&channel->ext_packets);
+
+    if(!stream_id) {
+        /* with extended_data_merge the standard stream also returns
+           extended data, in the order the two came in */
+        if(ext && (channel->remote.extended_data_ignore_mode ==
+                   LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE) &&
+           (!data || (int32_t)(ext->seq - data->seq) < 0))
+            return ext;
+        return data;
+    }
+
+    while(ext && _libssh2_ntohu32(ext->data + 5) != (uint32_t)stream_id)
+        ext = _libssh2_list_next(&ext->node);
+
+    return ext;
+}
+
+/*
+ * channel_data_free
+ *
+ * Throw away all the data queued on a channel
+ */
+static void
+channel_data_free(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_PACKET *packet;
+
+    channel->read_lent = NULL;
+    while((packet = _libssh2_list_first(&channel->data_packets)))
+        _libssh2_packet_free(channel->session, packet);
+    while((packet = _libssh2_list_first(&channel->ext_packets)))
+        _libssh2_packet_free(channel->session, packet);
+}
+
+/*
+ * _libssh2_channel_window_init
+ *
+ * Give a new channel its receive window. It gets what was asked for, but no
+ * more than half of what is left of the session's window budget, so there
+ * is room for other channels and for this one to grow. The peer must be
+ * able to send at least one packet however full the budget is.
+ *
+ * remote.packet_size must be set first.
+ */
+void
+_libssh2_channel_window_init(LIBSSH2_CHANNEL *channel, uint32_t window)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    size_t room = 0;
+
+    if(session->window_budget > session->window_reserved)
+        room = session->window_budget - session->window_reserved;
+    room = LIBSSH2_MAX(room / 2, channel->remote.packet_size);
+
+    if(window > room)
+        window = (uint32_t)room;
+
+    channel->remote.window_size = window;
+    channel->remote.window_size_initial = window;
+    channel->window_target = window;
+    session->window_reserved += window;
+}
+
+/*
+ * _libssh2_channel_window_free
+ *
+ * Give a channel's share of the window budget back to the session
+ */
+void
+_libssh2_channel_window_free(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+
+    if(session->window_reserved > channel->window_target)
+        session->window_reserved -= channel->window_target;
+    else
+        session->window_reserved = 0;
+    channel->window_target = 0;
+}
+
+/*
+ * channel_rtt_sample
+ *
+ * Fold a measured round trip into the session's smoothed estimate
+ */
+static void
+channel_rtt_sample(LIBSSH2_SESSION *session, libssh2_uint64_t rtt)
+{
+    if(!rtt)
+        rtt = 1;
+
+    if(!session->rtt)
+        session->rtt = rtt;
+    else {
+        /* a peer that had nothing more to send makes a round trip look
+           long, so one sample may at most double the estimate */
+        if(rtt > session->rtt * 2)
+            rtt = session->rtt * 2;
+        session->rtt = (session->rtt * 7 + rtt) / 8;
+    }
+}
+
+/*
+ * _libssh2_channel_window_sample
+ *
+ * Data came in on a channel. If it is the answer to window sent to a peer
+ * that had none left, the time since then is a round trip.
+ */
+void
+_libssh2_channel_window_sample(LIBSSH2_CHANNEL *channel)
+{
+    if(channel->window_sent) {
+        channel_rtt_sample(channel->session,
+                           _libssh2_now_us() - channel->window_sent);
+        channel->window_sent = 0;
+    }
+}
+
+/*
+ * channel_window_consumed
+ *
+ * Account for 'len' bytes the application has read off a channel. They
+ * leave the receive window, and they count towards the throughput which the
+ * window target is sized from: the peer should be able to send twice what
+ * is read in a round trip without waiting for a window adjust, as in TCP
+ * receive buffer autotuning. The target only grows, within the budget.
+ */
+static void
+channel_window_consumed(LIBSSH2_CHANNEL *channel, size_t len)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    libssh2_uint64_t now;
+    libssh2_uint64_t elapsed;
+    libssh2_uint64_t want;
+    size_t room = 0;
+
+    channel->remote.window_size -= (uint32_t)len;
+    channel->window_read += len;
+
+    if(!session->rtt)
+        return;
+
+    now = _libssh2_now_us();
+    if(!channel->window_mark) {
+        channel->window_mark = now;
+        channel->window_read = 0;
+        return;
+    }
+
+    elapsed = now - channel->window_mark;
+    if(elapsed < session->rtt)
+        return;
+
+    want = (libssh2_uint64_t)channel->window_read * 2 * session->rtt /
+        elapsed;
+    channel->window_read = 0;
+    channel->window_mark = now;
+
+    if(want <= channel->window_target)
+        return;
+
+    if(session->window_budget > session->window_reserved)
+        room = session->window_budget - session->window_reserved;
+    if(want - channel->window_target > room)
+        want = channel->window_target + room;
+    if(want > LIBSSH2_CHANNEL_WINDOW_MAX)
+        want = LIBSSH2_CHANNEL_WINDOW_MAX;
+    if(want <= channel->window_target)
+        return;
+
+    _libssh2_debug((session, LIBSSH2_TRACE_CONN,
+                   "Growing receive window of channel %u/%u from %u to %u "
+                   "bytes, rtt %u us", channel->local.id, channel->remote.id,
+                   channel->window_target, (uint32_t)want,
+                   (uint32_t)session->rtt));
+
+    session->window_reserved += (size_t)(want - channel->window_target);
+    channel->window_target = (uint32_t)want;
+}
+
 /*
  * _libssh2_channel_open
  *
@@ -156,6 +482,11 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         memset(&session->open_packet_requirev_state, 0,
                sizeof(session->open_packet_requirev_state));
 
+        /* Don't ask for packets larger than our transport buffers are
+           sized for */
+        if(packet_size > _libssh2_transport_max_payload(session))
+            packet_size = (uint32_t)_libssh2_transport_max_payload(session);
+
         _libssh2_debug((session, LIBSSH2_TRACE_CONN,
                        "Opening Channel - win %d pack %d", window_size,
                        packet_size));
@@ -181,13 +512,14 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
 
         /* REMEMBER: local as in locally sourced */
         session->open_channel->local.id = session->open_local_channel;
-        session->open_channel->remote.window_size = window_size;
-        session->open_channel->remote.window_size_initial = window_size;
         session->open_channel->remote.packet_size = packet_size;
         session->open_channel->session = session;
+        _libssh2_channel_window_init(session->open_channel, window_size);
+        window_size = session->open_channel->remote.window_size;
 
         _libssh2_list_add(&session->channels,
                           &session->open_channel->node);
+        _libssh2_channel_index_add(session, session->open_channel);
 
         s = session->open_packet =
             LIBSSH2_ALLOC(session, session->open_packet_len);
@@ -223,6 +555,8 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
             goto channel_error;
         }
 
+        /* the confirmation is a round trip sample */
+        session->open_channel->window_sent = _libssh2_now_us();
         session->open_state = libssh2_NB_state_sent;
     }
 
@@ -264,6 +598,7 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
                 _libssh2_ntohu32(session->open_data + 9);
             session->open_channel->local.packet_size =
                 _libssh2_ntohu32(session->open_data + 13);
+            _libssh2_channel_window_sample(session->open_channel);
             _libssh2_debug((session, LIBSSH2_TRACE_CONN,
                            "Connection Established - ID: %u/%u win: %u/%u"
                            " pack: %u/%u",
@@ -321,25 +656,14 @@ channel_error:
         session->open_packet = NULL;
     }
     if(session->open_channel) {
-        unsigned char channel_id[4];
         LIBSSH2_FREE(session, session->open_channel->channel_type);
 
         _libssh2_list_remove(&session->open_channel->node);
+        _libssh2_channel_index_remove(session, session->open_channel);
+        _libssh2_channel_window_free(session->open_channel);
 
         /* Clear out packets meant for this channel */
-        _libssh2_htonu32(channel_id, session->open_channel->local.id);
-        while((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
-                                   &session->open_data,
-                                   &session->open_data_len, 1,
-                                   channel_id, 4) >= 0)
-              ||
-              (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
-                                   &session->open_data,
-                                   &session->open_data_len, 1,
-                                   channel_id, 4) >= 0)) {
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
-        }
+        channel_data_free(session->open_channel);
 
         LIBSSH2_FREE(session, session->open_channel);
         session->open_channel = NULL;
@@ -1671,44 +1995,27 @@ int
 _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
 {
     if(channel->flush_state == libssh2_NB_state_idle) {
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
+        struct list_head *queues[2];
+        int i;
+
+        queues[0] = &channel->data_packets;
+        queues[1] = &channel->ext_packets;
+        channel->read_lent = NULL;
         channel->flush_refund_bytes = 0;
         channel->flush_flush_bytes = 0;
 
-        while(packet) {
-            unsigned char packet_type;
-            LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+        for(i = 0; i < 2; i++) {
+            LIBSSH2_PACKET *packet = _libssh2_list_first(queues[i]);
 
-            if(packet->data_len < 1) {
-                packet = next;
-                _libssh2_debug((channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length"));
-                continue;
-            }
-
-            packet_type = packet->data[0];
-
-            if(((packet_type == SSH_MSG_CHANNEL_DATA)
-                || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-               && ((packet->data_len >= 5)
-                   && (_libssh2_ntohu32(packet->data + 1)
-                       == channel->local.id))) {
-                /* It's our channel at least */
+            while(packet) {
+                LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+                unsigned char packet_type = packet->data[0];
                 int packet_stream_id;
 
-                if(packet_type == SSH_MSG_CHANNEL_DATA) {
+                if(packet_type == SSH_MSG_CHANNEL_DATA)
                     packet_stream_id = 0;
-                }
-                else if(packet->data_len >= 9) {
-                    packet_stream_id = _libssh2_ntohu32(packet->data + 5);
-                }
-                else {
-                    channel->flush_state = libssh2_NB_state_idle;
-                    return _libssh2_error(channel->session,
-                                          LIBSSH2_ERROR_PROTO,
-                                          "Unexpected packet length");
-                }
+                else
+                    packet_stream_id = (int)_libssh2_ntohu32(packet->data + 5);
 
                 if((streamid == LIBSSH2_CHANNEL_FLUSH_ALL)
                     || ((packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA)
@@ -1729,14 +2036,11 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
                     channel->flush_refund_bytes += packet->data_len - 13;
                     channel->flush_flush_bytes += bytes_to_flush;
 
-                    LIBSSH2_FREE(channel->session, packet->data);
-
-                    /* remove this packet from the parent's list */
-                    _libssh2_list_remove(&packet->node);
-                    LIBSSH2_FREE(channel->session, packet);
+                    /* remove this packet from the channel's queue */
+                    _libssh2_packet_free(channel->session, packet);
                 }
+                packet = next;
             }
-            packet = next;
         }
 
         channel->flush_state = libssh2_NB_state_created;
@@ -1923,7 +2227,15 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                               "packet, deferring");
     }
     else {
-        channel->remote.window_size += adjustment;
+        /* a peer that had used up its window has been waiting for this
+           one, so the next data it sends times a round trip */
+        if(channel->remote.window_size <= channel->read_avail)
+            channel->window_sent = _libssh2_now_us();
+
+        /* what the packet says, as a resumed send may have been passed
+           a different adjustment */
+        channel->remote.window_size +=
+            _libssh2_ntohu32(&channel->adjust_adjust[5]);
     }
 
     channel->adjust_state = libssh2_NB_state_idle;
@@ -2057,6 +2369,43 @@ libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
 #endif
 
 
+/*
+ * channel_read_window
+ *
+ * Top the receive window up to the channel's target once the application has
+ * read enough for an adjust to be worth a packet, rather than waiting for the
+ * peer to run out. Returns 0 or the error of the window adjust.
+ */
+static int
+channel_read_window(LIBSSH2_CHANNEL *channel)
+{
+    uint32_t target = channel->window_target;
+    uint32_t window = channel->remote.window_size;
+    int rc;
+
+    if((channel->read_state == libssh2_NB_state_jump1) ||
+       ((window < target) &&
+        (target - window >= LIBSSH2_MAX(target / 8,
+                                        LIBSSH2_CHANNEL_MINADJUST)))) {
+
+        uint32_t adjustment = window < target ? target - window : 0;
+        if(adjustment < LIBSSH2_CHANNEL_MINADJUST)
+            adjustment = LIBSSH2_CHANNEL_MINADJUST;
+
+        /* the actual window adjusting may not finish so we need to deal with
+           this special state here */
+        channel->read_state = libssh2_NB_state_jump1;
+        rc = _libssh2_channel_receive_window_adjust(channel, adjustment,
+                                                    0, NULL);
+        if(rc)
+            return rc;
+
+        channel->read_state = libssh2_NB_state_idle;
+    }
+
+    return 0;
+}
+
 /*
  * _libssh2_channel_read
  *
@@ -2077,8 +2426,7 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     size_t bytes_read = 0;
     size_t bytes_want;
     int unlink_packet;
-    LIBSSH2_PACKET *read_packet;
-    LIBSSH2_PACKET *read_next;
+    LIBSSH2_PACKET *readpkt;
 
     _libssh2_debug((session, LIBSSH2_TRACE_CONN,
                    "channel_read() wants %ld bytes from channel %u/%u "
@@ -2086,26 +2434,13 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
                    (long)buflen, channel->local.id, channel->remote.id,
                    stream_id));
 
-    /* expand the receiving window first if it has become too narrow */
-    if((channel->read_state == libssh2_NB_state_jump1) ||
-       (channel->remote.window_size <
-        channel->remote.window_size_initial / 4 * 3 + buflen)) {
-
-        uint32_t adjustment = (uint32_t)(channel->remote.window_size_initial +
-            buflen - channel->remote.window_size);
-        if(adjustment < LIBSSH2_CHANNEL_MINADJUST)
-            adjustment = LIBSSH2_CHANNEL_MINADJUST;
+    /* copying ends any loan of data from the queues */
+    channel->read_lent = NULL;
 
-        /* the actual window adjusting may not finish so we need to deal with
-           this special state here */
-        channel->read_state = libssh2_NB_state_jump1;
-        rc = _libssh2_channel_receive_window_adjust(channel, adjustment,
-                                                    0, NULL);
-        if(rc)
-            return rc;
-
-        channel->read_state = libssh2_NB_state_idle;
-    }
+    /* refill the receiving window first if enough has been read */
+    rc = channel_read_window(channel);
+    if(rc)
+        return rc;
 
     /* Process all pending incoming packets. Tests prove that this way
        produces faster transfers. */
@@ -2116,93 +2451,43 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
         return _libssh2_error(session, rc, "transport read");
 
-    read_packet = _libssh2_list_first(&session->packets);
-    while(read_packet && (bytes_read < buflen)) {
-        /* previously this loop condition also checked for
-           !channel->remote.close but we cannot let it do this:
-
-           We may have a series of packets to read that are still pending even
-           if a close has been received. Acknowledging the close too early
-           makes us flush buffers prematurely and loose data.
-        */
-
-        LIBSSH2_PACKET *readpkt = read_packet;
-
-        /* In case packet gets destroyed during this iteration */
-        read_next = _libssh2_list_next(&readpkt->node);
-
-        if(readpkt->data_len < 5) {
-            read_packet = read_next;
+    /* previously this loop condition also checked for
+       !channel->remote.close but we cannot let it do this:
 
-            if(readpkt->data_len != 1 ||
-                readpkt->data[0] != SSH_MSG_REQUEST_FAILURE) {
-                _libssh2_debug((channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length"));
-            }
+       We may have a series of packets to read that are still pending even
+       if a close has been received. Acknowledging the close too early
+       makes us flush buffers prematurely and loose data.
+    */
+    while((bytes_read < buflen) &&
+          (readpkt = channel_data_packet(channel, stream_id))) {
+        /* figure out much more data we want to read */
+        bytes_want = buflen - bytes_read;
+        unlink_packet = FALSE;
 
-            continue;
+        if(bytes_want >= (readpkt->data_len - readpkt->data_head)) {
+            /* we want more than this node keeps, so adjust the number and
+               delete this node after the copy */
+            bytes_want = readpkt->data_len - readpkt->data_head;
+            unlink_packet = TRUE;
         }
 
-        channel->read_local_id =
-            _libssh2_ntohu32(readpkt->data + 1);
+        _libssh2_debug((session, LIBSSH2_TRACE_CONN,
+                       "channel_read() got %ld of data from %u/%u/%d%s",
+                       (long)bytes_want, channel->local.id,
+                       channel->remote.id, stream_id,
+                       unlink_packet ? " [ul]" : ""));
 
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if((stream_id
-             && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == channel->read_local_id)
-             && (readpkt->data_len >= 9)
-             && (stream_id == (int) _libssh2_ntohu32(readpkt->data + 5)))
-            || (!stream_id && (readpkt->data[0] == SSH_MSG_CHANNEL_DATA)
-                && (channel->local.id == channel->read_local_id))
-            || (!stream_id
-                && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                && (channel->local.id == channel->read_local_id)
-                && (channel->remote.extended_data_ignore_mode ==
-                    LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
-
-            /* figure out much more data we want to read */
-            bytes_want = buflen - bytes_read;
-            unlink_packet = FALSE;
-
-            if(bytes_want >= (readpkt->data_len - readpkt->data_head)) {
-                /* we want more than this node keeps, so adjust the number and
-                   delete this node after the copy */
-                bytes_want = readpkt->data_len - readpkt->data_head;
-                unlink_packet = TRUE;
-            }
+        /* copy data from this struct to the target buffer */
+        memcpy(&buf[bytes_read],
+               &readpkt->data[readpkt->data_head], bytes_want);
 
-            _libssh2_debug((session, LIBSSH2_TRACE_CONN,
-                           "channel_read() got %ld of data from %u/%u/%d%s",
-                           (long)bytes_want, channel->local.id,
-                           channel->remote.id, stream_id,
-                           unlink_packet ? " [ul]" : ""));
-
-            /* copy data from this struct to the target buffer */
-            memcpy(&buf[bytes_read],
-                   &readpkt->data[readpkt->data_head], bytes_want);
-
-            /* advance pointer and counter */
-            readpkt->data_head += bytes_want;
-            bytes_read += bytes_want;
-
-            /* if drained, remove from list */
-            if(unlink_packet) {
-                /* detach readpkt from session->packets list */
-                _libssh2_list_remove(&readpkt->node);
-
-                LIBSSH2_FREE(session, readpkt->data);
-                LIBSSH2_FREE(session, readpkt);
-            }
-        }
+        /* advance pointer and counter */
+        readpkt->data_head += bytes_want;
+        bytes_read += bytes_want;
 
-        /* check the next struct in the chain */
-        read_packet = read_next;
+        /* if drained, remove from the channel's queue and recycle it */
+        if(unlink_packet)
+            _libssh2_packet_free(session, readpkt);
     }
 
     if(!bytes_read) {
@@ -2220,7 +2505,7 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
     }
 
     channel->read_avail -= bytes_read;
-    channel->remote.window_size -= (uint32_t)bytes_read;
+    channel_window_consumed(channel, bytes_read);
 
     return bytes_read;
 }
@@ -2262,6 +2547,115 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
     return rc;
 }
 
+/*
+ * channel_read_borrow
+ *
+ * Lend the caller the unread part of the next packet of data on a stream,
+ * straight from the buffer it was decrypted into. Returns its length, 0 at
+ * the end of the stream, or a negative error code.
+ */
+static ssize_t
+channel_read_borrow(LIBSSH2_CHANNEL *channel, int stream_id,
+                    const char **data)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_PACKET *readpkt;
+    int rc;
+
+    rc = channel_read_window(channel);
+    if(rc)
+        return rc;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while(rc > 0);
+
+    if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "transport read");
+
+    /* an empty packet has nothing to lend, and 0 would read as end of
+       stream */
+    while((readpkt = channel_data_packet(channel, stream_id)) &&
+          (readpkt->data_head == readpkt->data_len)) {
+        if(readpkt == channel->read_lent)
+            channel->read_lent = NULL;
+        _libssh2_packet_free(session, readpkt);
+    }
+
+    if(!readpkt) {
+        /* same as _libssh2_channel_read() when nothing was copied */
+        if(channel->remote.eof || channel->remote.close)
+            return 0;
+        else if(rc != LIBSSH2_ERROR_EAGAIN)
+            return 0;
+
+        return _libssh2_error(session, rc, "would block");
+    }
+
+    _libssh2_debug((session, LIBSSH2_TRACE_CONN,
+                   "channel_read_borrow() lends %ld bytes from %u/%u/%d",
+                   (long)(readpkt->data_len - readpkt->data_head),
+                   channel->local.id, channel->remote.id, stream_id));
+
+    channel->read_lent = readpkt;
+    *data = (const char *)&readpkt->data[readpkt->data_head];
+
+    return (ssize_t)(readpkt->data_len - readpkt->data_head);
+}
+
+/*
+ * libssh2_channel_read_borrow_ex
+ *
+ * Read without copying: point '*data' at the next bytes of a stream, inside
+ * the packet they came in, and return how many there are. The bytes stay
+ * queued until given back with libssh2_channel_read_release(). A read, flush
+ * or free of the channel ends the loan.
+ */
+LIBSSH2_API ssize_t
+libssh2_channel_read_borrow_ex(LIBSSH2_CHANNEL *channel, int stream_id,
+                               const char **data)
+{
+    ssize_t rc;
+
+    if(!channel || !data)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, channel->session,
+                 channel_read_borrow(channel, stream_id, data));
+    return rc;
+}
+
+/*
+ * libssh2_channel_read_release
+ *
+ * Mark the first 'len' bytes of what libssh2_channel_read_borrow_ex() lent
+ * as read and end the loan. The packet goes back to the pool once all of it
+ * has been read.
+ */
+LIBSSH2_API int
+libssh2_channel_read_release(LIBSSH2_CHANNEL *channel, size_t len)
+{
+    LIBSSH2_PACKET *readpkt;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    readpkt = channel->read_lent;
+    if(!readpkt || (len > readpkt->data_len - readpkt->data_head))
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_BAD_USE,
+                              "Releasing data that was not borrowed");
+
+    channel->read_lent = NULL;
+    readpkt->data_head += len;
+    channel->read_avail -= len;
+    channel_window_consumed(channel, len);
+
+    if(readpkt->data_head == readpkt->data_len)
+        _libssh2_packet_free(channel->session, readpkt);
+
+    return 0;
+}
+
 /*
  * _libssh2_channel_packet_data_len
  *
@@ -2271,57 +2665,63 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
 size_t
 _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
 {
-    LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_PACKET *read_packet;
-    LIBSSH2_PACKET *next_packet;
-    uint32_t read_local_id;
+    LIBSSH2_PACKET *read_packet = channel_data_packet(channel, stream_id);
 
-    read_packet = _libssh2_list_first(&session->packets);
     if(!read_packet)
         return 0;
 
-    while(read_packet) {
+    return read_packet->data_len - read_packet->data_head;
+}
 
-        next_packet = _libssh2_list_next(&read_packet->node);
+/*
+ * channel_write_header
+ *
+ * Prepare the header of the next data message of a write, for as much of the
+ * 'buflen' bytes left as the remote end's window and packet size allow. The
+ * transport layer splits it up if it does not fit in one packet of this
+ * session.
+ */
+static void
+channel_write_header(LIBSSH2_CHANNEL *channel, int stream_id, size_t buflen)
+{
+    unsigned char *s = channel->write_packet;
 
-        if(read_packet->data_len < 5) {
-            read_packet = next_packet;
-            _libssh2_debug((channel->session, LIBSSH2_TRACE_ERROR,
-                           "Unexpected packet length"));
-            continue;
-        }
+    channel->write_bufwrite = buflen;
 
-        read_local_id = _libssh2_ntohu32(read_packet->data + 1);
+    *(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA :
+        SSH_MSG_CHANNEL_DATA;
+    _libssh2_store_u32(&s, channel->remote.id);
+    if(stream_id)
+        _libssh2_store_u32(&s, stream_id);
 
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if((stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (read_packet->data_len >= 9)
-             && (stream_id == (int) _libssh2_ntohu32(read_packet->data + 5)))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             && (channel->local.id == read_local_id))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (channel->remote.extended_data_ignore_mode
-                 == LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
-            return read_packet->data_len - read_packet->data_head;
-        }
-
-        read_packet = next_packet;
+    /* Don't exceed the remote end's limits */
+    /* REMEMBER local means local as the SOURCE of the data */
+    if(channel->write_bufwrite > channel->local.window_size) {
+        _libssh2_debug((channel->session, LIBSSH2_TRACE_CONN,
+                       "Splitting write block due to %u byte "
+                       "window_size on %u/%u/%d",
+                       channel->local.window_size, channel->local.id,
+                       channel->remote.id, stream_id));
+        channel->write_bufwrite = channel->local.window_size;
+    }
+    if(channel->write_bufwrite > channel->local.packet_size) {
+        _libssh2_debug((channel->session, LIBSSH2_TRACE_CONN,
+                       "Splitting write block due to %u byte "
+                       "packet_size on %u/%u/%d",
+                       channel->local.packet_size, channel->local.id,
+                       channel->remote.id, stream_id));
+        channel->write_bufwrite = channel->local.packet_size;
     }
 
-    return 0;
+    /* store the size here only, the buffer is passed in as-is to
+       _libssh2_transport_send() */
+    _libssh2_store_u32(&s, (uint32_t)channel->write_bufwrite);
+    channel->write_packet_len = s - channel->write_packet;
+
+    _libssh2_debug((channel->session, LIBSSH2_TRACE_CONN,
+                   "Sending %ld bytes on channel %u/%u, stream_id=%d",
+                   (long)channel->write_bufwrite, channel->local.id,
+                   channel->remote.id, stream_id));
 }
 
 /*
@@ -2338,23 +2738,18 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                        const unsigned char *buf, size_t buflen)
 {
     int rc = 0;
+    int flush_rc;
+    int split;
     LIBSSH2_SESSION *session = channel->session;
     ssize_t wrote = 0; /* counter for this specific this call */
 
-    /* In theory we could split larger buffers into several smaller packets
-     * but it turns out to be really hard and nasty to do while still offering
-     * the API/prototype.
-     *
-     * Instead we only deal with the first 32K in this call and for the parent
-     * function to call it again with the remainder! 32K is a conservative
-     * limit based on the text in RFC4253 section 6.1.
+    /* There is no size limit here, the data is only limited by the remote
+     * end's window below. It is sent as as many messages as that and the
+     * socket take, and the transport layer splits up those that don't fit
+     * in a single SSH packet of ours.
      */
-    if(buflen > 32700)
-        buflen = 32700;
 
     if(channel->write_state == libssh2_NB_state_idle) {
-        unsigned char *s = channel->write_packet;
-
         _libssh2_debug((channel->session, LIBSSH2_TRACE_CONN,
                        "Writing %ld bytes on channel %u/%u, stream #%d",
                        (long)buflen, channel->local.id, channel->remote.id,
@@ -2386,83 +2781,140 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
 
             /* Waiting on the socket to be writable would be wrong because we
              * would be back here immediately, but a readable socket might
-             * herald an incoming window adjustment.
+             * herald an incoming window adjustment. Packets still queued
+             * from an earlier call keep the outbound direction set, the peer
+             * may only adjust the window once it has them.
              */
             session->socket_block_directions = LIBSSH2_SESSION_BLOCK_INBOUND;
+            if((size_t)session->packet.ototal_num > session->packet.osent)
+                session->socket_block_directions |=
+                    LIBSSH2_SESSION_BLOCK_OUTBOUND;
+
+            /* the stall lasts until a write finds room again */
+            if(!channel->write_stall_start)
+                channel->write_stall_start = _libssh2_now_us();
 
             return rc == LIBSSH2_ERROR_EAGAIN ? rc : 0;
         }
 
-        channel->write_bufwrite = buflen;
-
-        *(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA :
-            SSH_MSG_CHANNEL_DATA;
-        _libssh2_store_u32(&s, channel->remote.id);
-        if(stream_id)
-            _libssh2_store_u32(&s, stream_id);
-
-        /* Don't exceed the remote end's limits */
-        /* REMEMBER local means local as the SOURCE of the data */
-        if(channel->write_bufwrite > channel->local.window_size) {
-            _libssh2_debug((session, LIBSSH2_TRACE_CONN,
-                           "Splitting write block due to %u byte "
-                           "window_size on %u/%u/%d",
-                           channel->local.window_size, channel->local.id,
-                           channel->remote.id, stream_id));
-            channel->write_bufwrite = channel->local.window_size;
-        }
-        if(channel->write_bufwrite > channel->local.packet_size) {
-            _libssh2_debug((session, LIBSSH2_TRACE_CONN,
-                           "Splitting write block due to %u byte "
-                           "packet_size on %u/%u/%d",
-                           channel->local.packet_size, channel->local.id,
-                           channel->remote.id, stream_id));
-            channel->write_bufwrite = channel->local.packet_size;
+        if(channel->write_stall_start) {
+            session->stats.window_stall_time +=
+                _libssh2_now_us() - channel->write_stall_start;
+            channel->write_stall_start = 0;
         }
-        /* store the size here only, the buffer is passed in as-is to
-           _libssh2_transport_send() */
-        _libssh2_store_u32(&s, (uint32_t)channel->write_bufwrite);
-        channel->write_packet_len = s - channel->write_packet;
 
-        _libssh2_debug((session, LIBSSH2_TRACE_CONN,
-                       "Sending %ld bytes on channel %u/%u, stream_id=%d",
-                       (long)channel->write_bufwrite, channel->local.id,
-                       channel->remote.id, stream_id));
+        channel_write_header(channel, stream_id, buflen);
 
+        channel->write_queued = 0;
         channel->write_state = libssh2_NB_state_created;
     }
 
     if(channel->write_state == libssh2_NB_state_created) {
-        rc = _libssh2_transport_send(session, channel->write_packet,
-                                     channel->write_packet_len,
-                                     buf, channel->write_bufwrite);
-        if(rc == LIBSSH2_ERROR_EAGAIN) {
+        /* The packets are corked: each one then either goes into the
+           outgoing queue as a whole or, on EAGAIN, not at all, and the
+           queue goes out in as few send() calls as the socket allows. A
+           packet that has been queued counts as written, and we keep
+           going until the window, the data or the room in the queue runs
+           out. That count is returned once the queue has been sent.
+           Start from what was queued before a split message made us
+           return EAGAIN. */
+        wrote = channel->write_queued;
+
+        do {
+            _libssh2_transport_cork(session);
+
+            for(;;) {
+                rc = _libssh2_transport_send(session, channel->write_packet,
+                                             channel->write_packet_len,
+                                             buf + wrote,
+                                             channel->write_bufwrite);
+                if(rc)
+                    break;
+
+                /* Shrink local window size */
+                channel->local.window_size -=
+                    (uint32_t)channel->write_bufwrite;
+                wrote += channel->write_bufwrite;
+
+                if(((size_t)wrote == buflen) || !channel->local.window_size)
+                    break;
+
+                channel_write_header(channel, stream_id, buflen - wrote);
+            }
+
+            flush_rc = _libssh2_transport_uncork(session);
+
+            /* The transport layer may have queued only some of the packets
+               the message was split into. Once the queue is sent it takes
+               the rest, until then the caller has to come back with the
+               same data. */
+            split = (rc == LIBSSH2_ERROR_EAGAIN) &&
+                (session->packet.odata == channel->write_packet);
+        } while(split && !flush_rc);
+
+        if(split && (flush_rc == LIBSSH2_ERROR_EAGAIN)) {
+            channel->write_queued = wrote;
+            return _libssh2_error(session, flush_rc,
+                                  "Would block sending channel data");
+        }
+
+        /* a write returns once its data is on the wire, so the caller
+           does not have to know about the queue */
+        if(wrote && session->api_block_mode) {
+            time_t start_time = time(NULL);
+
+            while(flush_rc == LIBSSH2_ERROR_EAGAIN) {
+                flush_rc = _libssh2_wait_socket(session, start_time);
+                if(!flush_rc)
+                    flush_rc = _libssh2_transport_flush(session);
+            }
+        }
+        else if(wrote && (flush_rc == LIBSSH2_ERROR_EAGAIN)) {
+            /* the caller comes back with the same data until the rest of
+               the queue is sent, and only then learns how much went */
+            channel->write_queued = wrote;
+            channel->write_state = libssh2_NB_state_sent;
+            return _libssh2_error(session, flush_rc,
+                                  "Would block sending channel data");
+        }
+
+        if(!wrote && (rc == LIBSSH2_ERROR_EAGAIN)) {
+            /* nothing went, so the caller comes back with the same data */
             return _libssh2_error(session, rc,
                                   "Unable to send channel data");
         }
-        else if(rc) {
-            channel->write_state = libssh2_NB_state_idle;
+
+        channel->write_state = libssh2_NB_state_idle;
+
+        /* a send error or timeout after some packets were queued shows up
+           on the next call, the data itself must not be written twice */
+        if(wrote)
+            return wrote;
+
+        if(rc)
             return _libssh2_error(session, rc,
                                   "Unable to send channel data");
-        }
-        /* Shrink local window size */
-        channel->local.window_size -= (uint32_t)channel->write_bufwrite;
 
-        wrote += channel->write_bufwrite;
+        if(flush_rc && (flush_rc != LIBSSH2_ERROR_EAGAIN))
+            return _libssh2_error(session, flush_rc,
+                                  "Unable to send channel data");
 
-        /* Since _libssh2_transport_write() succeeded, we must return
-           now to allow the caller to provide the next chunk of data.
+        return 0;
+    }
 
-           We cannot move on to send the next piece of data that may
-           already have been provided in this same function call, as we
-           risk getting EAGAIN for that and we can't return information
-           both about sent data as well as EAGAIN. So, by returning short
-           now, the caller will call this function again with new data to
-           send */
+    if(channel->write_state == libssh2_NB_state_sent) {
+        flush_rc = _libssh2_transport_flush(session);
+        if(flush_rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, flush_rc,
+                                  "Would block sending channel data");
 
         channel->write_state = libssh2_NB_state_idle;
 
-        return wrote;
+        if(flush_rc)
+            return _libssh2_error(session, flush_rc,
+                                  "Unable to send channel data");
+
+        return channel->write_queued;
     }
 
     return LIBSSH2_ERROR_INVAL; /* reaching this point is really bad */
@@ -2544,35 +2996,13 @@ libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int
 libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-    LIBSSH2_PACKET *next_packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while(packet) {
-
-        next_packet = _libssh2_list_next(&packet->node);
-
-        if(packet->data_len < 1) {
-            packet = next_packet;
-            _libssh2_debug((channel->session, LIBSSH2_TRACE_ERROR,
-                           "Unexpected packet length"));
-            continue;
-        }
-
-        if(((packet->data[0] == SSH_MSG_CHANNEL_DATA)
-            || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA))
-            && ((packet->data_len >= 5)
-            && (channel->local.id == _libssh2_ntohu32(packet->data + 1)))) {
-            /* There's data waiting to be read yet, mask the EOF status */
-            return 0;
-        }
-        packet = next_packet;
+    if(_libssh2_list_first(&channel->data_packets) ||
+       _libssh2_list_first(&channel->ext_packets)) {
+        /* There's data waiting to be read yet, mask the EOF status */
+        return 0;
     }
 
     return channel->remote.eof;
@@ -2816,9 +3246,6 @@ libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 {
     LIBSSH2_SESSION *session = channel->session;
-    unsigned char channel_id[4];
-    unsigned char *data;
-    size_t data_len;
     int rc;
 
     assert(session);
@@ -2856,14 +3283,7 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
      */
 
     /* Clear out packets meant for this channel */
-    _libssh2_htonu32(channel_id, channel->local.id);
-    while((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA, &data,
-                               &data_len, 1, channel_id, 4) >= 0)
-          ||
-          (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA, &data,
-                               &data_len, 1, channel_id, 4) >= 0)) {
-        LIBSSH2_FREE(session, data);
-    }
+    channel_data_free(channel);
 
     /* free "channel_type" */
     if(channel->channel_type) {
@@ -2872,6 +3292,8 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 
     /* Unlink from channel list */
     _libssh2_list_remove(&channel->node);
+    _libssh2_channel_index_remove(session, channel);
+    _libssh2_channel_window_free(channel);
 
     /*
      * Make sure all memory used in the state variables are free
@@ -2932,36 +3354,7 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
     }
 
     if(read_avail) {
-        size_t bytes_queued = 0;
-        LIBSSH2_PACKET *next_packet;
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
-
-        while(packet) {
-            unsigned char packet_type;
-               next_packet = _libssh2_list_next(&packet->node);
-
-            if(packet->data_len < 1) {
-                packet = next_packet;
-                _libssh2_debug((channel->session, LIBSSH2_TRACE_ERROR,
-                               "Unexpected packet length"));
-                continue;
-            }
-
-            packet_type = packet->data[0];
-
-            if(((packet_type == SSH_MSG_CHANNEL_DATA)
-                || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-               && ((packet->data_len >= 5)
-                   && (_libssh2_ntohu32(packet->data + 1) ==
-                       channel->local.id))) {
-                bytes_queued += packet->data_len - packet->data_head;
-            }
-
-            packet = next_packet;
-        }
-
-        *read_avail = (unsigned long)bytes_queued;
+        *read_avail = (unsigned long)channel->read_avail;
     }
 
     return channel->remote.window_size;
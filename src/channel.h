@@ -124,6 +124,16 @@ uint32_t _libssh2_channel_nextid(LIBSSH2_SESSION * session);
 LIBSSH2_CHANNEL *_libssh2_channel_locate(LIBSSH2_SESSION * session,
                                          uint32_t channel_id);
 
+void _libssh2_channel_index_add(LIBSSH2_SESSION *session,
+                                LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_index_remove(LIBSSH2_SESSION *session,
+                                   LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_index_free(LIBSSH2_SESSION *session);
+
+void _libssh2_channel_window_init(LIBSSH2_CHANNEL *channel, uint32_t window);
+void _libssh2_channel_window_free(LIBSSH2_CHANNEL *channel);
+void _libssh2_channel_window_sample(LIBSSH2_CHANNEL *channel);
+
 size_t _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel,
                                         int stream_id);
 
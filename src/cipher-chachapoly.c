@@ -37,6 +37,11 @@ chachapoly_init(struct chachapoly_ctx *ctx, const u_char *key, u_int keylen)
     return 0;
 }
 
+/* Bytes handled per pass. Poly1305 and ChaCha20 run over each chunk back
+   to back while it is still in cache. A multiple of CHACHA_BLOCKLEN, so the
+   keystream continues across chunks. */
+#define CHACHAPOLY_CHUNK 1024
+
 /*
  * chachapoly_crypt() operates as following:
  * En/decrypt with header key 'aadlen' bytes from 'src', storing result
@@ -45,20 +50,24 @@ chachapoly_init(struct chachapoly_ctx *ctx, const u_char *key, u_int keylen)
  * En/decrypt 'len' bytes at offset 'aadlen' from 'src' to 'dest'. Use
  * POLY1305_TAGLEN bytes at offset 'len'+'aadlen' as the authentication
  * tag. This tag is written on encryption and verified on decryption.
+ * Both happen in a single pass over the packet, so on decryption 'dest'
+ * is wiped again if the tag does not match.
  */
 int
 chachapoly_crypt(struct chachapoly_ctx *ctx, u_int seqnr, u_char *dest,
                  const u_char *src, u_int len, u_int aadlen, int do_encrypt)
 {
     u_char seqbuf[8];
-    const u_char one[8] = { 1, 0, 0, 0, 0, 0, 0, 0 }; /* NB little-endian */
-    u_char expected_tag[POLY1305_TAGLEN], poly_key[POLY1305_KEYLEN];
+    u_char expected_tag[POLY1305_TAGLEN], poly_key[CHACHA_BLOCKLEN];
+    struct poly1305_ctx poly;
     int r = LIBSSH2_ERROR_INVAL;
     unsigned char *ptr = NULL;
+    u_int off, chunk;
 
     /*
      * Run ChaCha20 once to generate the Poly1305 key. The IV is the
-     * packet sequence number.
+     * packet sequence number. A whole block is generated, that leaves
+     * the block counter at 1 for the payload.
      */
     memset(poly_key, 0, sizeof(poly_key));
     ptr = &seqbuf[0];
@@ -66,34 +75,49 @@ chachapoly_crypt(struct chachapoly_ctx *ctx, u_int seqnr, u_char *dest,
     chacha_ivsetup(&ctx->main_ctx, seqbuf, NULL);
     chacha_encrypt_bytes(&ctx->main_ctx,
                          poly_key, poly_key, sizeof(poly_key));
+    poly1305_init(&poly, poly_key);
 
-    /* If decrypting, check tag before anything else */
-    if(!do_encrypt) {
-        const u_char *tag = src + aadlen + len;
-
-        poly1305_auth(expected_tag, src, aadlen + len, poly_key);
-        if(chachapoly_timingsafe_bcmp(expected_tag, tag, POLY1305_TAGLEN)
-           != 0) {
-            r = LIBSSH2_ERROR_DECRYPT;
-            goto out;
-        }
-    }
-
-    /* Crypt additional data */
+    /* Crypt additional data, the MAC covers its encrypted form */
     if(aadlen) {
+        if(!do_encrypt)
+            poly1305_update(&poly, src, aadlen);
         chacha_ivsetup(&ctx->header_ctx, seqbuf, NULL);
         chacha_encrypt_bytes(&ctx->header_ctx, src, dest, aadlen);
+        if(do_encrypt)
+            poly1305_update(&poly, dest, aadlen);
     }
 
-    /* Set Chacha's block counter to 1 */
-    chacha_ivsetup(&ctx->main_ctx, seqbuf, one);
-    chacha_encrypt_bytes(&ctx->main_ctx, src + aadlen,
-                         dest + aadlen, len);
+    for(off = 0; off < len; off += chunk) {
+        const u_char *in = src + aadlen + off;
+        u_char *out = dest + aadlen + off;
+
+        chunk = len - off;
+        if(chunk > CHACHAPOLY_CHUNK)
+            chunk = CHACHAPOLY_CHUNK;
+
+        /* in and out may be the same, read the ciphertext first */
+        if(!do_encrypt)
+            poly1305_update(&poly, in, chunk);
+        chacha_encrypt_bytes(&ctx->main_ctx, in, out, chunk);
+        if(do_encrypt)
+            poly1305_update(&poly, out, chunk);
+    }
 
-    /* If encrypting, calculate and append tag */
     if(do_encrypt) {
-        poly1305_auth(dest + aadlen + len, dest, aadlen + len,
-                      poly_key);
+        /* append tag */
+        poly1305_finish(&poly, dest + aadlen + len);
+    }
+    else {
+        const u_char *tag = src + aadlen + len;
+
+        poly1305_finish(&poly, expected_tag);
+        if(chachapoly_timingsafe_bcmp(expected_tag, tag, POLY1305_TAGLEN)
+           != 0) {
+            /* no plaintext of a forged packet */
+            _libssh2_explicit_zero(dest, aadlen + len);
+            r = LIBSSH2_ERROR_DECRYPT;
+            goto out;
+        }
     }
     r = 0;
 out:
@@ -48,6 +48,8 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#ifdef ESP_PLATFORM
 #include "esp_netif.h"
+#endif
 
 #endif
\ No newline at end of file
@@ -76,6 +76,29 @@ int _libssh2_hmac_update(libssh2_hmac_ctx *ctx,
 int _libssh2_hmac_final(libssh2_hmac_ctx *ctx, void *data);
 void _libssh2_hmac_cleanup(libssh2_hmac_ctx *ctx);
 
+/* Prepared HMAC keys for the transport MACs: the padded key blocks are
+   hashed once, each message then starts from a copy of those states.
+   return: success = 1, error = 0 */
+#if LIBSSH2_MD5
+int _libssh2_hmac_md5_key_init(libssh2_hmac_key *hkey,
+                               void *key, size_t keylen);
+#endif
+#if LIBSSH2_HMAC_RIPEMD
+int _libssh2_hmac_ripemd160_key_init(libssh2_hmac_key *hkey,
+                                     void *key, size_t keylen);
+#endif
+int _libssh2_hmac_sha1_key_init(libssh2_hmac_key *hkey,
+                                void *key, size_t keylen);
+int _libssh2_hmac_sha256_key_init(libssh2_hmac_key *hkey,
+                                  void *key, size_t keylen);
+int _libssh2_hmac_sha512_key_init(libssh2_hmac_key *hkey,
+                                  void *key, size_t keylen);
+int _libssh2_hmac_key_start(libssh2_hmac_key *hkey);
+int _libssh2_hmac_key_update(libssh2_hmac_key *hkey,
+                             const void *data, size_t datalen);
+int _libssh2_hmac_key_final(libssh2_hmac_key *hkey, void *data);
+void _libssh2_hmac_key_cleanup(libssh2_hmac_key *hkey);
+
 #define LIBSSH2_ED25519_KEY_LEN 32
 #define LIBSSH2_ED25519_PRIVATE_KEY_LEN 64
 #define LIBSSH2_ED25519_SIG_LEN 64
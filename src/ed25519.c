@@ -0,0 +1,713 @@
+/*
+ * X25519 (RFC 7748) and Ed25519 (RFC 8032) for crypto backends that lack
+ * them. The field arithmetic follows the public domain ref10 code by
+ * D. J. Bernstein et al, the group operations follow TweetNaCl.
+ *
+ * Everything that handles secrets runs in constant time: no branches or
+ * table lookups depend on secret data.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "libssh2_priv.h"
+
+#if defined(LIBSSH2_MBEDTLS) && LIBSSH2_ED25519
+
+#include "ed25519.h"
+
+/* Elements of GF(2^255 - 19) in radix 2^25.5: ten signed limbs of
+   alternately 26 and 25 bits, limb i holding bits ceil(25.5 * i) and up.
+   Results of all operations below are carried, so limbs stay below 2^26
+   plus a little and products of two never overflow 64 bits. */
+typedef int32_t fe[10];
+
+/* Points of the Edwards curve in extended coordinates (X:Y:Z:T),
+   x = X/Z, y = Y/Z, x * y = T/Z */
+typedef fe ge[4];
+
+static const fe fe_d = {
+    56195235, 13857412, 51736253, 6949390, 114729,
+    24766616, 60832955, 30306712, 48412415, 21499315
+};
+
+static const fe fe_d2 = {
+    45281625, 27714825, 36363642, 13898781, 229458,
+    15978800, 54557047, 27058993, 29715967, 9444199
+};
+
+static const fe fe_sqrtm1 = {
+    34513072, 25610706, 9377949, 3500415, 12389472,
+    33281959, 41962654, 31548777, 326685, 11406482
+};
+
+static const fe fe_base_x = {
+    52811034, 25909283, 16144682, 17082669, 27570973,
+    30858332, 40966398, 8378388, 20764389, 8758491
+};
+
+static const fe fe_base_y = {
+    40265304, 26843545, 13421772, 20132659, 26843545,
+    6710886, 53687091, 13421772, 40265318, 26843545
+};
+
+/* the group order L = 2^252 + 27742317777372353535851937790883648493 */
+static const int64_t L[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x10
+};
+
+#define LIMB_BITS(i) (((i) & 1) ? 25 : 26)
+
+static void
+fe_0(fe h)
+{
+    int i;
+
+    for(i = 0; i < 10; i++)
+        h[i] = 0;
+}
+
+static void
+fe_1(fe h)
+{
+    fe_0(h);
+    h[0] = 1;
+}
+
+static void
+fe_copy(fe h, const fe f)
+{
+    int i;
+
+    for(i = 0; i < 10; i++)
+        h[i] = f[i];
+}
+
+/* bring 64 bit limbs back into range, 2^255 wraps around to 19 */
+static void
+fe_carry(fe h, int64_t t[10])
+{
+    int64_t c;
+    int i;
+
+    for(i = 0; i < 10; i++) {
+        c = t[i] >> LIMB_BITS(i);
+        t[i] -= c * ((int64_t)1 << LIMB_BITS(i));
+        if(i < 9)
+            t[i + 1] += c;
+        else
+            t[0] += 19 * c;
+    }
+    c = t[0] >> 26;
+    t[0] -= c * ((int64_t)1 << 26);
+    t[1] += c;
+
+    for(i = 0; i < 10; i++)
+        h[i] = (int32_t)t[i];
+}
+
+static void
+fe_add(fe h, const fe f, const fe g)
+{
+    int64_t t[10];
+    int i;
+
+    for(i = 0; i < 10; i++)
+        t[i] = (int64_t)f[i] + g[i];
+    fe_carry(h, t);
+}
+
+static void
+fe_sub(fe h, const fe f, const fe g)
+{
+    int64_t t[10];
+    int i;
+
+    for(i = 0; i < 10; i++)
+        t[i] = (int64_t)f[i] - g[i];
+    fe_carry(h, t);
+}
+
+static void
+fe_mul(fe h, const fe f, const fe g)
+{
+    int64_t t[10] = { 0 };
+    int32_t g19[10];
+    int32_t f2[10];
+    int i, j;
+
+    for(i = 0; i < 10; i++) {
+        g19[i] = 19 * g[i];
+        /* two odd limbs multiply to a half bit too much */
+        f2[i] = (i & 1) ? 2 * f[i] : f[i];
+    }
+
+    for(i = 0; i < 10; i++) {
+        for(j = 0; j < 10; j++) {
+            int64_t fi = (i & j & 1) ? f2[i] : f[i];
+
+            if(i + j < 10)
+                t[i + j] += fi * g[j];
+            else
+                t[i + j - 10] += fi * g19[j];
+        }
+    }
+
+    fe_carry(h, t);
+}
+
+static void
+fe_sq(fe h, const fe f)
+{
+    fe_mul(h, f, f);
+}
+
+/* h = f * n for a small n */
+static void
+fe_mul_small(fe h, const fe f, int32_t n)
+{
+    int64_t t[10];
+    int i;
+
+    for(i = 0; i < 10; i++)
+        t[i] = (int64_t)f[i] * n;
+    fe_carry(h, t);
+}
+
+static void
+fe_sq_times(fe h, const fe f, int n)
+{
+    fe_sq(h, f);
+    while(--n)
+        fe_sq(h, h);
+}
+
+/* swap f and g if b is 1, leave them if b is 0 */
+static void
+fe_cswap(fe f, fe g, int32_t b)
+{
+    int32_t mask = -b;
+    int32_t x;
+    int i;
+
+    for(i = 0; i < 10; i++) {
+        x = mask & (f[i] ^ g[i]);
+        f[i] ^= x;
+        g[i] ^= x;
+    }
+}
+
+static void
+fe_frombytes(fe h, const unsigned char s[32])
+{
+    int64_t t[10];
+    int i, bit = 0;
+
+    for(i = 0; i < 10; i++) {
+        int w = LIMB_BITS(i);
+        int64_t v = 0;
+        int k;
+
+        for(k = 0; k < w; k++, bit++) {
+            if(bit < 255)
+                v |= (int64_t)((s[bit >> 3] >> (bit & 7)) & 1) << k;
+        }
+        t[i] = v;
+    }
+    fe_carry(h, t);
+}
+
+static void
+fe_tobytes(unsigned char s[32], const fe f)
+{
+    int64_t t[10];
+    int64_t q, c;
+    int i, bit = 0;
+
+    for(i = 0; i < 10; i++)
+        t[i] = f[i];
+
+    /* q is 1 if f >= p, 0 otherwise */
+    q = (19 * t[9] + ((int64_t)1 << 24)) >> 25;
+    for(i = 0; i < 10; i++)
+        q = (t[i] + q) >> LIMB_BITS(i);
+
+    /* f - q * p, the final carry out of bit 255 is dropped */
+    t[0] += 19 * q;
+    for(i = 0; i < 9; i++) {
+        c = t[i] >> LIMB_BITS(i);
+        t[i + 1] += c;
+        t[i] -= c * ((int64_t)1 << LIMB_BITS(i));
+    }
+    t[9] &= ((int64_t)1 << 25) - 1;
+
+    memset(s, 0, 32);
+    for(i = 0; i < 10; i++) {
+        int k;
+
+        for(k = 0; k < LIMB_BITS(i); k++, bit++)
+            s[bit >> 3] |= (unsigned char)(((t[i] >> k) & 1) << (bit & 7));
+    }
+}
+
+static int
+fe_isnegative(const fe f)
+{
+    unsigned char s[32];
+
+    fe_tobytes(s, f);
+    return s[0] & 1;
+}
+
+static int
+fe_isequal(const fe f, const fe g)
+{
+    unsigned char a[32], b[32];
+
+    fe_tobytes(a, f);
+    fe_tobytes(b, g);
+    return memcmp(a, b, 32) == 0;
+}
+
+/* h = z^(p - 2) = 1/z */
+static void
+fe_invert(fe h, const fe z)
+{
+    fe t0, t1, t2, t3;
+
+    fe_sq(t0, z);
+    fe_sq_times(t1, t0, 2);
+    fe_mul(t1, z, t1);
+    fe_mul(t0, t0, t1);
+    fe_sq(t2, t0);
+    fe_mul(t1, t1, t2);             /* 2^5 - 1 */
+    fe_sq_times(t2, t1, 5);
+    fe_mul(t1, t2, t1);             /* 2^10 - 1 */
+    fe_sq_times(t2, t1, 10);
+    fe_mul(t2, t2, t1);             /* 2^20 - 1 */
+    fe_sq_times(t3, t2, 20);
+    fe_mul(t2, t3, t2);             /* 2^40 - 1 */
+    fe_sq_times(t2, t2, 10);
+    fe_mul(t1, t2, t1);             /* 2^50 - 1 */
+    fe_sq_times(t2, t1, 50);
+    fe_mul(t2, t2, t1);             /* 2^100 - 1 */
+    fe_sq_times(t3, t2, 100);
+    fe_mul(t2, t3, t2);             /* 2^200 - 1 */
+    fe_sq_times(t2, t2, 50);
+    fe_mul(t1, t2, t1);             /* 2^250 - 1 */
+    fe_sq_times(t1, t1, 5);
+    fe_mul(h, t1, t0);              /* 2^255 - 21 */
+}
+
+/* h = z^((p - 5) / 8) */
+static void
+fe_pow22523(fe h, const fe z)
+{
+    fe t0, t1, t2;
+
+    fe_sq(t0, z);
+    fe_sq_times(t1, t0, 2);
+    fe_mul(t1, z, t1);
+    fe_mul(t0, t0, t1);
+    fe_sq(t0, t0);
+    fe_mul(t0, t1, t0);             /* 2^5 - 1 */
+    fe_sq_times(t1, t0, 5);
+    fe_mul(t0, t1, t0);             /* 2^10 - 1 */
+    fe_sq_times(t1, t0, 10);
+    fe_mul(t1, t1, t0);             /* 2^20 - 1 */
+    fe_sq_times(t2, t1, 20);
+    fe_mul(t1, t2, t1);             /* 2^40 - 1 */
+    fe_sq_times(t1, t1, 10);
+    fe_mul(t0, t1, t0);             /* 2^50 - 1 */
+    fe_sq_times(t1, t0, 50);
+    fe_mul(t1, t1, t0);             /* 2^100 - 1 */
+    fe_sq_times(t2, t1, 100);
+    fe_mul(t1, t2, t1);             /* 2^200 - 1 */
+    fe_sq_times(t1, t1, 50);
+    fe_mul(t0, t1, t0);             /* 2^250 - 1 */
+    fe_sq_times(t0, t0, 2);
+    fe_mul(h, t0, z);               /* 2^252 - 3 */
+}
+
+/*
+ * X25519
+ */
+
+int
+x25519_scalarmult(unsigned char out[CURVE25519_KEYLEN],
+                  const unsigned char scalar[CURVE25519_KEYLEN],
+                  const unsigned char point[CURVE25519_KEYLEN])
+{
+    static const unsigned char zero[CURVE25519_KEYLEN] = { 0 };
+    unsigned char e[32];
+    fe x1, x2, z2, x3, z3, a, aa, b, bb, c, d, da, cb, t;
+    int32_t swap = 0;
+    int pos;
+
+    memcpy(e, scalar, 32);
+    e[0] &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    fe_frombytes(x1, point);
+    fe_1(x2);
+    fe_0(z2);
+    fe_copy(x3, x1);
+    fe_1(z3);
+
+    /* Montgomery ladder */
+    for(pos = 254; pos >= 0; pos--) {
+        int32_t bit = (e[pos >> 3] >> (pos & 7)) & 1;
+
+        swap ^= bit;
+        fe_cswap(x2, x3, swap);
+        fe_cswap(z2, z3, swap);
+        swap = bit;
+
+        fe_add(a, x2, z2);
+        fe_sq(aa, a);
+        fe_sub(b, x2, z2);
+        fe_sq(bb, b);
+        fe_sub(t, aa, bb);          /* E */
+        fe_add(c, x3, z3);
+        fe_sub(d, x3, z3);
+        fe_mul(da, d, a);
+        fe_mul(cb, c, b);
+        fe_add(x3, da, cb);
+        fe_sq(x3, x3);
+        fe_sub(z3, da, cb);
+        fe_sq(z3, z3);
+        fe_mul(z3, z3, x1);
+        fe_mul(x2, aa, bb);
+        fe_mul_small(z2, t, 121665);
+        fe_add(z2, z2, aa);
+        fe_mul(z2, z2, t);
+    }
+    fe_cswap(x2, x3, swap);
+    fe_cswap(z2, z3, swap);
+
+    fe_invert(z2, z2);
+    fe_mul(x2, x2, z2);
+    fe_tobytes(out, x2);
+
+    _libssh2_explicit_zero(e, sizeof(e));
+
+    return memcmp(out, zero, CURVE25519_KEYLEN) ? 0 : -1;
+}
+
+void
+x25519_scalarmult_base(unsigned char out[CURVE25519_KEYLEN],
+                       const unsigned char scalar[CURVE25519_KEYLEN])
+{
+    static const unsigned char base[CURVE25519_KEYLEN] = { 9 };
+
+    x25519_scalarmult(out, scalar, base);
+}
+
+/*
+ * Ed25519
+ */
+
+/* p = p + q, also for p == q */
+static void
+ge_add(ge p, ge q)
+{
+    fe a, b, c, d, t, e, f, g, h;
+
+    fe_sub(a, p[1], p[0]);
+    fe_sub(t, q[1], q[0]);
+    fe_mul(a, a, t);
+    fe_add(b, p[0], p[1]);
+    fe_add(t, q[0], q[1]);
+    fe_mul(b, b, t);
+    fe_mul(c, p[3], q[3]);
+    fe_mul(c, c, fe_d2);
+    fe_mul(d, p[2], q[2]);
+    fe_add(d, d, d);
+    fe_sub(e, b, a);
+    fe_sub(f, d, c);
+    fe_add(g, d, c);
+    fe_add(h, b, a);
+
+    fe_mul(p[0], e, f);
+    fe_mul(p[1], h, g);
+    fe_mul(p[2], g, f);
+    fe_mul(p[3], e, h);
+}
+
+static void
+ge_cswap(ge p, ge q, int32_t b)
+{
+    int i;
+
+    for(i = 0; i < 4; i++)
+        fe_cswap(p[i], q[i], b);
+}
+
+static void
+ge_tobytes(unsigned char s[32], ge p)
+{
+    fe zi, x, y;
+
+    fe_invert(zi, p[2]);
+    fe_mul(x, p[0], zi);
+    fe_mul(y, p[1], zi);
+    fe_tobytes(s, y);
+    s[31] ^= (unsigned char)(fe_isnegative(x) << 7);
+}
+
+/* p = s * q, q is destroyed */
+static void
+ge_scalarmult(ge p, ge q, const unsigned char s[32])
+{
+    int i;
+
+    fe_0(p[0]);
+    fe_1(p[1]);
+    fe_1(p[2]);
+    fe_0(p[3]);
+
+    for(i = 255; i >= 0; i--) {
+        int32_t bit = (s[i >> 3] >> (i & 7)) & 1;
+
+        ge_cswap(p, q, bit);
+        ge_add(q, p);
+        ge_add(p, p);
+        ge_cswap(p, q, bit);
+    }
+}
+
+static void
+ge_scalarmult_base(ge p, const unsigned char s[32])
+{
+    ge q;
+
+    fe_copy(q[0], fe_base_x);
+    fe_copy(q[1], fe_base_y);
+    fe_1(q[2]);
+    fe_mul(q[3], fe_base_x, fe_base_y);
+    ge_scalarmult(p, q, s);
+}
+
+/* decode the point in s and negate it, returns -1 if s is not a point */
+static int
+ge_frombytes_negate(ge p, const unsigned char s[32])
+{
+    fe u, v, v3, vxx, check;
+
+    fe_frombytes(p[1], s);
+    fe_1(p[2]);
+
+    /* x^2 = (y^2 - 1) / (d y^2 + 1) = u / v */
+    fe_sq(u, p[1]);
+    fe_mul(v, u, fe_d);
+    fe_sub(u, u, p[2]);
+    fe_add(v, v, p[2]);
+
+    /* x = u v^3 (u v^7)^((p - 5) / 8) */
+    fe_sq(v3, v);
+    fe_mul(v3, v3, v);
+    fe_sq(p[0], v3);
+    fe_mul(p[0], p[0], v);
+    fe_mul(p[0], p[0], u);
+    fe_pow22523(p[0], p[0]);
+    fe_mul(p[0], p[0], v3);
+    fe_mul(p[0], p[0], u);
+
+    fe_sq(vxx, p[0]);
+    fe_mul(vxx, vxx, v);
+    if(!fe_isequal(vxx, u)) {
+        fe_0(check);
+        fe_sub(check, check, u);
+        if(!fe_isequal(vxx, check))
+            return -1;
+        fe_mul(p[0], p[0], fe_sqrtm1);
+    }
+
+    if(fe_isnegative(p[0]) == (s[31] >> 7)) {
+        fe_0(check);
+        fe_sub(p[0], check, p[0]);
+    }
+
+    fe_mul(p[3], p[0], p[1]);
+    return 0;
+}
+
+/* r = x mod L, x is destroyed */
+static void
+sc_reduce_limbs(unsigned char r[32], int64_t x[64])
+{
+    int64_t carry;
+    int i, j;
+
+    for(i = 63; i >= 32; i--) {
+        carry = 0;
+        for(j = i - 32; j < i - 12; j++) {
+            x[j] += carry - 16 * x[i] * L[j - (i - 32)];
+            carry = (x[j] + 128) >> 8;
+            x[j] -= carry * 256;
+        }
+        x[j] += carry;
+        x[i] = 0;
+    }
+
+    carry = 0;
+    for(j = 0; j < 32; j++) {
+        x[j] += carry - (x[31] >> 4) * L[j];
+        carry = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for(j = 0; j < 32; j++)
+        x[j] -= carry * L[j];
+    for(i = 0; i < 32; i++) {
+        x[i + 1] += x[i] >> 8;
+        r[i] = (unsigned char)(x[i] & 255);
+    }
+}
+
+/* r = s mod L for a 64 byte s */
+static void
+sc_reduce(unsigned char r[32], const unsigned char s[64])
+{
+    int64_t x[64];
+    int i;
+
+    for(i = 0; i < 64; i++)
+        x[i] = s[i];
+    sc_reduce_limbs(r, x);
+}
+
+static int
+sha512_parts(unsigned char out[64],
+             const unsigned char *a, size_t a_len,
+             const unsigned char *b, size_t b_len,
+             const unsigned char *c, size_t c_len)
+{
+    libssh2_sha512_ctx ctx;
+    int ok;
+
+    if(!libssh2_sha512_init(&ctx))
+        return -1;
+
+    ok = libssh2_sha512_update(ctx, a, a_len);
+    if(ok && b_len)
+        ok = libssh2_sha512_update(ctx, b, b_len);
+    if(ok && c_len)
+        ok = libssh2_sha512_update(ctx, c, c_len);
+
+    /* always finish, that frees the context */
+    if(!libssh2_sha512_final(ctx, out))
+        ok = 0;
+
+    return ok ? 0 : -1;
+}
+
+/* the secret scalar and the nonce prefix of the private key 'seed' */
+static int
+expand_seed(unsigned char az[64], const unsigned char seed[ED25519_SEEDLEN])
+{
+    if(sha512_parts(az, seed, ED25519_SEEDLEN, NULL, 0, NULL, 0))
+        return -1;
+
+    az[0] &= 248;
+    az[31] &= 127;
+    az[31] |= 64;
+    return 0;
+}
+
+void
+ed25519_public_key(unsigned char pk[ED25519_PUBLICKEYLEN],
+                   const unsigned char seed[ED25519_SEEDLEN])
+{
+    unsigned char az[64];
+    ge a;
+
+    if(expand_seed(az, seed)) {
+        memset(pk, 0, ED25519_PUBLICKEYLEN);
+        return;
+    }
+
+    ge_scalarmult_base(a, az);
+    ge_tobytes(pk, a);
+
+    _libssh2_explicit_zero(az, sizeof(az));
+}
+
+int
+ed25519_sign(unsigned char sig[ED25519_SIGLEN],
+             const unsigned char *m, size_t m_len,
+             const unsigned char seed[ED25519_SEEDLEN],
+             const unsigned char pk[ED25519_PUBLICKEYLEN])
+{
+    unsigned char az[64], nonce[64], hram[64], r[32], h[32];
+    int64_t x[64];
+    ge p;
+    int i, j, rc = -1;
+
+    if(expand_seed(az, seed))
+        goto out;
+
+    /* r = H(prefix || m), R = r B */
+    if(sha512_parts(nonce, az + 32, 32, m, m_len, NULL, 0))
+        goto out;
+    sc_reduce(r, nonce);
+    ge_scalarmult_base(p, r);
+    ge_tobytes(sig, p);
+
+    /* S = r + H(R || A || m) a */
+    if(sha512_parts(hram, sig, 32, pk, ED25519_PUBLICKEYLEN, m, m_len))
+        goto out;
+    sc_reduce(h, hram);
+
+    for(i = 0; i < 64; i++)
+        x[i] = 0;
+    for(i = 0; i < 32; i++)
+        x[i] = r[i];
+    for(i = 0; i < 32; i++) {
+        for(j = 0; j < 32; j++)
+            x[i + j] += (int64_t)h[i] * az[j];
+    }
+    sc_reduce_limbs(sig + 32, x);
+
+    rc = 0;
+
+out:
+    _libssh2_explicit_zero(az, sizeof(az));
+    _libssh2_explicit_zero(nonce, sizeof(nonce));
+    _libssh2_explicit_zero(r, sizeof(r));
+    _libssh2_explicit_zero(x, sizeof(x));
+
+    return rc;
+}
+
+int
+ed25519_verify(const unsigned char sig[ED25519_SIGLEN],
+               const unsigned char *m, size_t m_len,
+               const unsigned char pk[ED25519_PUBLICKEYLEN])
+{
+    unsigned char hram[64], h[32], check[32];
+    ge a, sb;
+
+    /* reject the obviously non-canonical S, as ref10 does */
+    if(sig[63] & 224)
+        return -1;
+
+    if(ge_frombytes_negate(a, pk))
+        return -1;
+
+    if(sha512_parts(hram, sig, 32, pk, ED25519_PUBLICKEYLEN, m, m_len))
+        return -1;
+    sc_reduce(h, hram);
+
+    /* R has to be S B - h A */
+    ge_scalarmult(sb, a, h);
+    ge_scalarmult_base(a, sig + 32);
+    ge_add(sb, a);
+    ge_tobytes(check, sb);
+
+    return memcmp(check, sig, 32) ? -1 : 0;
+}
+
+#endif /* LIBSSH2_MBEDTLS && LIBSSH2_ED25519 */
@@ -0,0 +1,40 @@
+#ifndef LIBSSH2_ED25519_H
+#define LIBSSH2_ED25519_H
+/*
+ * X25519 (RFC 7748) and Ed25519 (RFC 8032) for crypto backends that lack
+ * them. The field arithmetic follows the public domain ref10 code by
+ * D. J. Bernstein et al, the group operations follow TweetNaCl.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#define CURVE25519_KEYLEN   32
+#define ED25519_PUBLICKEYLEN 32
+#define ED25519_SEEDLEN     32
+#define ED25519_SIGLEN      64
+
+/* out = scalar * point, returns -1 if the result is all zero (the point has
+   small order) */
+int x25519_scalarmult(unsigned char out[CURVE25519_KEYLEN],
+                      const unsigned char scalar[CURVE25519_KEYLEN],
+                      const unsigned char point[CURVE25519_KEYLEN]);
+
+/* out = scalar * base point */
+void x25519_scalarmult_base(unsigned char out[CURVE25519_KEYLEN],
+                            const unsigned char scalar[CURVE25519_KEYLEN]);
+
+/* public key of the private key 'seed' */
+void ed25519_public_key(unsigned char pk[ED25519_PUBLICKEYLEN],
+                        const unsigned char seed[ED25519_SEEDLEN]);
+
+int ed25519_sign(unsigned char sig[ED25519_SIGLEN],
+                 const unsigned char *m, size_t m_len,
+                 const unsigned char seed[ED25519_SEEDLEN],
+                 const unsigned char pk[ED25519_PUBLICKEYLEN]);
+
+/* returns 0 if the signature is valid */
+int ed25519_verify(const unsigned char sig[ED25519_SIGLEN],
+                   const unsigned char *m, size_t m_len,
+                   const unsigned char pk[ED25519_PUBLICKEYLEN]);
+
+#endif /* LIBSSH2_ED25519_H */
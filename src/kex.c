@@ -1697,6 +1697,88 @@ dh_gex_clean_exit:
     return ret;
 }
 
+/* kex_pregen_same
+ * Whether a key pair made for one key exchange method suits another
+ */
+static int
+kex_pregen_same(const LIBSSH2_KEX_METHOD *a, const LIBSSH2_KEX_METHOD *b)
+{
+    /* the two curve25519 methods only differ in name */
+    return a == b ||
+        (!strncmp(a->name, "curve25519-sha256", 17) &&
+         !strncmp(b->name, "curve25519-sha256", 17));
+}
+
+static struct kex_pregen_key *
+kex_pregen_find(LIBSSH2_SESSION *session, const LIBSSH2_KEX_METHOD *kex)
+{
+    int i;
+
+    for(i = 0; i < LIBSSH2_KEX_PREGEN_KEYS; i++) {
+        struct kex_pregen_key *pk = &session->kex_pregen[i];
+        if(pk->kex && kex_pregen_same(pk->kex, kex))
+            return pk;
+    }
+    return NULL;
+}
+
+/* kex_pregen_take
+ * Hand a pre-generated key pair for the agreed key exchange over to
+ * key_state, removing it from the session so that it is never used twice.
+ * Returns 1 if there was one.
+ */
+static int
+kex_pregen_take(LIBSSH2_SESSION *session, key_exchange_state_low_t *key_state)
+{
+    struct kex_pregen_key *pk = kex_pregen_find(session, session->kex);
+
+    if(!pk)
+        return 0;
+
+    key_state->private_key = pk->private_key;
+    key_state->public_key_oct = pk->public_key_oct;
+    key_state->public_key_oct_len = pk->public_key_oct_len;
+    key_state->curve25519_public_key = pk->curve25519_public_key;
+    key_state->curve25519_private_key = pk->curve25519_private_key;
+    memset(pk, 0, sizeof(*pk));
+
+    _libssh2_debug((session, LIBSSH2_TRACE_KEX,
+                   "Using pre-generated key pair for %s",
+                   session->kex->name));
+    return 1;
+}
+
+static void
+kex_pregen_clear(LIBSSH2_SESSION *session, struct kex_pregen_key *pk)
+{
+#if LIBSSH2_ECDSA
+    if(pk->private_key)
+        _libssh2_ecdsa_free(pk->private_key);
+#endif
+    if(pk->public_key_oct)
+        LIBSSH2_FREE(session, pk->public_key_oct);
+    if(pk->curve25519_public_key)
+        LIBSSH2_FREE(session, pk->curve25519_public_key);
+    if(pk->curve25519_private_key) {
+        _libssh2_explicit_zero(pk->curve25519_private_key,
+                               LIBSSH2_ED25519_KEY_LEN);
+        LIBSSH2_FREE(session, pk->curve25519_private_key);
+    }
+    memset(pk, 0, sizeof(*pk));
+}
+
+/* _libssh2_kex_pregen_free
+ * Drop the pre-generated key pairs no key exchange has used
+ */
+void
+_libssh2_kex_pregen_free(LIBSSH2_SESSION *session)
+{
+    int i;
+
+    for(i = 0; i < LIBSSH2_KEX_PREGEN_KEYS; i++)
+        kex_pregen_clear(session, &session->kex_pregen[i]);
+}
+
 #if LIBSSH2_ECDSA
 
 /* LIBSSH2_KEX_METHOD_EC_SHA_HASH_CREATE_VERIFY
@@ -2407,9 +2489,11 @@ kex_method_ecdh_key_exchange
             goto ecdh_clean_exit;
         }
 
-        rc = _libssh2_ecdsa_create_key(session, &key_state->private_key,
-                                       &key_state->public_key_oct,
-                                       &key_state->public_key_oct_len, type);
+        if(!kex_pregen_take(session, key_state))
+            rc = _libssh2_ecdsa_create_key(session, &key_state->private_key,
+                                           &key_state->public_key_oct,
+                                           &key_state->public_key_oct_len,
+                                           type);
 
         if(rc) {
             ret = _libssh2_error(session, rc,
@@ -2442,6 +2526,12 @@ kex_method_ecdh_key_exchange
         }
 
         key_state->state = libssh2_NB_state_sent1;
+
+        if(session->kex_guess) {
+            /* Guessed init sent right behind our KEXINIT, wait for the
+               reply once the server's KEXINIT has confirmed the guess */
+            return 0;
+        }
     }
 
     if(key_state->state == libssh2_NB_state_sent1) {
@@ -3057,9 +3147,10 @@ kex_method_curve25519_key_exchange
             goto clean_exit;
         }
 
-        rc = _libssh2_curve25519_new(session,
-                                     &key_state->curve25519_public_key,
-                                     &key_state->curve25519_private_key);
+        if(!kex_pregen_take(session, key_state))
+            rc = _libssh2_curve25519_new(session,
+                                         &key_state->curve25519_public_key,
+                                         &key_state->curve25519_private_key);
 
         if(rc) {
             ret = _libssh2_error(session, rc,
@@ -3092,6 +3183,12 @@ kex_method_curve25519_key_exchange
         }
 
         key_state->state = libssh2_NB_state_sent1;
+
+        if(session->kex_guess) {
+            /* Guessed init sent right behind our KEXINIT, wait for the
+               reply once the server's KEXINIT has confirmed the guess */
+            return 0;
+        }
     }
 
     if(key_state->state == libssh2_NB_state_sent1) {
@@ -3135,6 +3232,8 @@ clean_exit:
 
 #define LIBSSH2_KEX_METHOD_FLAG_REQ_ENC_HOSTKEY     0x0001
 #define LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY    0x0002
+/* the init packet can be sent ahead of the server's KEXINIT */
+#define LIBSSH2_KEX_METHOD_FLAG_GUESS               0x0004
 
 static const LIBSSH2_KEX_METHOD kex_method_diffie_helman_group1_sha1 = {
     "diffie-hellman-group1-sha1",
@@ -3193,7 +3292,8 @@ kex_method_ecdh_sha2_nistp256 = {
     "ecdh-sha2-nistp256",
     kex_method_ecdh_key_exchange,
     kex_method_ecdh_cleanup,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY |
+    LIBSSH2_KEX_METHOD_FLAG_GUESS,
 };
 
 static const LIBSSH2_KEX_METHOD
@@ -3201,7 +3301,8 @@ kex_method_ecdh_sha2_nistp384 = {
     "ecdh-sha2-nistp384",
     kex_method_ecdh_key_exchange,
     kex_method_ecdh_cleanup,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY |
+    LIBSSH2_KEX_METHOD_FLAG_GUESS,
 };
 
 static const LIBSSH2_KEX_METHOD
@@ -3209,7 +3310,8 @@ kex_method_ecdh_sha2_nistp521 = {
     "ecdh-sha2-nistp521",
     kex_method_ecdh_key_exchange,
     kex_method_ecdh_cleanup,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY |
+    LIBSSH2_KEX_METHOD_FLAG_GUESS,
 };
 #endif
 
@@ -3219,14 +3321,16 @@ kex_method_ssh_curve25519_sha256_libssh = {
     "curve25519-sha256@libssh.org",
     kex_method_curve25519_key_exchange,
     kex_method_curve25519_cleanup,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY |
+    LIBSSH2_KEX_METHOD_FLAG_GUESS,
 };
 static const LIBSSH2_KEX_METHOD
 kex_method_ssh_curve25519_sha256 = {
     "curve25519-sha256",
     kex_method_curve25519_key_exchange,
     kex_method_curve25519_cleanup,
-    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY |
+    LIBSSH2_KEX_METHOD_FLAG_GUESS,
 };
 #endif
 
@@ -3351,6 +3455,82 @@ kex_method_list(unsigned char *buf, uint32_t list_strlen,
 /* kexinit
  * Send SSH_MSG_KEXINIT packet
  */
+/* kex_get_method_by_name
+ */
+static const LIBSSH2_COMMON_METHOD *
+kex_get_method_by_name(const char *name, size_t name_len,
+                       const LIBSSH2_COMMON_METHOD ** methodlist)
+{
+    while(*methodlist) {
+        if((strlen((*methodlist)->name) == name_len) &&
+            (strncmp((*methodlist)->name, name, name_len) == 0)) {
+            return *methodlist;
+        }
+        methodlist++;
+    }
+    return NULL;
+}
+
+
+
+/* kex_first_method
+ * The first method of a comma separated list, if we support it
+ */
+static const LIBSSH2_COMMON_METHOD *
+kex_first_method(const unsigned char *list, size_t list_len,
+                 const LIBSSH2_COMMON_METHOD ** methodlist)
+{
+    const unsigned char *p = memchr(list, ',', list_len);
+
+    return kex_get_method_by_name((const char *) list,
+                                  p ? (size_t)(p - list) : list_len,
+                                  methodlist);
+}
+
+
+
+/* kex_pick_guess
+ * With LIBSSH2_FLAG_KEX_GUESS, guess that the server prefers the same key
+ * exchange and host key methods as we do, if that key exchange can start
+ * ahead of the server's KEXINIT
+ */
+static void kex_pick_guess(LIBSSH2_SESSION * session)
+{
+    const LIBSSH2_COMMON_METHOD **kexp =
+        (const LIBSSH2_COMMON_METHOD **) libssh2_kex_methods;
+    const LIBSSH2_COMMON_METHOD **hostkeyp =
+        (const LIBSSH2_COMMON_METHOD **) libssh2_hostkey_methods();
+    const LIBSSH2_KEX_METHOD *kex;
+    const LIBSSH2_HOSTKEY_METHOD *hostkey;
+
+    session->kex_guess = NULL;
+    session->hostkey_guess = NULL;
+
+    if(!session->flag.kex_guess)
+        return;
+
+    if(session->kex_prefs)
+        kex = (const LIBSSH2_KEX_METHOD *)
+            kex_first_method((unsigned char *) session->kex_prefs,
+                             strlen(session->kex_prefs), kexp);
+    else
+        kex = libssh2_kex_methods[0];
+
+    if(session->hostkey_prefs)
+        hostkey = (const LIBSSH2_HOSTKEY_METHOD *)
+            kex_first_method((unsigned char *) session->hostkey_prefs,
+                             strlen(session->hostkey_prefs), hostkeyp);
+    else
+        hostkey = (const LIBSSH2_HOSTKEY_METHOD *) hostkeyp[0];
+
+    if(kex && hostkey && (kex->flags & LIBSSH2_KEX_METHOD_FLAG_GUESS)) {
+        session->kex_guess = kex;
+        session->hostkey_guess = hostkey;
+    }
+}
+
+
+
 static int kexinit(LIBSSH2_SESSION * session)
 {
     /* 62 = packet_type(1) + cookie(16) + first_packet_follows(1) +
@@ -3437,12 +3617,9 @@ static int kexinit(LIBSSH2_SESSION * session)
         LIBSSH2_METHOD_PREFS_STR(s, lang_sc_len, session->remote.lang_prefs,
                                  NULL);
 
-        /* No optimistic KEX packet follows */
-        /* Deal with optimistic packets
-         * session->flags |= KEXINIT_OPTIMISTIC
-         * session->flags |= KEXINIT_METHODSMATCH
-         */
-        *(s++) = 0;
+        /* first_kex_packet_follows */
+        kex_pick_guess(session);
+        *(s++) = session->kex_guess ? 1 : 0;
 
         /* Reserved == 0 */
         _libssh2_htonu32(s, 0);
@@ -3504,6 +3681,7 @@ static int kexinit(LIBSSH2_SESSION * session)
     else if(rc) {
         LIBSSH2_FREE(session, data);
         session->kexinit_state = libssh2_NB_state_idle;
+        session->kex_guess = NULL;
         return _libssh2_error(session, rc,
                               "Unable to send KEXINIT packet to remote host");
 
@@ -3579,24 +3757,6 @@ _libssh2_kex_agree_instr(unsigned char *haystack, size_t haystack_len,
 
 
 
-/* kex_get_method_by_name
- */
-static const LIBSSH2_COMMON_METHOD *
-kex_get_method_by_name(const char *name, size_t name_len,
-                       const LIBSSH2_COMMON_METHOD ** methodlist)
-{
-    while(*methodlist) {
-        if((strlen((*methodlist)->name) == name_len) &&
-            (strncmp((*methodlist)->name, name, name_len) == 0)) {
-            return *methodlist;
-        }
-        methodlist++;
-    }
-    return NULL;
-}
-
-
-
 /* kex_agree_hostkey
  * Agree on a Hostkey which works with this kex
  */
@@ -3987,6 +4147,15 @@ static int kex_agree_methods(LIBSSH2_SESSION * session, unsigned char *data,
 
     /* Next uint32 in packet is all zeros (reserved) */
 
+    session->kex_server_pref = (const LIBSSH2_KEX_METHOD *)
+        kex_first_method(kex, kex_len,
+                         (const LIBSSH2_COMMON_METHOD **)
+                         libssh2_kex_methods);
+    session->hostkey_server_pref = (const LIBSSH2_HOSTKEY_METHOD *)
+        kex_first_method(hostkey, hostkey_len,
+                         (const LIBSSH2_COMMON_METHOD **)
+                         libssh2_hostkey_methods());
+
     if(kex_agree_kex_hostkey(session, kex, kex_len, hostkey, hostkey_len)) {
         return -1;
     }
@@ -4064,6 +4233,7 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
     if(key_state->state == libssh2_NB_state_idle) {
         /* Prevent loop in packet_add() */
         session->state |= LIBSSH2_STATE_EXCHANGING_KEYS;
+        session->kex_start = _libssh2_now_us();
 
         if(reexchange) {
             if(session->kex && session->kex->cleanup) {
@@ -4112,6 +4282,42 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
             key_state->state = libssh2_NB_state_sent1;
         }
 
+        if(key_state->state == libssh2_NB_state_sent1 &&
+           session->kex_guess &&
+           key_state->key_state_low.state != libssh2_NB_state_sent1) {
+            /* Send the init packet of the guessed key exchange without
+               waiting for the server's KEXINIT */
+            session->kex = session->kex_guess;
+            retcode = session->kex->exchange_keys(session,
+                                                  &key_state->key_state_low);
+            session->kex = NULL;
+            if(retcode == LIBSSH2_ERROR_EAGAIN) {
+                session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+                return retcode;
+            }
+            else if(retcode) {
+                session->kex_guess = NULL;
+                if(session->local.kexinit) {
+                    LIBSSH2_FREE(session, session->local.kexinit);
+                }
+                session->local.kexinit = key_state->oldlocal;
+                session->local.kexinit_len = key_state->oldlocal_len;
+                key_state->state = libssh2_NB_state_idle;
+                session->state &= ~LIBSSH2_STATE_INITIAL_KEX;
+                session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+                session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
+                return -1;
+            }
+        }
+
+        if(key_state->state == libssh2_NB_state_sent1 &&
+           !session->remote.banner) {
+            /* Sent ahead of reading the server's banner, session_startup()
+               comes back for the server's KEXINIT after that */
+            session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+            return 0;
+        }
+
         if(key_state->state == libssh2_NB_state_sent1) {
             retcode =
                 _libssh2_packet_require(session, SSH_MSG_KEXINIT,
@@ -4123,6 +4329,11 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                 return retcode;
             }
             else if(retcode) {
+                if(session->kex_guess) {
+                    session->kex_guess->cleanup(session,
+                                                &key_state->key_state_low);
+                    session->kex_guess = NULL;
+                }
                 if(session->local.kexinit) {
                     LIBSSH2_FREE(session, session->local.kexinit);
                 }
@@ -4146,6 +4357,28 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                                  session->remote.kexinit_len))
                 rc = LIBSSH2_ERROR_KEX_FAILURE;
 
+            if(session->kex_guess) {
+                /* The guess was right if the server prefers the same key
+                   exchange and host key methods (RFC 4253 section 7.1),
+                   otherwise it ignores our init packet and we start over
+                   with the agreed key exchange */
+                if(rc || session->kex != session->kex_guess ||
+                   session->kex_server_pref != session->kex_guess ||
+                   session->hostkey_server_pref != session->hostkey_guess) {
+                    _libssh2_debug((session, LIBSSH2_TRACE_KEX,
+                                   "Guessed KEX %s wrong",
+                                   session->kex_guess->name));
+                    session->kex_guess->cleanup(session,
+                                                &key_state->key_state_low);
+                }
+                else {
+                    _libssh2_debug((session, LIBSSH2_TRACE_KEX,
+                                   "Guessed KEX %s right",
+                                   session->kex_guess->name));
+                }
+                session->kex_guess = NULL;
+            }
+
             key_state->state = libssh2_NB_state_sent2;
         }
     }
@@ -4185,6 +4418,11 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
 
     key_state->state = libssh2_NB_state_idle;
 
+    if(!rc) {
+        session->stats.kex_count++;
+        session->stats.kex_time += _libssh2_now_us() - session->kex_start;
+    }
+
     return rc;
 }
 
@@ -4307,12 +4545,15 @@ libssh2_session_method_pref(LIBSSH2_SESSION * session, int method_type,
                               "supported");
     }
 
-    /* add method kex extension to the start of the user list */
+    /* add method kex extension to the end of the user list, so that the
+       first entry stays a real key exchange method that the server can
+       match a first_kex_packet_follows guess against */
     if(method_type == LIBSSH2_METHOD_KEX) {
         const char *kex_extensions =
-                    "ext-info-c,kex-strict-c-v00@openssh.com,";
+                    ",ext-info-c,kex-strict-c-v00@openssh.com";
         size_t kex_extensions_len = strlen(kex_extensions);
-        size_t tmp_len = kex_extensions_len + strlen(newprefs);
+        size_t newprefs_len = strlen(newprefs);
+        size_t tmp_len = newprefs_len + kex_extensions_len;
         tmpprefs = LIBSSH2_ALLOC(session, tmp_len + 1);
         if(!tmpprefs) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -4320,8 +4561,8 @@ libssh2_session_method_pref(LIBSSH2_SESSION * session, int method_type,
                                   " preferences");
         }
 
-        memcpy(tmpprefs, kex_extensions, kex_extensions_len);
-        memcpy(tmpprefs + kex_extensions_len, newprefs, strlen(newprefs));
+        memcpy(tmpprefs, newprefs, newprefs_len);
+        memcpy(tmpprefs + newprefs_len, kex_extensions, kex_extensions_len);
         tmpprefs[tmp_len] = '\0';
 
         LIBSSH2_FREE(session, newprefs);
@@ -4451,3 +4692,88 @@ LIBSSH2_API int libssh2_session_supported_algs(LIBSSH2_SESSION* session,
 
     return ialg;
 }
+
+/* kex_pregen_create
+ * Make a key pair for a key exchange method in a free slot. Returns 1 for
+ * methods whose key pairs cannot be made ahead of time.
+ */
+static int
+kex_pregen_create(LIBSSH2_SESSION *session, const LIBSSH2_KEX_METHOD *kex,
+                  struct kex_pregen_key *pk)
+{
+    int rc = 1;
+#if LIBSSH2_ECDSA
+    libssh2_curve_type type;
+#endif
+
+#if LIBSSH2_ED25519
+    if(!strncmp(kex->name, "curve25519-sha256", 17))
+        rc = _libssh2_curve25519_new(session, &pk->curve25519_public_key,
+                                     &pk->curve25519_private_key);
+#endif
+#if LIBSSH2_ECDSA
+    if(!kex_session_ecdh_curve_type(kex->name, &type))
+        rc = _libssh2_ecdsa_create_key(session, &pk->private_key,
+                                       &pk->public_key_oct,
+                                       &pk->public_key_oct_len, type);
+#endif
+
+    if(!rc)
+        pk->kex = kex;
+    return rc;
+}
+
+/* libssh2_session_kex_pregenerate
+ * Make the ephemeral key pairs for the configured ECDH and curve25519 key
+ * exchange methods now, so that the next key exchange does not have to
+ * spend the time on it. Every key pair is used by one key exchange at most
+ * and freed afterwards, or with the session.
+ */
+LIBSSH2_API int
+libssh2_session_kex_pregenerate(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_COMMON_METHOD **kexp =
+        (const LIBSSH2_COMMON_METHOD **) libssh2_kex_methods;
+    const char *s = session->kex_prefs;
+    int i = 0;
+
+    for(;;) {
+        const LIBSSH2_KEX_METHOD *kex;
+        struct kex_pregen_key *pk = NULL;
+        int j;
+
+        if(s) {
+            const char *p = strchr(s, ',');
+            size_t method_len = p ? (size_t)(p - s) : strlen(s);
+
+            if(!*s)
+                break;
+            kex = (const LIBSSH2_KEX_METHOD *)
+                kex_get_method_by_name(s, method_len, kexp);
+            s = p ? p + 1 : s + method_len;
+        }
+        else {
+            kex = libssh2_kex_methods[i++];
+            if(!kex)
+                break;
+        }
+
+        if(!kex || kex_pregen_find(session, kex))
+            continue;
+
+        for(j = 0; j < LIBSSH2_KEX_PREGEN_KEYS && !pk; j++) {
+            if(!session->kex_pregen[j].kex)
+                pk = &session->kex_pregen[j];
+        }
+        if(!pk)
+            break;
+
+        if(kex_pregen_create(session, kex, pk) < 0) {
+            kex_pregen_clear(session, pk);
+            return _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                  "Unable to pre-generate key pair");
+        }
+    }
+
+    return 0;
+}
@@ -49,6 +49,7 @@
 /* #undef HAVE_SYS_IOCTL_H */
 #define HAVE_SYS_TIME_H
 /* #undef HAVE_SYS_UN_H */
+#define HAVE_PTHREAD_H
 
 /* for example and tests */
 /* #undef HAVE_ARPA_INET_H */
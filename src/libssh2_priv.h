@@ -226,6 +226,13 @@ struct iovec {
  * padding length, payload, padding, and MAC.)."
  */
 #define MAX_SSH_PACKET_LEN 35000
+/* Room kept in a packet buffer on top of the payload for the length fields,
+   the padding and the MAC */
+#define SSH_PACKET_OVERHEAD 0x100
+/* Smallest transport buffer size a session can be configured with. It has
+   room for a 4096 byte payload, which some peers insist on as the smallest
+   maximum packet size of a channel */
+#define MIN_SSH_PACKET_LEN (4096 + SSH_PACKET_OVERHEAD)
 #define MAX_SHA_DIGEST_LEN SHA512_DIGEST_LENGTH
 
 #define LIBSSH2_ALLOC(session, count) \
@@ -376,6 +383,22 @@ typedef struct key_exchange_state_low_t
                                               bytes */
 } key_exchange_state_low_t;
 
+/* An ephemeral key pair made ahead of the key exchange by
+   libssh2_session_kex_pregenerate(), used by at most one key exchange */
+struct kex_pregen_key
+{
+    const LIBSSH2_KEX_METHOD *kex; /* method it was made for, NULL if the
+                                      slot is free */
+    _libssh2_ec_key *private_key;  /* ecdh */
+    unsigned char *public_key_oct;
+    size_t public_key_oct_len;
+    unsigned char *curve25519_public_key;
+    unsigned char *curve25519_private_key;
+};
+
+/* Different kinds of key pairs libssh2_session_kex_pregenerate() keeps */
+#define LIBSSH2_KEX_PREGEN_KEYS 4
+
 typedef struct key_exchange_state_t
 {
     libssh2_nonblocking_states state;
@@ -443,6 +466,12 @@ struct _LIBSSH2_PACKET
     /* Where to start reading data from,
      * used for channel data that's been partially consumed */
     size_t data_head;
+
+    /* allocated size of 'data' when it came from the packet pool, 0 if not */
+    size_t data_size;
+
+    /* arrival order of channel data among the packets of its channel */
+    uint32_t seq;
 };
 
 typedef struct _libssh2_channel_data
@@ -475,6 +504,23 @@ struct _LIBSSH2_CHANNEL
     uint32_t adjust_queue;
     /* Data immediately available for reading */
     size_t read_avail;
+    /* Received CHANNEL_DATA and CHANNEL_EXTENDED_DATA packets not read yet,
+       each in the order they came in */
+    struct list_head data_packets;
+    struct list_head ext_packets;
+    uint32_t data_seq;      /* seq of the next one */
+    /* Packet libssh2_channel_read_borrow_ex() has lent data from, until
+       it is released or the queues are read by other means */
+    LIBSSH2_PACKET *read_lent;
+
+    /* Receive window autotuning, see channel_window_consumed(): the window
+       the peer is kept topped up to, the bytes read since window_mark for
+       the throughput, and when a window went out to a peer that had none
+       left (or the open request was sent) for a round trip sample */
+    uint32_t window_target;
+    size_t window_read;
+    libssh2_uint64_t window_mark;
+    libssh2_uint64_t window_sent;
 
     LIBSSH2_SESSION *session;
 
@@ -523,13 +569,15 @@ struct _LIBSSH2_CHANNEL
     /* State variables used in libssh2_channel_read_ex() */
     libssh2_nonblocking_states read_state;
 
-    uint32_t read_local_id;
-
     /* State variables used in libssh2_channel_write_ex() */
     libssh2_nonblocking_states write_state;
     unsigned char write_packet[13];
     size_t write_packet_len;
     size_t write_bufwrite;
+    /* bytes a non-blocking write has queued and waits to see sent */
+    ssize_t write_queued;
+    /* when a write first found the remote window full, 0 if it is not */
+    libssh2_uint64_t write_stall_start;
 
     /* State variables used in libssh2_channel_close() */
     libssh2_nonblocking_states close_state;
@@ -606,12 +654,65 @@ typedef struct _libssh2_endpoint_data
     char *lang_prefs;
 } libssh2_endpoint_data;
 
-#define PACKETBUFSIZE MAX_SSH_PACKET_LEN
+/* Number of size classes of the packet pool, see packet.c */
+#define LIBSSH2_PACKET_POOL_CLASSES 4
+
+struct packet_pool
+{
+    /* idle payload buffers of each size class, each holding its own list
+       node at the start */
+    struct list_head bufs[LIBSSH2_PACKET_POOL_CLASSES];
+    size_t buf_count[LIBSSH2_PACKET_POOL_CLASSES];
+    /* size of the buffers of each class, the biggest is the session's
+       transport buffer size */
+    size_t class_size[LIBSSH2_PACKET_POOL_CLASSES];
+    size_t buf_bytes;       /* total size of the idle buffers */
+
+    struct list_head nodes; /* idle LIBSSH2_PACKET structs */
+    size_t node_count;
+
+    size_t max_idle;        /* most idle buffers kept per size class */
+    size_t max_bytes;       /* most idle buffer bytes kept in total */
+    int user_limits;        /* the limits were set with
+                               libssh2_session_set_packet_pool() */
+
+    /* allocations served from the pool and from the heap */
+    libssh2_uint64_t hits;
+    libssh2_uint64_t misses;
+};
+
+/* Default of how much receive window all the channels of a session may
+   hold between them, that is how much channel data may be on its way or
+   waiting to be read. See libssh2_session_set_window_budget(). */
+#ifdef ESP_PLATFORM
+#define LIBSSH2_WINDOW_BUDGET   (256 * 1024)
+#else
+#define LIBSSH2_WINDOW_BUDGET   (64 * 1024 * 1024)
+#endif
+
+/* Largest receive window autotuning gives a channel */
+#define LIBSSH2_CHANNEL_WINDOW_MAX  0x40000000
+
+/* Channels of a session by their local id, see _libssh2_channel_locate().
+   Open addressing with linear probing, and the id is its own hash: ids are
+   handed out in sequence so they spread over the slots evenly. */
+struct channel_index
+{
+    LIBSSH2_CHANNEL **slots;
+    size_t size;            /* number of slots, a power of two */
+    size_t count;           /* channels in the table */
+    size_t unindexed;       /* channels left out when it couldn't grow */
+};
+
+/* Random bytes drawn from the DRBG at a time for packet padding, see
+   transport.c */
+#define LIBSSH2_PADDING_POOL 1024
 
 struct transportpacket
 {
     /* ------------- for incoming data --------------- */
-    unsigned char buf[PACKETBUFSIZE];
+    unsigned char *buf;     /* LIBSSH2_ALLOC()ed at handshake time */
+    size_t buf_size;        /* allocated size of buf */
     unsigned char init[5];  /* first 5 bytes of the incoming data stream,
                                still encrypted */
     size_t writeidx;        /* at what array index we do the next write into
@@ -629,19 +730,33 @@ struct transportpacket
                                packet_length + padding_length + 4 +
                                mac_length. */
     unsigned char *payload; /* this is a pointer to a LIBSSH2_ALLOC()
-                               area to which we write incoming packet data
-                               which is not yet decrypted in etm mode. */
+                               area, usually from the packet pool, to which
+                               we write incoming packet data which is not
+                               yet decrypted in etm mode. */
+    size_t payload_size;    /* allocated size of payload if it came from
+                               the packet pool, 0 if not */
     unsigned char *wptr;    /* write pointer into the payload to where we
                                are currently writing decrypted data */
 
     /* ------------- for outgoing data --------------- */
-    unsigned char outbuf[MAX_SSH_PACKET_LEN]; /* area for the outgoing data */
-
-    ssize_t ototal_num;     /* size of outbuf in number of bytes */
-    const unsigned char *odata; /* original pointer to the data */
-    size_t olen;            /* original size of the data we stored in
-                               outbuf */
+    unsigned char *outbuf;  /* area for the outgoing data, LIBSSH2_ALLOC()ed
+                               at handshake time */
+    size_t outbuf_size;     /* allocated size of outbuf */
+
+    /* outbuf is a queue of encrypted packets, sent from osent up to
+       ototal_num */
+    ssize_t ototal_num;     /* end of the queued data in outbuf */
+    const unsigned char *odata; /* original pointer to the data of a call
+                                   that has to be completed */
+    size_t olen;            /* original size of that data */
     size_t osent;           /* number of bytes already sent */
+    int ocork;              /* nesting level of _libssh2_transport_cork() */
+    size_t osplit;          /* when splitting channel data over several
+                               packets, number of data bytes packed so far */
+    unsigned char orandom[LIBSSH2_PADDING_POOL]; /* random bytes for the
+                                                    padding of outgoing
+                                                    packets */
+    size_t orandom_left;    /* unused bytes at the end of orandom */
 };
 
 struct _LIBSSH2_PUBLICKEY
@@ -672,12 +787,29 @@ struct _LIBSSH2_PUBLICKEY
     size_t listFetch_data_len;
 };
 
+/* A private key loaded by libssh2_privkey_frommemory() or
+   libssh2_privkey_fromfile() */
+struct _LIBSSH2_PRIVKEY
+{
+    /* free function of the session the key was loaded with */
+    LIBSSH2_FREE_FUNC((*free));
+    void *abstract;
+
+    const LIBSSH2_HOSTKEY_METHOD *method;
+    void *method_abstract;      /* the parsed key */
+
+    /* public key blob, derived from the private key */
+    unsigned char *pubkeydata;
+    size_t pubkeydata_len;
+};
+
 #define LIBSSH2_SCP_RESPONSE_BUFLEN     256
 
 struct flags {
     int sigpipe;     /* LIBSSH2_FLAG_SIGPIPE */
     int compress;    /* LIBSSH2_FLAG_COMPRESS */
     int quote_paths; /* LIBSSH2_FLAG_QUOTE_PATHS */
+    int kex_guess;   /* LIBSSH2_FLAG_KEX_GUESS */
 };
 
 struct _LIBSSH2_SESSION
@@ -714,6 +846,17 @@ struct _LIBSSH2_SESSION
     const LIBSSH2_KEX_METHOD *kex;
     unsigned int burn_optimistic_kexinit;
 
+    /* With LIBSSH2_FLAG_KEX_GUESS: the key exchange and host key methods
+       guessed in the KEXINIT we sent, set while the guessed init packet is
+       unconfirmed */
+    const LIBSSH2_KEX_METHOD *kex_guess;
+    const LIBSSH2_HOSTKEY_METHOD *hostkey_guess;
+
+    /* The server's preferred methods from its last KEXINIT, NULL when we do
+       not support them */
+    const LIBSSH2_KEX_METHOD *kex_server_pref;
+    const LIBSSH2_HOSTKEY_METHOD *hostkey_server_pref;
+
     unsigned char *session_id;
     uint32_t session_id_len;
 
@@ -764,6 +907,9 @@ struct _LIBSSH2_SESSION
     /* Active connection channels */
     struct list_head channels;
 
+    /* The channels above and those queued on listeners, by local id */
+    struct channel_index channel_index;
+
     uint32_t next_channel;
 
     struct list_head listeners; /* list of LIBSSH2_LISTENER structs */
@@ -808,6 +954,7 @@ struct _LIBSSH2_SESSION
     size_t startup_service_length;
     packet_require_state_t startup_req_state;
     key_exchange_state_t startup_key_state;
+    struct kex_pregen_key kex_pregen[LIBSSH2_KEX_PREGEN_KEYS];
 
     /* State variables used in libssh2_session_free() */
     libssh2_nonblocking_states free_state;
@@ -961,6 +1108,23 @@ struct _LIBSSH2_SESSION
 
     /* Configurable timeout for packets. Replaces LIBSSH2_READ_TIMEOUT */
     long packet_read_timeout;
+
+    /* Size of the transport buffers allocated at handshake time, which is
+       also the largest packet we ask the peer to send on our channels */
+    size_t packet_buf_size;
+
+    /* Recycled buffers and nodes for incoming packets */
+    struct packet_pool packet_pool;
+
+    /* Receive window autotuning, see channel.c */
+    size_t window_budget;       /* most window the channels may hold */
+    size_t window_reserved;     /* sum of their window targets */
+    libssh2_uint64_t rtt;       /* smoothed round trip time in microseconds,
+                                   0 until measured */
+
+    /* Performance counters, see libssh2_session_get_stats() */
+    LIBSSH2_SESSION_STATS stats;
+    libssh2_uint64_t kex_start;     /* when the running key exchange began */
 };
 
 /* session.state bits */
@@ -1051,6 +1215,9 @@ struct _LIBSSH2_CRYPT_METHOD
     int (*get_len) (LIBSSH2_SESSION * session, unsigned int seqno,
                     unsigned char *data, size_t data_size, unsigned int *len,
                     void **abstract);
+    /* en/decrypt 'blocksize' bytes in place. The span may hold any number
+       of whole cipher blocks; 'firstlast' tells whether it starts and/or
+       ends the packet */
     int (*crypt) (LIBSSH2_SESSION * session, unsigned int seqno,
                   unsigned char *block, size_t blocksize, void **abstract,
                   int firstlast);
@@ -1211,6 +1378,8 @@ ssize_t _libssh2_send(libssh2_socket_t socket, const void *buffer,
 int _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                           key_exchange_state_t * state);
 
+void _libssh2_kex_pregen_free(LIBSSH2_SESSION *session);
+
 unsigned char *_libssh2_kex_agree_instr(unsigned char *haystack,
                                         size_t haystack_len,
                                         const unsigned char *needle,
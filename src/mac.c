@@ -78,29 +78,46 @@ static LIBSSH2_MAC_METHOD mac_method_none = {
 };
 #endif /* defined(LIBSSH2DEBUG) && defined(LIBSSH2_MAC_NONE_INSECURE) */
 
-/* mac_method_common_init
- * Initialize simple mac methods
+/* mac_method_hmac_init
+ * Hash the padded key blocks once, each packet then starts from a copy of
+ * the prepared states
  */
 static int
-mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
-                       int *free_key, void **abstract)
+mac_method_hmac_init(LIBSSH2_SESSION * session, unsigned char *key,
+                     size_t key_len,
+                     int (*key_init)(libssh2_hmac_key *, void *, size_t),
+                     int *free_key, void **abstract)
 {
-    *abstract = key;
-    *free_key = 0;
-    (void)session;
+    libssh2_hmac_key *hkey;
+
+    /* the key itself is not needed afterwards */
+    *free_key = 1;
+    *abstract = NULL;
+
+    hkey = LIBSSH2_ALLOC(session, sizeof(libssh2_hmac_key));
+    if(!hkey)
+        return -1;
+
+    if(!key_init(hkey, key, key_len)) {
+        LIBSSH2_FREE(session, hkey);
+        return -1;
+    }
+
+    *abstract = hkey;
 
     return 0;
 }
 
 
 
-/* mac_method_common_dtor
- * Cleanup simple mac methods
+/* mac_method_hmac_dtor
+ * Cleanup prepared HMAC keys
  */
 static int
-mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
+mac_method_hmac_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
     if(*abstract) {
+        _libssh2_hmac_key_cleanup(*abstract);
         LIBSSH2_FREE(session, *abstract);
     }
     *abstract = NULL;
@@ -110,48 +127,62 @@ mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
 
 
 
-#if LIBSSH2_HMAC_SHA512
-/* mac_method_hmac_sha512_hash
- * Calculate hash using full sha512 value
+/* mac_method_hmac_hash
+ * Calculate hash using the full digest
  */
 static int
-mac_method_hmac_sha2_512_hash(LIBSSH2_SESSION * session,
-                              unsigned char *buf, uint32_t seqno,
-                              const unsigned char *packet,
-                              size_t packet_len,
-                              const unsigned char *addtl,
-                              size_t addtl_len, void **abstract)
+mac_method_hmac_hash(LIBSSH2_SESSION * session,
+                     unsigned char *buf, uint32_t seqno,
+                     const unsigned char *packet,
+                     size_t packet_len,
+                     const unsigned char *addtl,
+                     size_t addtl_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
+    libssh2_hmac_key *hkey = *abstract;
     unsigned char seqno_buf[4];
     int res;
     (void)session;
 
+    if(!hkey)
+        return 1;
+
     _libssh2_htonu32(seqno_buf, seqno);
 
-    if(!_libssh2_hmac_ctx_init(&ctx))
-        return 1;
-    res = _libssh2_hmac_sha512_init(&ctx, *abstract, 64) &&
-          _libssh2_hmac_update(&ctx, seqno_buf, 4) &&
-          _libssh2_hmac_update(&ctx, packet, packet_len);
+    res = _libssh2_hmac_key_start(hkey) &&
+          _libssh2_hmac_key_update(hkey, seqno_buf, 4) &&
+          _libssh2_hmac_key_update(hkey, packet, packet_len);
     if(res && addtl && addtl_len)
-        res = _libssh2_hmac_update(&ctx, addtl, addtl_len);
+        res = _libssh2_hmac_key_update(hkey, addtl, addtl_len);
     if(res)
-        res = _libssh2_hmac_final(&ctx, buf);
-    _libssh2_hmac_cleanup(&ctx);
+        res = _libssh2_hmac_key_final(hkey, buf);
 
     return !res;
 }
 
 
 
+#if LIBSSH2_HMAC_SHA512
+/* mac_method_hmac_sha2_512_init
+ * Prepare the hmac-sha2-512 key
+ */
+static int
+mac_method_hmac_sha2_512_init(LIBSSH2_SESSION * session, unsigned char *key,
+                              int *free_key, void **abstract)
+{
+    return mac_method_hmac_init(session, key, 64,
+                                _libssh2_hmac_sha512_key_init,
+                                free_key, abstract);
+}
+
+
+
 static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512 = {
     "hmac-sha2-512",
     64,
     64,
-    mac_method_common_init,
-    mac_method_hmac_sha2_512_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_512_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 
@@ -159,9 +190,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512_etm = {
     "hmac-sha2-512-etm@openssh.com",
     64,
     64,
-    mac_method_common_init,
-    mac_method_hmac_sha2_512_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_512_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     1
 };
 
@@ -170,36 +201,16 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512_etm = {
 
 
 #if LIBSSH2_HMAC_SHA256
-/* mac_method_hmac_sha256_hash
- * Calculate hash using full sha256 value
+/* mac_method_hmac_sha2_256_init
+ * Prepare the hmac-sha2-256 key
  */
 static int
-mac_method_hmac_sha2_256_hash(LIBSSH2_SESSION * session,
-                              unsigned char *buf, uint32_t seqno,
-                              const unsigned char *packet,
-                              size_t packet_len,
-                              const unsigned char *addtl,
-                              size_t addtl_len, void **abstract)
+mac_method_hmac_sha2_256_init(LIBSSH2_SESSION * session, unsigned char *key,
+                              int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    int res;
-    (void)session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    if(!_libssh2_hmac_ctx_init(&ctx))
-        return 1;
-    res = _libssh2_hmac_sha256_init(&ctx, *abstract, 32) &&
-          _libssh2_hmac_update(&ctx, seqno_buf, 4) &&
-          _libssh2_hmac_update(&ctx, packet, packet_len);
-    if(res && addtl && addtl_len)
-        res = _libssh2_hmac_update(&ctx, addtl, addtl_len);
-    if(res)
-        res = _libssh2_hmac_final(&ctx, buf);
-    _libssh2_hmac_cleanup(&ctx);
-
-    return !res;
+    return mac_method_hmac_init(session, key, 32,
+                                _libssh2_hmac_sha256_key_init,
+                                free_key, abstract);
 }
 
 
@@ -208,9 +219,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256 = {
     "hmac-sha2-256",
     32,
     32,
-    mac_method_common_init,
-    mac_method_hmac_sha2_256_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_256_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 
@@ -218,9 +229,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256_etm = {
     "hmac-sha2-256-etm@openssh.com",
     32,
     32,
-    mac_method_common_init,
-    mac_method_hmac_sha2_256_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha2_256_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     1
 };
 
@@ -229,36 +240,16 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256_etm = {
 
 
 
-/* mac_method_hmac_sha1_hash
- * Calculate hash using full sha1 value
+/* mac_method_hmac_sha1_init
+ * Prepare the hmac-sha1 key
  */
 static int
-mac_method_hmac_sha1_hash(LIBSSH2_SESSION * session,
-                          unsigned char *buf, uint32_t seqno,
-                          const unsigned char *packet,
-                          size_t packet_len,
-                          const unsigned char *addtl,
-                          size_t addtl_len, void **abstract)
+mac_method_hmac_sha1_init(LIBSSH2_SESSION * session, unsigned char *key,
+                          int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    int res;
-    (void)session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    if(!_libssh2_hmac_ctx_init(&ctx))
-        return 1;
-    res = _libssh2_hmac_sha1_init(&ctx, *abstract, 20) &&
-          _libssh2_hmac_update(&ctx, seqno_buf, 4) &&
-          _libssh2_hmac_update(&ctx, packet, packet_len);
-    if(res && addtl && addtl_len)
-        res = _libssh2_hmac_update(&ctx, addtl, addtl_len);
-    if(res)
-        res = _libssh2_hmac_final(&ctx, buf);
-    _libssh2_hmac_cleanup(&ctx);
-
-    return !res;
+    return mac_method_hmac_init(session, key, 20,
+                                _libssh2_hmac_sha1_key_init,
+                                free_key, abstract);
 }
 
 
@@ -267,9 +258,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1 = {
     "hmac-sha1",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_sha1_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha1_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 
@@ -277,9 +268,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_etm = {
     "hmac-sha1-etm@openssh.com",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_sha1_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_sha1_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     1
 };
 
@@ -296,8 +287,8 @@ mac_method_hmac_sha1_96_hash(LIBSSH2_SESSION * session,
 {
     unsigned char temp[SHA_DIGEST_LENGTH];
 
-    if(mac_method_hmac_sha1_hash(session, temp, seqno, packet, packet_len,
-                                 addtl, addtl_len, abstract))
+    if(mac_method_hmac_hash(session, temp, seqno, packet, packet_len,
+                            addtl, addtl_len, abstract))
         return 1;
 
     memcpy(buf, (char *) temp, 96 / 8);
@@ -310,43 +301,23 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_96 = {
     "hmac-sha1-96",
     12,
     20,
-    mac_method_common_init,
+    mac_method_hmac_sha1_init,
     mac_method_hmac_sha1_96_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_dtor,
     0
 };
 
 #if LIBSSH2_MD5
-/* mac_method_hmac_md5_hash
- * Calculate hash using full md5 value
+/* mac_method_hmac_md5_init
+ * Prepare the hmac-md5 key
  */
 static int
-mac_method_hmac_md5_hash(LIBSSH2_SESSION * session, unsigned char *buf,
-                         uint32_t seqno,
-                         const unsigned char *packet,
-                         size_t packet_len,
-                         const unsigned char *addtl,
-                         size_t addtl_len, void **abstract)
+mac_method_hmac_md5_init(LIBSSH2_SESSION * session, unsigned char *key,
+                         int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    int res;
-    (void)session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    if(!_libssh2_hmac_ctx_init(&ctx))
-        return 1;
-    res = _libssh2_hmac_md5_init(&ctx, *abstract, 16) &&
-          _libssh2_hmac_update(&ctx, seqno_buf, 4) &&
-          _libssh2_hmac_update(&ctx, packet, packet_len);
-    if(res && addtl && addtl_len)
-        res = _libssh2_hmac_update(&ctx, addtl, addtl_len);
-    if(res)
-        res = _libssh2_hmac_final(&ctx, buf);
-    _libssh2_hmac_cleanup(&ctx);
-
-    return !res;
+    return mac_method_hmac_init(session, key, 16,
+                                _libssh2_hmac_md5_key_init,
+                                free_key, abstract);
 }
 
 
@@ -355,9 +326,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5 = {
     "hmac-md5",
     16,
     16,
-    mac_method_common_init,
-    mac_method_hmac_md5_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_md5_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 
@@ -374,8 +345,8 @@ mac_method_hmac_md5_96_hash(LIBSSH2_SESSION * session,
 {
     unsigned char temp[MD5_DIGEST_LENGTH];
 
-    if(mac_method_hmac_md5_hash(session, temp, seqno, packet, packet_len,
-                                addtl, addtl_len, abstract))
+    if(mac_method_hmac_hash(session, temp, seqno, packet, packet_len,
+                            addtl, addtl_len, abstract))
         return 1;
 
     memcpy(buf, (char *) temp, 96 / 8);
@@ -388,45 +359,24 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_md5_96 = {
     "hmac-md5-96",
     12,
     16,
-    mac_method_common_init,
+    mac_method_hmac_md5_init,
     mac_method_hmac_md5_96_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_dtor,
     0
 };
 #endif /* LIBSSH2_MD5 */
 
 #if LIBSSH2_HMAC_RIPEMD
-/* mac_method_hmac_ripemd160_hash
- * Calculate hash using ripemd160 value
+/* mac_method_hmac_ripemd160_init
+ * Prepare the hmac-ripemd160 key
  */
 static int
-mac_method_hmac_ripemd160_hash(LIBSSH2_SESSION * session,
-                               unsigned char *buf, uint32_t seqno,
-                               const unsigned char *packet,
-                               size_t packet_len,
-                               const unsigned char *addtl,
-                               size_t addtl_len,
-                               void **abstract)
+mac_method_hmac_ripemd160_init(LIBSSH2_SESSION * session, unsigned char *key,
+                               int *free_key, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
-    int res;
-    (void)session;
-
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    if(!_libssh2_hmac_ctx_init(&ctx))
-        return 1;
-    res = _libssh2_hmac_ripemd160_init(&ctx, *abstract, 20) &&
-          _libssh2_hmac_update(&ctx, seqno_buf, 4) &&
-          _libssh2_hmac_update(&ctx, packet, packet_len);
-    if(res && addtl && addtl_len)
-        res = _libssh2_hmac_update(&ctx, addtl, addtl_len);
-    if(res)
-        res = _libssh2_hmac_final(&ctx, buf);
-    _libssh2_hmac_cleanup(&ctx);
-
-    return !res;
+    return mac_method_hmac_init(session, key, 20,
+                                _libssh2_hmac_ripemd160_key_init,
+                                free_key, abstract);
 }
 
 
@@ -435,9 +385,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160 = {
     "hmac-ripemd160",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_ripemd160_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_ripemd160_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 
@@ -445,9 +395,9 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160_openssh_com = {
     "hmac-ripemd160@openssh.com",
     20,
     20,
-    mac_method_common_init,
-    mac_method_hmac_ripemd160_hash,
-    mac_method_common_dtor,
+    mac_method_hmac_ripemd160_init,
+    mac_method_hmac_hash,
+    mac_method_hmac_dtor,
     0
 };
 #endif /* LIBSSH2_HMAC_RIPEMD */
@@ -41,9 +41,18 @@
 
 #include <stdlib.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if LIBSSH2_ED25519
+#include "ed25519.h"
+#endif
+
 #if MBEDTLS_VERSION_NUMBER < 0x03000000
 #define mbedtls_cipher_info_get_key_bitlen(c) (c->key_bitlen)
 #define mbedtls_cipher_info_get_iv_size(c)    (c->iv_size)
+#define mbedtls_cipher_info_get_mode(c)       (c->mode)
 #define mbedtls_rsa_get_len(rsa)              (rsa->len)
 
 #define MBEDTLS_PRIVATE(m) m
@@ -57,6 +66,99 @@
 static mbedtls_entropy_context  _libssh2_mbedtls_entropy;
 static mbedtls_ctr_drbg_context _libssh2_mbedtls_ctr_drbg;
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * Every thread gets its own CTR_DRBG, seeded from the shared entropy
+ * source on first use, so that sessions running on different threads or
+ * tasks do not share (and race on) one generator state. Each of them
+ * seeds and reseeds from the shared entropy context, which mbedTLS only
+ * locks itself with MBEDTLS_THREADING_C (off in ESP-IDF), so every
+ * generator polls it through _libssh2_mbedtls_entropy_func() under
+ * _libssh2_mbedtls_entropy_lock. The global generator above is the
+ * fallback if a thread's own one cannot be set up; threads falling back
+ * share it under _libssh2_mbedtls_drbg_lock, which is always taken before
+ * the entropy lock.
+ */
+static pthread_key_t _libssh2_mbedtls_drbg_key;
+static int _libssh2_mbedtls_drbg_key_ok;
+static pthread_mutex_t _libssh2_mbedtls_entropy_lock =
+    PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _libssh2_mbedtls_drbg_lock =
+    PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_libssh2_mbedtls_drbg_free(void *drbg)
+{
+    mbedtls_ctr_drbg_free(drbg);
+    mbedtls_free(drbg);
+}
+#endif
+
+/* entropy callback of every CTR_DRBG */
+static int
+_libssh2_mbedtls_entropy_func(void *entropy, unsigned char *out, size_t len)
+{
+    int ret;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&_libssh2_mbedtls_entropy_lock);
+#endif
+    ret = mbedtls_entropy_func(entropy, out, len);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&_libssh2_mbedtls_entropy_lock);
+#endif
+    return ret;
+}
+
+/* the CTR_DRBG to use on the calling thread */
+static mbedtls_ctr_drbg_context *
+_libssh2_mbedtls_drbg(void)
+{
+#ifdef HAVE_PTHREAD_H
+    mbedtls_ctr_drbg_context *drbg;
+
+    if(!_libssh2_mbedtls_drbg_key_ok)
+        return &_libssh2_mbedtls_ctr_drbg;
+
+    drbg = pthread_getspecific(_libssh2_mbedtls_drbg_key);
+    if(drbg)
+        return drbg;
+
+    drbg = mbedtls_calloc(1, sizeof(*drbg));
+    if(!drbg)
+        return &_libssh2_mbedtls_ctr_drbg;
+
+    mbedtls_ctr_drbg_init(drbg);
+    if(mbedtls_ctr_drbg_seed(drbg, _libssh2_mbedtls_entropy_func,
+                             &_libssh2_mbedtls_entropy, NULL, 0) ||
+       pthread_setspecific(_libssh2_mbedtls_drbg_key, drbg)) {
+        _libssh2_mbedtls_drbg_free(drbg);
+        return &_libssh2_mbedtls_ctr_drbg;
+    }
+
+    return drbg;
+#else
+    return &_libssh2_mbedtls_ctr_drbg;
+#endif
+}
+
+/* f_rng of every mbedTLS call, with _libssh2_mbedtls_drbg() as p_rng */
+static int
+_libssh2_mbedtls_rng(void *drbg, unsigned char *out, size_t len)
+{
+#ifdef HAVE_PTHREAD_H
+    if(drbg == &_libssh2_mbedtls_ctr_drbg) {
+        int ret;
+
+        pthread_mutex_lock(&_libssh2_mbedtls_drbg_lock);
+        ret = mbedtls_ctr_drbg_random(drbg, out, len);
+        pthread_mutex_unlock(&_libssh2_mbedtls_drbg_lock);
+        return ret;
+    }
+#endif
+    return mbedtls_ctr_drbg_random(drbg, out, len);
+}
+
 /*******************************************************************/
 /*
  * mbedTLS backend: Generic functions
@@ -71,15 +173,33 @@ _libssh2_mbedtls_init(void)
     mbedtls_ctr_drbg_init(&_libssh2_mbedtls_ctr_drbg);
 
     ret = mbedtls_ctr_drbg_seed(&_libssh2_mbedtls_ctr_drbg,
-                                mbedtls_entropy_func,
+                                _libssh2_mbedtls_entropy_func,
                                 &_libssh2_mbedtls_entropy, NULL, 0);
     if(ret)
         mbedtls_ctr_drbg_free(&_libssh2_mbedtls_ctr_drbg);
+
+#ifdef HAVE_PTHREAD_H
+    _libssh2_mbedtls_drbg_key_ok =
+        !pthread_key_create(&_libssh2_mbedtls_drbg_key,
+                            _libssh2_mbedtls_drbg_free);
+#endif
 }
 
 void
 _libssh2_mbedtls_free(void)
 {
+#ifdef HAVE_PTHREAD_H
+    if(_libssh2_mbedtls_drbg_key_ok) {
+        /* pthread_key_delete() runs no destructors, release the one of the
+           calling thread here. Threads still using libssh2 at this point
+           keep theirs. */
+        void *drbg = pthread_getspecific(_libssh2_mbedtls_drbg_key);
+        if(drbg)
+            _libssh2_mbedtls_drbg_free(drbg);
+        pthread_key_delete(_libssh2_mbedtls_drbg_key);
+        _libssh2_mbedtls_drbg_key_ok = 0;
+    }
+#endif
     mbedtls_ctr_drbg_free(&_libssh2_mbedtls_ctr_drbg);
     mbedtls_entropy_free(&_libssh2_mbedtls_entropy);
 }
@@ -88,7 +208,7 @@ int
 _libssh2_mbedtls_random(unsigned char *buf, size_t len)
 {
     int ret;
-    ret = mbedtls_ctr_drbg_random(&_libssh2_mbedtls_ctr_drbg, buf, len);
+    ret = _libssh2_mbedtls_rng(_libssh2_mbedtls_drbg(), buf, len);
     return ret == 0 ? 0 : -1;
 }
 
@@ -117,71 +237,212 @@ _libssh2_mbedtls_cipher_init(_libssh2_cipher_ctx *ctx,
     if(!ctx)
         return -1;
 
-    op = encrypt == 0 ? MBEDTLS_ENCRYPT : MBEDTLS_DECRYPT;
+    op = encrypt ? MBEDTLS_ENCRYPT : MBEDTLS_DECRYPT;
 
     cipher_info = mbedtls_cipher_info_from_type(algo);
     if(!cipher_info)
         return -1;
 
-    mbedtls_cipher_init(ctx);
-    ret = mbedtls_cipher_setup(ctx, cipher_info);
+    mbedtls_cipher_init(&ctx->ctx);
+#if LIBSSH2_AES_GCM
+    mbedtls_aes_init(&ctx->aes);
+#endif
+    ret = mbedtls_cipher_setup(&ctx->ctx, cipher_info);
     if(!ret)
-        ret = mbedtls_cipher_setkey(ctx,
+        ret = mbedtls_cipher_setkey(&ctx->ctx,
                   secret,
                   (int)mbedtls_cipher_info_get_key_bitlen(cipher_info),
                   op);
 
+#if LIBSSH2_AES_GCM
+    if(mbedtls_cipher_info_get_mode(cipher_info) == MBEDTLS_MODE_GCM) {
+        /* the nonce is set for each packet by
+           _libssh2_mbedtls_cipher_crypt() */
+        memcpy(ctx->iv, iv, sizeof(ctx->iv));
+        ctx->started = 0;
+
+        if(!ret)
+            ret = mbedtls_aes_setkey_enc(&ctx->aes, secret,
+                      mbedtls_cipher_info_get_key_bitlen(cipher_info));
+        if(ret)
+            _libssh2_mbedtls_cipher_dtor(ctx);
+
+        return ret == 0 ? 0 : -1;
+    }
+#endif
+
+#if defined(MBEDTLS_CIPHER_MODE_WITH_PADDING)
+    /* SSH packets are always a whole number of blocks, the padding is
+       part of the packet itself */
+    if(!ret &&
+       mbedtls_cipher_info_get_mode(cipher_info) == MBEDTLS_MODE_CBC)
+        ret = mbedtls_cipher_set_padding_mode(&ctx->ctx,
+                                              MBEDTLS_PADDING_NONE);
+#endif
+
     if(!ret)
-        ret = mbedtls_cipher_set_iv(ctx, iv,
+        ret = mbedtls_cipher_set_iv(&ctx->ctx, iv,
                   mbedtls_cipher_info_get_iv_size(cipher_info));
 
+    if(!ret)
+        ret = mbedtls_cipher_reset(&ctx->ctx);
+
+    if(ret)
+        _libssh2_mbedtls_cipher_dtor(ctx);
+
     return ret == 0 ? 0 : -1;
 }
 
-int
-_libssh2_mbedtls_cipher_crypt(_libssh2_cipher_ctx *ctx,
-                              _libssh2_cipher_type(algo),
-                              int encrypt,
-                              unsigned char *block,
-                              size_t blocklen, int firstlast)
+#if LIBSSH2_AES_GCM
+/*
+ * aes*-gcm@openssh.com encrypts each packet as a GCM message of its own,
+ * with the packet length field as additional data and a 12 byte nonce
+ * whose last 8 bytes count the packets (RFC 5647).
+ *
+ * The transport layer hands a packet over in several spans, and after the
+ * 4 byte length field the first of them ends 12 bytes into a cipher block.
+ * mbedTLS 2.x, and some hardware implementations, require every update but
+ * the last to be a whole number of blocks. So a partial block at the end of
+ * a span is en/decrypted with a keystream block of our own and its input
+ * goes to GCM together with the start of the next span.
+ */
+static int
+gcm_crypt(_libssh2_cipher_ctx *ctx, int encrypt,
+          unsigned char *block, size_t blocklen, int firstlast)
 {
+    unsigned char out[16];
+    unsigned char *tag = NULL;
+    size_t olen, n, i;
     int ret;
-    unsigned char *output;
-    size_t osize, olen, finish_olen;
 
-    (void)encrypt;
-    (void)algo;
-    (void)firstlast;
-
-    osize = blocklen + mbedtls_cipher_get_block_size(ctx);
+    if(!ctx->started) {
+        size_t aad_len = IS_FIRST(firstlast) ? 4 : 0;
 
-    output = (unsigned char *)mbedtls_calloc(osize, sizeof(char));
-    if(output) {
-        ret = mbedtls_cipher_reset(ctx);
+        if(blocklen < aad_len)
+            return -1;
 
+        ret = mbedtls_cipher_set_iv(&ctx->ctx, ctx->iv, sizeof(ctx->iv));
         if(!ret)
-            ret = mbedtls_cipher_update(ctx, block, blocklen, output, &olen);
-
+            ret = mbedtls_cipher_reset(&ctx->ctx);
         if(!ret)
-            ret = mbedtls_cipher_finish(ctx, output + olen, &finish_olen);
+            ret = mbedtls_cipher_update_ad(&ctx->ctx, block, aad_len);
+        if(ret)
+            return -1;
+
+        block += aad_len;
+        blocklen -= aad_len;
+        ctx->carry_len = 0;
+        ctx->blocks = 0;
+        ctx->started = 1;
+    }
+
+    if(IS_LAST(firstlast)) {
+        /* the span ends with the authentication tag */
+        if(blocklen < 16)
+            return -1;
+        blocklen -= 16;
+        tag = block + blocklen;
+    }
 
-        if(!ret) {
-            olen += finish_olen;
-            memcpy(block, output, olen);
+    /* complete the block carried over from the previous span */
+    if(ctx->carry_len) {
+        n = LIBSSH2_MIN(blocklen, 16 - ctx->carry_len);
+        memcpy(&ctx->carry[ctx->carry_len], block, n);
+        for(i = 0; i < n; i++)
+            block[i] ^= ctx->keystream[ctx->carry_len + i];
+        ctx->carry_len += n;
+        block += n;
+        blocklen -= n;
+
+        if(ctx->carry_len == 16 || tag) {
+            /* the output is what the keystream already gave */
+            if(mbedtls_cipher_update(&ctx->ctx, ctx->carry, ctx->carry_len,
+                                     out, &olen))
+                return -1;
+            ctx->carry_len = 0;
+            ctx->blocks++;
         }
+    }
 
-        _libssh2_mbedtls_safe_free(output, osize);
+    /* whole blocks in place, and in the last span all that is left */
+    n = tag ? blocklen : (blocklen & ~(size_t)15);
+    if(n) {
+        if(mbedtls_cipher_update(&ctx->ctx, block, n, block, &olen) ||
+           olen != n)
+            return -1;
+        ctx->blocks += (uint32_t)(n / 16);
+        block += n;
+        blocklen -= n;
     }
+
+    /* a partial block is left, the counter block for it is the nonce
+       followed by the 32 bit block number, counting from 2 */
+    if(blocklen) {
+        memcpy(ctx->keystream, ctx->iv, sizeof(ctx->iv));
+        _libssh2_htonu32(&ctx->keystream[12], ctx->blocks + 2);
+        if(mbedtls_aes_crypt_ecb(&ctx->aes, MBEDTLS_AES_ENCRYPT,
+                                 ctx->keystream, ctx->keystream))
+            return -1;
+
+        memcpy(ctx->carry, block, blocklen);
+        for(i = 0; i < blocklen; i++)
+            block[i] ^= ctx->keystream[i];
+        ctx->carry_len = blocklen;
+    }
+
+    if(!tag)
+        return 0;
+
+    if(encrypt)
+        ret = mbedtls_cipher_write_tag(&ctx->ctx, tag, 16);
     else
-        ret = -1;
+        ret = mbedtls_cipher_check_tag(&ctx->ctx, tag, 16);
+
+    /* next packet: increment the 64 bit invocation counter */
+    ctx->started = 0;
+    for(i = sizeof(ctx->iv); i-- > 4;) {
+        if(++ctx->iv[i])
+            break;
+    }
 
     return ret == 0 ? 0 : -1;
 }
+#endif
+
+int
+_libssh2_mbedtls_cipher_crypt(_libssh2_cipher_ctx *ctx,
+                              _libssh2_cipher_type(algo),
+                              int encrypt,
+                              unsigned char *block,
+                              size_t blocklen, int firstlast)
+{
+    int ret;
+    size_t olen = 0;
+
+#if LIBSSH2_AES_GCM
+    if(algo == _libssh2_cipher_aes256gcm || algo == _libssh2_cipher_aes128gcm)
+        return gcm_crypt(ctx, encrypt, block, blocklen, firstlast);
+#endif
+
+    (void)encrypt;
+    (void)algo;
+    (void)firstlast;
+
+    /* The context carries the IV/counter over from the previous call and
+       no padding is applied, so whole blocks are processed in place
+       without resetting or finishing the context in between. */
+    ret = mbedtls_cipher_update(&ctx->ctx, block, blocklen, block, &olen);
+
+    return (ret == 0 && olen == blocklen) ? 0 : -1;
+}
 
 void
 _libssh2_mbedtls_cipher_dtor(_libssh2_cipher_ctx *ctx)
 {
-    mbedtls_cipher_free(ctx);
+    mbedtls_cipher_free(&ctx->ctx);
+#if LIBSSH2_AES_GCM
+    mbedtls_aes_free(&ctx->aes);
+#endif
 }
 
 
@@ -298,6 +559,138 @@ void _libssh2_hmac_cleanup(libssh2_hmac_ctx *ctx)
     mbedtls_md_free(ctx);
 }
 
+static int
+_libssh2_mbedtls_hmac_key_init(libssh2_hmac_key *hkey,
+                               mbedtls_md_type_t mdtype,
+                               const unsigned char *key, size_t keylen)
+{
+    const mbedtls_md_info_t *md_info;
+    unsigned char pad[128];     /* the largest block, SHA-512 */
+    unsigned char sum[MBEDTLS_MD_MAX_SIZE];
+    size_t block_len, i;
+    int ret;
+
+    md_info = mbedtls_md_info_from_type(mdtype);
+    if(!md_info)
+        return 0;
+
+    block_len = (mdtype == MBEDTLS_MD_SHA384 ||
+                 mdtype == MBEDTLS_MD_SHA512) ? 128 : 64;
+    hkey->digest_len = mbedtls_md_get_size(md_info);
+
+    mbedtls_md_init(&hkey->inner);
+    mbedtls_md_init(&hkey->outer);
+    mbedtls_md_init(&hkey->work);
+
+    if(keylen > block_len) {
+        if(mbedtls_md(md_info, key, keylen, sum))
+            return 0;
+        key = sum;
+        keylen = hkey->digest_len;
+    }
+
+    memset(pad, 0x36, block_len);
+    for(i = 0; i < keylen; i++)
+        pad[i] ^= key[i];
+
+    ret = mbedtls_md_setup(&hkey->inner, md_info, 0) ||
+          mbedtls_md_starts(&hkey->inner) ||
+          mbedtls_md_update(&hkey->inner, pad, block_len);
+
+    for(i = 0; i < block_len; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+
+    ret = ret ||
+          mbedtls_md_setup(&hkey->outer, md_info, 0) ||
+          mbedtls_md_starts(&hkey->outer) ||
+          mbedtls_md_update(&hkey->outer, pad, block_len) ||
+          mbedtls_md_setup(&hkey->work, md_info, 0);
+
+    _libssh2_explicit_zero(pad, sizeof(pad));
+    _libssh2_explicit_zero(sum, sizeof(sum));
+
+    if(ret) {
+        _libssh2_hmac_key_cleanup(hkey);
+        return 0;
+    }
+
+    return 1;
+}
+
+#if LIBSSH2_MD5
+int _libssh2_hmac_md5_key_init(libssh2_hmac_key *hkey,
+                               void *key, size_t keylen)
+{
+    return _libssh2_mbedtls_hmac_key_init(hkey, MBEDTLS_MD_MD5, key, keylen);
+}
+#endif
+
+#if LIBSSH2_HMAC_RIPEMD
+int _libssh2_hmac_ripemd160_key_init(libssh2_hmac_key *hkey,
+                                     void *key, size_t keylen)
+{
+    return _libssh2_mbedtls_hmac_key_init(hkey, MBEDTLS_MD_RIPEMD160,
+                                          key, keylen);
+}
+#endif
+
+int _libssh2_hmac_sha1_key_init(libssh2_hmac_key *hkey,
+                                void *key, size_t keylen)
+{
+    return _libssh2_mbedtls_hmac_key_init(hkey, MBEDTLS_MD_SHA1, key, keylen);
+}
+
+int _libssh2_hmac_sha256_key_init(libssh2_hmac_key *hkey,
+                                  void *key, size_t keylen)
+{
+    return _libssh2_mbedtls_hmac_key_init(hkey, MBEDTLS_MD_SHA256,
+                                          key, keylen);
+}
+
+int _libssh2_hmac_sha512_key_init(libssh2_hmac_key *hkey,
+                                  void *key, size_t keylen)
+{
+    return _libssh2_mbedtls_hmac_key_init(hkey, MBEDTLS_MD_SHA512,
+                                          key, keylen);
+}
+
+int _libssh2_hmac_key_start(libssh2_hmac_key *hkey)
+{
+    int ret = mbedtls_md_clone(&hkey->work, &hkey->inner);
+
+    return ret == 0 ? 1 : 0;
+}
+
+int _libssh2_hmac_key_update(libssh2_hmac_key *hkey,
+                             const void *data, size_t datalen)
+{
+    int ret = mbedtls_md_update(&hkey->work, data, datalen);
+
+    return ret == 0 ? 1 : 0;
+}
+
+int _libssh2_hmac_key_final(libssh2_hmac_key *hkey, void *data)
+{
+    unsigned char sum[MBEDTLS_MD_MAX_SIZE];
+    int ret;
+
+    ret = mbedtls_md_finish(&hkey->work, sum) ||
+          mbedtls_md_clone(&hkey->work, &hkey->outer) ||
+          mbedtls_md_update(&hkey->work, sum, hkey->digest_len) ||
+          mbedtls_md_finish(&hkey->work, data);
+
+    _libssh2_explicit_zero(sum, sizeof(sum));
+
+    return ret ? 0 : 1;
+}
+
+void _libssh2_hmac_key_cleanup(libssh2_hmac_key *hkey)
+{
+    mbedtls_md_free(&hkey->inner);
+    mbedtls_md_free(&hkey->outer);
+    mbedtls_md_free(&hkey->work);
+}
+
 /*******************************************************************/
 /*
  * mbedTLS backend: BigNumber functions
@@ -336,8 +729,8 @@ _libssh2_mbedtls_bignum_random(_libssh2_bn *bn, int bits, int top, int bottom)
         return -1;
 
     len = (bits + 7) >> 3;
-    err = mbedtls_mpi_fill_random(bn, len, mbedtls_ctr_drbg_random,
-                                  &_libssh2_mbedtls_ctr_drbg);
+    err = mbedtls_mpi_fill_random(bn, len, _libssh2_mbedtls_rng,
+                                  _libssh2_mbedtls_drbg());
     if(err)
         return -1;
 
@@ -477,8 +870,8 @@ _libssh2_mbedtls_rsa_new_private(libssh2_rsa_ctx **rsa,
 
 #if MBEDTLS_VERSION_NUMBER >= 0x03000000
     ret = mbedtls_pk_parse_keyfile(&pkey, filename, (const char *)passphrase,
-                                   mbedtls_ctr_drbg_random,
-                                   &_libssh2_mbedtls_ctr_drbg);
+                                   _libssh2_mbedtls_rng,
+                                   _libssh2_mbedtls_drbg());
 #else
     ret = mbedtls_pk_parse_keyfile(&pkey, filename, (const char *)passphrase);
 #endif
@@ -514,6 +907,12 @@ _libssh2_mbedtls_rsa_new_private_frommemory(libssh2_rsa_ctx **rsa,
     if(!*rsa)
         return -1;
 
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    mbedtls_rsa_init(*rsa);
+#else
+    mbedtls_rsa_init(*rsa, MBEDTLS_RSA_PKCS_V15, 0);
+#endif
+
     /*
     mbedtls checks in "mbedtls/pkparse.c:1184" if "key[keylen - 1] != '\0'"
     private-key from memory will fail if the last byte is not a null byte
@@ -531,8 +930,8 @@ _libssh2_mbedtls_rsa_new_private_frommemory(libssh2_rsa_ctx **rsa,
     ret = mbedtls_pk_parse_key(&pkey, (unsigned char *)filedata_nullterm,
                                filedata_len + 1,
                                passphrase, pwd_len,
-                               mbedtls_ctr_drbg_random,
-                               &_libssh2_mbedtls_ctr_drbg);
+                               _libssh2_mbedtls_rng,
+                               _libssh2_mbedtls_drbg());
 #else
     ret = mbedtls_pk_parse_key(&pkey, (unsigned char *)filedata_nullterm,
                                filedata_len + 1,
@@ -655,8 +1054,8 @@ _libssh2_mbedtls_rsa_sha2_sign(LIBSSH2_SESSION *session,
     if(ret == 0) {
 #if MBEDTLS_VERSION_NUMBER >= 0x03000000
         ret = mbedtls_rsa_pkcs1_sign(rsa,
-                                     mbedtls_ctr_drbg_random,
-                                     &_libssh2_mbedtls_ctr_drbg,
+                                     _libssh2_mbedtls_rng,
+                                     _libssh2_mbedtls_drbg(),
                                      md_type, (unsigned int)hash_len,
                                      hash, sig);
 #else
@@ -739,6 +1138,23 @@ gen_publickey_from_rsa(LIBSSH2_SESSION *session,
     return key;
 }
 
+/* Force-expose internal mbedTLS function */
+#if MBEDTLS_VERSION_NUMBER >= 0x03060000
+int mbedtls_pk_load_file(const char *path, unsigned char **buf, size_t *n);
+#endif
+
+#if LIBSSH2_ED25519
+static int
+_libssh2_mbedtls_ed25519_pub_priv_key(LIBSSH2_SESSION *session,
+                                      unsigned char **method,
+                                      size_t *method_len,
+                                      unsigned char **pubkeydata,
+                                      size_t *pubkeydata_len,
+                                      const unsigned char *data,
+                                      size_t data_len,
+                                      const unsigned char *passphrase);
+#endif
+
 static int
 _libssh2_mbedtls_pub_priv_key(LIBSSH2_SESSION *session,
                               unsigned char **method,
@@ -749,7 +1165,7 @@ _libssh2_mbedtls_pub_priv_key(LIBSSH2_SESSION *session,
 {
     unsigned char *key = NULL, *mth = NULL;
     size_t keylen = 0, mthlen = 0;
-    int ret;
+    int ret = 0;
     mbedtls_rsa_context *rsa;
 
     if(mbedtls_pk_get_type(pkey) != MBEDTLS_PK_RSA) {
@@ -807,10 +1223,31 @@ _libssh2_mbedtls_pub_priv_keyfile(LIBSSH2_SESSION *session,
     mbedtls_pk_init(&pkey);
 #if MBEDTLS_VERSION_NUMBER >= 0x03000000
     ret = mbedtls_pk_parse_keyfile(&pkey, privatekey, passphrase,
-                                   mbedtls_ctr_drbg_random,
-                                   &_libssh2_mbedtls_ctr_drbg);
+                                   _libssh2_mbedtls_rng,
+                                   _libssh2_mbedtls_drbg());
 #else
     ret = mbedtls_pk_parse_keyfile(&pkey, privatekey, passphrase);
+#endif
+#if LIBSSH2_ED25519
+    if(ret) {
+        /* mbedTLS does not know OpenSSH keys, try an ed25519 one */
+        unsigned char *data = NULL;
+        size_t data_len = 0;
+
+        if(mbedtls_pk_load_file(privatekey, &data, &data_len) == 0) {
+            int rc = _libssh2_mbedtls_ed25519_pub_priv_key(session,
+                                        method, method_len,
+                                        pubkeydata, pubkeydata_len,
+                                        data, data_len,
+                                        (const unsigned char *)passphrase);
+
+            _libssh2_mbedtls_safe_free(data, data_len);
+            if(rc == 0) {
+                mbedtls_pk_free(&pkey);
+                return 0;
+            }
+        }
+    }
 #endif
     if(ret) {
         mbedtls_strerror(ret, (char *)buf, sizeof(buf));
@@ -860,8 +1297,8 @@ _libssh2_mbedtls_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
                                (unsigned char *)privatekeydata_nullterm,
                                privatekeydata_len + 1,
                                (const unsigned char *)passphrase, pwd_len,
-                               mbedtls_ctr_drbg_random,
-                               &_libssh2_mbedtls_ctr_drbg);
+                               _libssh2_mbedtls_rng,
+                               _libssh2_mbedtls_drbg());
 #else
     ret = mbedtls_pk_parse_key(&pkey,
                                (unsigned char *)privatekeydata_nullterm,
@@ -870,6 +1307,21 @@ _libssh2_mbedtls_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
 #endif
     _libssh2_mbedtls_safe_free(privatekeydata_nullterm, privatekeydata_len);
 
+#if LIBSSH2_ED25519
+    /* mbedTLS does not know OpenSSH keys, try an ed25519 one */
+    if(ret &&
+       _libssh2_mbedtls_ed25519_pub_priv_key(session, method, method_len,
+                                             pubkeydata, pubkeydata_len,
+                                             (const unsigned char *)
+                                             privatekeydata,
+                                             privatekeydata_len,
+                                             (const unsigned char *)
+                                             passphrase) == 0) {
+        mbedtls_pk_free(&pkey);
+        return 0;
+    }
+#endif
+
     if(ret) {
         mbedtls_strerror(ret, (char *)buf, sizeof(buf));
         mbedtls_pk_free(&pkey);
@@ -992,8 +1444,8 @@ _libssh2_mbedtls_ecdsa_create_key(LIBSSH2_SESSION *session,
     mbedtls_ecdsa_init(*privkey);
 
     if(mbedtls_ecdsa_genkey(*privkey, (mbedtls_ecp_group_id)curve,
-                            mbedtls_ctr_drbg_random,
-                            &_libssh2_mbedtls_ctr_drbg))
+                            _libssh2_mbedtls_rng,
+                            _libssh2_mbedtls_drbg()))
         goto failed;
 
     plen = 2 * mbedtls_mpi_size(&(*privkey)->MBEDTLS_PRIVATE(grp).P) + 1;
@@ -1087,8 +1539,8 @@ _libssh2_mbedtls_ecdh_gen_k(_libssh2_bn **k,
     if(mbedtls_ecdh_compute_shared(&privkey->MBEDTLS_PRIVATE(grp), *k,
                                    &pubkey,
                                    &privkey->MBEDTLS_PRIVATE(d),
-                                   mbedtls_ctr_drbg_random,
-                                   &_libssh2_mbedtls_ctr_drbg)) {
+                                   _libssh2_mbedtls_rng,
+                                   _libssh2_mbedtls_drbg())) {
         rc = -1;
         goto cleanup;
     }
@@ -1174,8 +1626,8 @@ _libssh2_mbedtls_parse_eckey(libssh2_ecdsa_ctx **ctx,
 
 #if MBEDTLS_VERSION_NUMBER >= 0x03000000
     if(mbedtls_pk_parse_key(pkey, data, data_len, pwd, pwd_len,
-                            mbedtls_ctr_drbg_random,
-                            &_libssh2_mbedtls_ctr_drbg))
+                            _libssh2_mbedtls_rng,
+                            _libssh2_mbedtls_drbg()))
 
         goto failed;
 #else
@@ -1257,8 +1709,8 @@ _libssh2_mbedtls_parse_openssh_key(libssh2_ecdsa_ctx **ctx,
                        &(*ctx)->MBEDTLS_PRIVATE(Q),
                        &(*ctx)->MBEDTLS_PRIVATE(d),
                        &(*ctx)->MBEDTLS_PRIVATE(grp).G,
-                       mbedtls_ctr_drbg_random,
-                       &_libssh2_mbedtls_ctr_drbg))
+                       _libssh2_mbedtls_rng,
+                       _libssh2_mbedtls_drbg()))
         goto failed;
 
     if(mbedtls_ecp_check_privkey(&(*ctx)->MBEDTLS_PRIVATE(grp),
@@ -1279,11 +1731,6 @@ cleanup:
     return *ctx ? 0 : -1;
 }
 
-/* Force-expose internal mbedTLS function */
-#if MBEDTLS_VERSION_NUMBER >= 0x03060000
-int mbedtls_pk_load_file(const char *path, unsigned char **buf, size_t *n);
-#endif
-
 /* _libssh2_ecdsa_new_private
  *
  * Creates a new private key given a file path and password
@@ -1416,8 +1863,8 @@ _libssh2_mbedtls_ecdsa_sign(LIBSSH2_SESSION *session,
     if(mbedtls_ecdsa_sign(&ctx->MBEDTLS_PRIVATE(grp), &pr, &ps,
                           &ctx->MBEDTLS_PRIVATE(d),
                           hash, hash_len,
-                          mbedtls_ctr_drbg_random,
-                          &_libssh2_mbedtls_ctr_drbg))
+                          _libssh2_mbedtls_rng,
+                          _libssh2_mbedtls_drbg()))
         goto cleanup;
 
     r_len = mbedtls_mpi_size(&pr) + 1;
@@ -1506,6 +1953,371 @@ _libssh2_mbedtls_ecdsa_free(libssh2_ecdsa_ctx *ctx)
 #endif /* LIBSSH2_ECDSA */
 
 
+#if LIBSSH2_ED25519
+
+/*******************************************************************/
+/*
+ * mbedTLS backend: ED25519 functions
+ */
+
+/* _libssh2_curve25519_new
+ *
+ * Creates an ephemeral X25519 key pair for curve25519-sha256
+ *
+ */
+
+int
+_libssh2_curve25519_new(LIBSSH2_SESSION *session, uint8_t **out_public_key,
+                        uint8_t **out_private_key)
+{
+    unsigned char *pub_key, *priv_key;
+
+    pub_key = LIBSSH2_ALLOC(session, LIBSSH2_ED25519_KEY_LEN);
+    priv_key = LIBSSH2_ALLOC(session, LIBSSH2_ED25519_KEY_LEN);
+
+    if(!pub_key || !priv_key ||
+       _libssh2_random(priv_key, LIBSSH2_ED25519_KEY_LEN)) {
+        if(pub_key)
+            LIBSSH2_FREE(session, pub_key);
+        if(priv_key)
+            LIBSSH2_FREE(session, priv_key);
+        return -1;
+    }
+
+    x25519_scalarmult_base(pub_key, priv_key);
+
+    if(out_public_key)
+        *out_public_key = pub_key;
+    else
+        LIBSSH2_FREE(session, pub_key);
+
+    if(out_private_key)
+        *out_private_key = priv_key;
+    else {
+        _libssh2_explicit_zero(priv_key, LIBSSH2_ED25519_KEY_LEN);
+        LIBSSH2_FREE(session, priv_key);
+    }
+
+    return 0;
+}
+
+/* _libssh2_curve25519_gen_k
+ *
+ * Computes the shared secret K from our private key and the server's
+ * public key, K is used as the raw 32 bytes like all implementations do
+ *
+ */
+
+int
+_libssh2_curve25519_gen_k(_libssh2_bn **k,
+                          uint8_t private_key[LIBSSH2_ED25519_KEY_LEN],
+                          uint8_t server_public_key[LIBSSH2_ED25519_KEY_LEN])
+{
+    unsigned char shared_key[LIBSSH2_ED25519_KEY_LEN];
+    int rc = -1;
+
+    if(!k || !*k)
+        return -1;
+
+    /* an all zero result means the server sent a point of small order */
+    if(x25519_scalarmult(shared_key, private_key, server_public_key) == 0 &&
+       _libssh2_bn_from_bin(*k, LIBSSH2_ED25519_KEY_LEN, shared_key) == 0)
+        rc = 0;
+
+    _libssh2_explicit_zero(shared_key, sizeof(shared_key));
+
+    return rc;
+}
+
+static int
+_libssh2_mbedtls_ed25519_parse_openssh_key(libssh2_ed25519_ctx **ed_ctx,
+                                           LIBSSH2_SESSION *session,
+                                           const unsigned char *data,
+                                           size_t data_len,
+                                           const unsigned char *pwd)
+{
+    libssh2_ed25519_ctx *ctx = NULL;
+    struct string_buf *decrypted = NULL;
+    unsigned char *pub_key, *priv_key;
+    size_t pub_len, priv_len;
+
+    if(_libssh2_openssh_pem_parse_memory(session, pwd,
+                                         (const char *)data, data_len,
+                                         &decrypted))
+        return -1;
+
+    if(_libssh2_match_string(decrypted, "ssh-ed25519"))
+        goto cleanup;
+
+    if(_libssh2_get_string(decrypted, &pub_key, &pub_len) ||
+       pub_len != LIBSSH2_ED25519_KEY_LEN)
+        goto cleanup;
+
+    /* the seed followed by the public key again */
+    if(_libssh2_get_string(decrypted, &priv_key, &priv_len) ||
+       priv_len != LIBSSH2_ED25519_PRIVATE_KEY_LEN ||
+       memcmp(priv_key + LIBSSH2_ED25519_KEY_LEN, pub_key,
+              LIBSSH2_ED25519_KEY_LEN))
+        goto cleanup;
+
+    ctx = mbedtls_calloc(1, sizeof(libssh2_ed25519_ctx));
+    if(!ctx)
+        goto cleanup;
+
+    memcpy(ctx->public_key, pub_key, LIBSSH2_ED25519_KEY_LEN);
+    memcpy(ctx->private_key, priv_key, LIBSSH2_ED25519_KEY_LEN);
+    ctx->has_private = 1;
+
+cleanup:
+
+    _libssh2_string_buf_free(session, decrypted);
+
+    if(!ctx)
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ed25519 private key");
+
+    *ed_ctx = ctx;
+
+    return 0;
+}
+
+static int
+_libssh2_mbedtls_ed25519_pub_priv_key(LIBSSH2_SESSION *session,
+                                      unsigned char **method,
+                                      size_t *method_len,
+                                      unsigned char **pubkeydata,
+                                      size_t *pubkeydata_len,
+                                      const unsigned char *data,
+                                      size_t data_len,
+                                      const unsigned char *passphrase)
+{
+    libssh2_ed25519_ctx *ctx = NULL;
+    unsigned char *mth, *key, *p;
+    size_t keylen = 4 + 11 + 4 + LIBSSH2_ED25519_KEY_LEN;
+
+    if(_libssh2_mbedtls_ed25519_parse_openssh_key(&ctx, session,
+                                                  data, data_len,
+                                                  passphrase))
+        return -1;
+
+    mth = LIBSSH2_ALLOC(session, 11);
+    key = LIBSSH2_ALLOC(session, keylen);
+    if(!mth || !key) {
+        if(mth)
+            LIBSSH2_FREE(session, mth);
+        if(key)
+            LIBSSH2_FREE(session, key);
+        _libssh2_mbedtls_ed25519_free(ctx);
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for public key");
+    }
+
+    memcpy(mth, "ssh-ed25519", 11);
+
+    p = key;
+    _libssh2_store_str(&p, "ssh-ed25519", 11);
+    _libssh2_store_str(&p, (const char *)ctx->public_key,
+                       LIBSSH2_ED25519_KEY_LEN);
+
+    _libssh2_mbedtls_ed25519_free(ctx);
+
+    *method = mth;
+    *method_len = 11;
+    *pubkeydata = key;
+    *pubkeydata_len = keylen;
+
+    return 0;
+}
+
+/* _libssh2_ed25519_new_private
+ *
+ * Creates a new private key given a file path and password
+ *
+ */
+
+int
+_libssh2_ed25519_new_private(libssh2_ed25519_ctx **ed_ctx,
+                             LIBSSH2_SESSION *session,
+                             const char *filename, const uint8_t *passphrase)
+{
+    unsigned char *data = NULL;
+    size_t data_len = 0;
+    int rc;
+
+    /* FIXME: Reimplement this functionality via a public API. */
+    if(mbedtls_pk_load_file(filename, &data, &data_len))
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to read private key file");
+
+    rc = _libssh2_mbedtls_ed25519_parse_openssh_key(ed_ctx, session,
+                                                    data, data_len,
+                                                    passphrase);
+
+    _libssh2_mbedtls_safe_free(data, data_len);
+
+    return rc;
+}
+
+/* _libssh2_ed25519_new_private_frommemory
+ *
+ * Creates a new private key given a file data and password
+ *
+ */
+
+int
+_libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx **ed_ctx,
+                                        LIBSSH2_SESSION *session,
+                                        const char *filedata,
+                                        size_t filedata_len,
+                                        const unsigned char *passphrase)
+{
+    return _libssh2_mbedtls_ed25519_parse_openssh_key(ed_ctx, session,
+                                                      (const unsigned char *)
+                                                      filedata,
+                                                      filedata_len,
+                                                      passphrase);
+}
+
+int
+_libssh2_ed25519_new_private_sk(libssh2_ed25519_ctx **ed_ctx,
+                                unsigned char *flags,
+                                const char **application,
+                                const unsigned char **key_handle,
+                                size_t *handle_len,
+                                LIBSSH2_SESSION *session,
+                                const char *filename,
+                                const uint8_t *passphrase)
+{
+    (void)ed_ctx;
+    (void)flags;
+    (void)application;
+    (void)key_handle;
+    (void)handle_len;
+    (void)filename;
+    (void)passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                          "Unable to load SK key: "
+                          "Method unimplemented in mbedTLS backend");
+}
+
+int
+_libssh2_ed25519_new_private_frommemory_sk(libssh2_ed25519_ctx **ed_ctx,
+                                           unsigned char *flags,
+                                           const char **application,
+                                           const unsigned char **key_handle,
+                                           size_t *handle_len,
+                                           LIBSSH2_SESSION *session,
+                                           const char *filedata,
+                                           size_t filedata_len,
+                                           const unsigned char *passphrase)
+{
+    (void)ed_ctx;
+    (void)flags;
+    (void)application;
+    (void)key_handle;
+    (void)handle_len;
+    (void)filedata;
+    (void)filedata_len;
+    (void)passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                          "Unable to load SK key: "
+                          "Method unimplemented in mbedTLS backend");
+}
+
+/* _libssh2_ed25519_new_public
+ *
+ * Creates a new public key given the raw 32 bytes
+ *
+ */
+
+int
+_libssh2_ed25519_new_public(libssh2_ed25519_ctx **ed_ctx,
+                            LIBSSH2_SESSION *session,
+                            const unsigned char *raw_pub_key,
+                            const size_t key_len)
+{
+    libssh2_ed25519_ctx *ctx;
+
+    if(key_len != LIBSSH2_ED25519_KEY_LEN)
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ed25519 public key length");
+
+    ctx = mbedtls_calloc(1, sizeof(libssh2_ed25519_ctx));
+    if(!ctx)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for ed25519 key");
+
+    memcpy(ctx->public_key, raw_pub_key, LIBSSH2_ED25519_KEY_LEN);
+
+    *ed_ctx = ctx;
+
+    return 0;
+}
+
+/* _libssh2_ed25519_sign
+ *
+ * Computes the ED25519 signature of a message
+ *
+ */
+
+int
+_libssh2_ed25519_sign(libssh2_ed25519_ctx *ctx, LIBSSH2_SESSION *session,
+                      uint8_t **out_sig, size_t *out_sig_len,
+                      const uint8_t *message, size_t message_len)
+{
+    unsigned char *sig;
+
+    if(!ctx->has_private)
+        return _libssh2_error(session, LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED,
+                              "No private key to sign with");
+
+    sig = LIBSSH2_ALLOC(session, LIBSSH2_ED25519_SIG_LEN);
+    if(!sig)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for signature");
+
+    if(ed25519_sign(sig, message, message_len,
+                    ctx->private_key, ctx->public_key)) {
+        LIBSSH2_FREE(session, sig);
+        return -1;
+    }
+
+    *out_sig = sig;
+    *out_sig_len = LIBSSH2_ED25519_SIG_LEN;
+
+    return 0;
+}
+
+/* _libssh2_ed25519_verify
+ *
+ * Verifies an ED25519 signature, returns 0 on success
+ *
+ */
+
+int
+_libssh2_ed25519_verify(libssh2_ed25519_ctx *ctx, const uint8_t *s,
+                        size_t s_len, const uint8_t *m, size_t m_len)
+{
+    if(s_len != LIBSSH2_ED25519_SIG_LEN)
+        return -1;
+
+    return ed25519_verify(s, m, m_len, ctx->public_key) ? -1 : 0;
+}
+
+void
+_libssh2_mbedtls_ed25519_free(libssh2_ed25519_ctx *ctx)
+{
+    if(!ctx)
+        return;
+
+    _libssh2_explicit_zero(ctx, sizeof(*ctx));
+    mbedtls_free(ctx);
+}
+#endif /* LIBSSH2_ED25519 */
+
+
 /* _libssh2_supported_key_sign_algorithms
  *
  * Return supported key hash algo upgrades, see crypto.h
@@ -62,6 +62,9 @@
 #include <mbedtls/rsa.h>
 #include <mbedtls/bignum.h>
 #include <mbedtls/cipher.h>
+#ifdef MBEDTLS_GCM_C
+# include <mbedtls/aes.h>
+#endif
 #ifdef MBEDTLS_ECDH_C
 # include <mbedtls/ecdh.h>
 #endif
@@ -86,7 +89,11 @@
 
 #define LIBSSH2_AES_CBC         1
 #define LIBSSH2_AES_CTR         1
-#define LIBSSH2_AES_GCM         0
+#ifdef MBEDTLS_GCM_C
+# define LIBSSH2_AES_GCM        1
+#else
+# define LIBSSH2_AES_GCM        0
+#endif
 #ifdef MBEDTLS_CIPHER_BLOWFISH_CBC
 # define LIBSSH2_BLOWFISH       1
 #else
@@ -109,7 +116,7 @@
 #else
 # define LIBSSH2_ECDSA          0
 #endif
-#define LIBSSH2_ED25519         0
+#define LIBSSH2_ED25519         1
 
 #include "crypto_config.h"
 
@@ -147,6 +154,17 @@
 
 #define libssh2_hmac_ctx    mbedtls_md_context_t
 
+/* HMAC with the key already absorbed, see _libssh2_hmac_key_init() */
+struct _libssh2_mbedtls_hmac_key
+{
+    mbedtls_md_context_t inner;     /* after hashing key ^ ipad */
+    mbedtls_md_context_t outer;     /* after hashing key ^ opad */
+    mbedtls_md_context_t work;      /* message state, cloned from these */
+    size_t digest_len;
+};
+
+#define libssh2_hmac_key    struct _libssh2_mbedtls_hmac_key
+
 
 /*******************************************************************/
 /*
@@ -345,6 +363,29 @@ typedef enum {
 #endif /* LIBSSH2_ECDSA */
 
 
+/*******************************************************************/
+/*
+ * mbedTLS backend: ED25519 functions
+ */
+
+#if LIBSSH2_ED25519
+
+/* mbedTLS has no EdDSA, the curve arithmetic is in ed25519.c */
+struct _libssh2_mbedtls_ed25519_ctx
+{
+    unsigned char public_key[32];
+    unsigned char private_key[32];  /* the seed, not the expanded key */
+    int has_private;
+};
+
+#define libssh2_ed25519_ctx struct _libssh2_mbedtls_ed25519_ctx
+
+#define _libssh2_ed25519_free(ctx) \
+    _libssh2_mbedtls_ed25519_free(ctx)
+
+#endif /* LIBSSH2_ED25519 */
+
+
 /*******************************************************************/
 /*
  * mbedTLS backend: Key functions
@@ -367,7 +408,22 @@ typedef enum {
  * mbedTLS backend: Cipher Context structure
  */
 
-#define _libssh2_cipher_ctx         mbedtls_cipher_context_t
+struct _libssh2_mbedtls_cipher_ctx
+{
+    mbedtls_cipher_context_t ctx;
+#if LIBSSH2_AES_GCM
+    /* aes*-gcm@openssh.com only, see _libssh2_mbedtls_cipher_crypt() */
+    mbedtls_aes_context aes;        /* same key, for keystream blocks */
+    unsigned char iv[12];           /* nonce of the current packet */
+    unsigned char carry[16];        /* input not handed to GCM yet */
+    unsigned char keystream[16];    /* keystream of the carried block */
+    size_t carry_len;
+    uint32_t blocks;                /* blocks handed to GCM for the packet */
+    int started;                    /* in the middle of a packet */
+#endif
+};
+
+#define _libssh2_cipher_ctx         struct _libssh2_mbedtls_cipher_ctx
 
 #define _libssh2_cipher_type(algo)  mbedtls_cipher_type_t algo
 
@@ -385,6 +441,10 @@ typedef enum {
 #endif
 #define _libssh2_cipher_3des      MBEDTLS_CIPHER_DES_EDE3_CBC
 #define _libssh2_cipher_chacha20  MBEDTLS_CIPHER_CHACHA20_POLY1305
+#if LIBSSH2_AES_GCM
+#define _libssh2_cipher_aes256gcm MBEDTLS_CIPHER_AES_256_GCM
+#define _libssh2_cipher_aes128gcm MBEDTLS_CIPHER_AES_128_GCM
+#endif
 
 
 /*******************************************************************/
@@ -498,6 +558,11 @@ void
 _libssh2_mbedtls_ecdsa_free(libssh2_ecdsa_ctx *ctx);
 #endif /* LIBSSH2_ECDSA */
 
+#if LIBSSH2_ED25519
+void
+_libssh2_mbedtls_ed25519_free(libssh2_ed25519_ctx *ctx);
+#endif /* LIBSSH2_ED25519 */
+
 extern void
 _libssh2_init_aes_ctr(void);
 extern void
@@ -48,6 +48,10 @@
 #include <errno.h>
 #include <assert.h>
 
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#endif
+
 #ifdef _WIN32
 /* Force parameter type. */
 #define libssh2_recv(s, b, l, f)  recv((s), (b), (int)(l), (f))
@@ -775,6 +779,30 @@ void *_libssh2_calloc(LIBSSH2_SESSION* session, size_t size)
     return p;
 }
 
+/* _libssh2_now_us
+ *
+ * Microseconds since some fixed point, from a clock that doesn't jump with
+ * the time of day. Cheap enough to read around every packet.
+ */
+libssh2_uint64_t _libssh2_now_us(void)
+{
+#if defined(ESP_PLATFORM)
+    return (libssh2_uint64_t)esp_timer_get_time();
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (libssh2_uint64_t)ts.tv_sec * 1000000 +
+        (libssh2_uint64_t)ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (libssh2_uint64_t)tv.tv_sec * 1000000 +
+        (libssh2_uint64_t)tv.tv_usec;
+#endif
+}
+
 /* XOR operation on buffers input1 and input2, result in output.
    It is safe to use an input buffer as the output buffer. */
 void _libssh2_xor_data(unsigned char *output,
@@ -119,6 +119,9 @@ int _libssh2_store_bignum2_bytes(unsigned char **buf,
                                  size_t len);
 void *_libssh2_calloc(LIBSSH2_SESSION *session, size_t size);
 
+/* microseconds on a monotonic clock, for the session counters */
+libssh2_uint64_t _libssh2_now_us(void);
+
 struct string_buf *_libssh2_string_buf_new(LIBSSH2_SESSION *session);
 void _libssh2_string_buf_free(LIBSSH2_SESSION *session,
                               struct string_buf *buf);
@@ -57,6 +57,21 @@
 #include "channel.h"
 #include "packet.h"
 
+/*
+ * packet_open_channel_free
+ *
+ * Free a channel the peer opened when its confirmation could not be sent.
+ * It is not linked into the session yet, but holds part of the window
+ * budget.
+ */
+static void
+packet_open_channel_free(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    _libssh2_channel_window_free(channel);
+    LIBSSH2_FREE(session, channel->channel_type);
+    LIBSSH2_FREE(session, channel);
+}
+
 /*
  * libssh2_packet_queue_listener
  *
@@ -140,8 +155,8 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                 (memcmp(listn->host, listen_state->host,
                         listen_state->host_len) == 0)) {
                 /* This is our listener */
+                /* listen_state->channel is kept across EAGAIN */
                 LIBSSH2_CHANNEL *channel = NULL;
-                listen_state->channel = NULL;
 
                 if(listen_state->state == libssh2_NB_state_allocated) {
                     if(listn->queue_maxsize &&
@@ -184,12 +199,11 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                            channel->channel_type_len + 1);
 
                     channel->remote.id = listen_state->sender_channel;
-                    channel->remote.window_size_initial =
-                        LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-                    channel->remote.window_size =
-                        LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-                    channel->remote.packet_size =
-                        LIBSSH2_CHANNEL_PACKET_DEFAULT;
+                    channel->remote.packet_size = (uint32_t)
+                        LIBSSH2_MIN(LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                                    _libssh2_transport_max_payload(session));
+                    _libssh2_channel_window_init(channel,
+                                           LIBSSH2_CHANNEL_WINDOW_DEFAULT);
 
                     channel->local.id = _libssh2_channel_nextid(session);
                     channel->local.window_size_initial =
@@ -225,6 +239,11 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                         return rc;
                     else if(rc) {
                         listen_state->state = libssh2_NB_state_idle;
+                        if(listen_state->channel) {
+                            packet_open_channel_free(session,
+                                                     listen_state->channel);
+                            listen_state->channel = NULL;
+                        }
                         return _libssh2_error(session, rc,
                                               "Unable to send channel "
                                               "open confirmation");
@@ -234,6 +253,8 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                     if(listen_state->channel) {
                         _libssh2_list_add(&listn->queue,
                                           &listen_state->channel->node);
+                        _libssh2_channel_index_add(session,
+                                                   listen_state->channel);
                         listn->queue_size++;
                     }
 
@@ -349,6 +370,8 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
     if(session->x11) {
         if(x11open_state->state == libssh2_NB_state_allocated) {
             channel = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_CHANNEL));
+            x11open_state->channel = channel;
+
             if(!channel) {
                 _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                "allocate a channel for new connection");
@@ -372,10 +395,11 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
                    channel->channel_type_len + 1);
 
             channel->remote.id = x11open_state->sender_channel;
-            channel->remote.window_size_initial =
-                LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-            channel->remote.window_size = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-            channel->remote.packet_size = LIBSSH2_CHANNEL_PACKET_DEFAULT;
+            channel->remote.packet_size = (uint32_t)
+                LIBSSH2_MIN(LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                            _libssh2_transport_max_payload(session));
+            _libssh2_channel_window_init(channel,
+                                         LIBSSH2_CHANNEL_WINDOW_DEFAULT);
 
             channel->local.id = _libssh2_channel_nextid(session);
             channel->local.window_size_initial =
@@ -409,6 +433,8 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
             }
             else if(rc) {
                 x11open_state->state = libssh2_NB_state_idle;
+                packet_open_channel_free(session, channel);
+                x11open_state->channel = NULL;
                 return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                       "Unable to send channel open "
                                       "confirmation");
@@ -416,6 +442,7 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
 
             /* Link the channel into the session */
             _libssh2_list_add(&session->channels, &channel->node);
+            _libssh2_channel_index_add(session, channel);
 
             /*
              * Pass control to the callback, they may turn right around and
@@ -532,10 +559,11 @@ packet_authagent_open(LIBSSH2_SESSION * session,
                    channel->channel_type_len + 1);
 
             channel->remote.id = authagent_state->sender_channel;
-            channel->remote.window_size_initial =
-                LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-            channel->remote.window_size = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
-            channel->remote.packet_size = LIBSSH2_CHANNEL_PACKET_DEFAULT;
+            channel->remote.packet_size = (uint32_t)
+                LIBSSH2_MIN(LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                            _libssh2_transport_max_payload(session));
+            _libssh2_channel_window_init(channel,
+                                         LIBSSH2_CHANNEL_WINDOW_DEFAULT);
 
             channel->local.id = _libssh2_channel_nextid(session);
             channel->local.window_size_initial =
@@ -570,6 +598,8 @@ packet_authagent_open(LIBSSH2_SESSION * session,
             }
             else if(rc) {
                 authagent_state->state = libssh2_NB_state_idle;
+                packet_open_channel_free(session, channel);
+                authagent_state->channel = NULL;
                 return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                       "Unable to send channel open "
                                       "confirmation");
@@ -577,6 +607,7 @@ packet_authagent_open(LIBSSH2_SESSION * session,
 
             /* Link the channel into the session */
             _libssh2_list_add(&session->channels, &channel->node);
+            _libssh2_channel_index_add(session, channel);
 
             /* mess with stuff so we don't keep reading the same packet
                over and over */
@@ -617,20 +648,280 @@ authagent_exit:
     return 0;
 }
 
+/*
+ * Packet pool
+ *
+ * Every incoming packet needs a payload buffer and a LIBSSH2_PACKET node,
+ * which are freed again as soon as the data has been consumed. To not hit
+ * the heap for each packet of a transfer, idle buffers are kept in a few
+ * size classes and nodes in a list of their own, up to the session's limits.
+ *
+ * Pooled buffers are ordinary LIBSSH2_ALLOC() areas of their class size, so
+ * code that ends up owning one may still LIBSSH2_FREE() it.
+ */
+
+/* sizes of the smaller classes, the biggest follows the transport buffers */
+static const size_t packet_pool_class[LIBSSH2_PACKET_POOL_CLASSES - 1] = {
+    512, 2048, 8192
+};
+
+/*
+ * _libssh2_packet_pool_init
+ *
+ * Set up an empty pool with the default limits.
+ */
+void
+_libssh2_packet_pool_init(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    int i;
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES; i++)
+        _libssh2_list_init(&pool->bufs[i]);
+    _libssh2_list_init(&pool->nodes);
+    _libssh2_packet_pool_resize(session);
+}
+
+/*
+ * _libssh2_packet_pool_resize
+ *
+ * Size the classes of the pool after the session's transport buffers, which
+ * bound the packets the peer sends on our channels, so that a bulk data
+ * packet isn't rounded up to some bigger fixed size. The pool is emptied
+ * first.
+ *
+ * Unless the application set its own, the limits follow as well: a channel
+ * with the default window, or the whole window budget if that is smaller,
+ * can have that many bytes of data packets waiting to be read, and the pool
+ * keeps as many buffers as they take so that a bulk transfer stops
+ * allocating once its window is full.
+ */
+void
+_libssh2_packet_pool_resize(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    size_t top = session->packet_buf_size;
+    size_t window;
+    size_t packet;
+    int i;
+
+    _libssh2_packet_pool_free(session);
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES - 1; i++)
+        pool->class_size[i] = LIBSSH2_MIN(packet_pool_class[i], top);
+    pool->class_size[i] = top;
+
+    if(pool->user_limits)
+        return;
+
+    window = LIBSSH2_MIN(LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                         session->window_budget);
+    packet = LIBSSH2_MIN(LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                         _libssh2_transport_max_payload(session));
+
+    /* an eighth more for peers that fill their packets less than they
+       may, and one for the packet the transport layer is reading */
+    pool->max_idle = window / packet + window / packet / 8 + 1;
+    pool->max_bytes = pool->max_idle * top;
+}
+
+/*
+ * _libssh2_packet_pool_trim
+ *
+ * Free the idle buffers and nodes the pool holds beyond its limits.
+ */
+void
+_libssh2_packet_pool_trim(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    struct list_node *node;
+    int i;
+
+    /* drop the biggest buffers first */
+    for(i = LIBSSH2_PACKET_POOL_CLASSES - 1; i >= 0; i--) {
+        while((pool->buf_count[i] > pool->max_idle ||
+               pool->buf_bytes > pool->max_bytes) &&
+              (node = _libssh2_list_first(&pool->bufs[i])) != NULL) {
+            _libssh2_list_remove(node);
+            pool->buf_count[i]--;
+            pool->buf_bytes -= pool->class_size[i];
+            LIBSSH2_FREE(session, node);
+        }
+    }
+
+    while(pool->node_count > pool->max_idle * LIBSSH2_PACKET_POOL_CLASSES &&
+          (node = _libssh2_list_first(&pool->nodes)) != NULL) {
+        _libssh2_list_remove(node);
+        pool->node_count--;
+        LIBSSH2_FREE(session, node);
+    }
+}
+
+/*
+ * _libssh2_packet_pool_free
+ *
+ * Free everything the pool holds, at session teardown.
+ */
+void
+_libssh2_packet_pool_free(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    size_t max_idle = pool->max_idle;
+    size_t max_bytes = pool->max_bytes;
+
+    pool->max_idle = 0;
+    pool->max_bytes = 0;
+    _libssh2_packet_pool_trim(session);
+    pool->max_idle = max_idle;
+    pool->max_bytes = max_bytes;
+}
+
+/*
+ * _libssh2_packet_buf_alloc
+ *
+ * Get a buffer of at least 'len' bytes for an incoming packet. '*size' is
+ * set to the allocated size to hand back to _libssh2_packet_buf_free(), or
+ * to 0 if the buffer is too big for the pool.
+ */
+unsigned char *
+_libssh2_packet_buf_alloc(LIBSSH2_SESSION * session, size_t len,
+                          size_t *size)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    struct list_node *node;
+    int i;
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES; i++) {
+        if(len <= pool->class_size[i])
+            break;
+    }
+    if(i == LIBSSH2_PACKET_POOL_CLASSES) {
+        *size = 0;
+        return LIBSSH2_ALLOC(session, len);
+    }
+
+    *size = pool->class_size[i];
+
+    node = _libssh2_list_first(&pool->bufs[i]);
+    if(node) {
+        _libssh2_list_remove(node);
+        pool->buf_count[i]--;
+        pool->buf_bytes -= *size;
+        pool->hits++;
+        return (unsigned char *)node;
+    }
+
+    pool->misses++;
+    return LIBSSH2_ALLOC(session, *size);
+}
+
+/*
+ * _libssh2_packet_buf_free
+ *
+ * Return a buffer from _libssh2_packet_buf_alloc() of allocated size 'size'
+ * to the pool, or free it if the pool is full or 'size' is 0.
+ */
+void
+_libssh2_packet_buf_free(LIBSSH2_SESSION * session, unsigned char *buf,
+                         size_t size)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    int i;
+
+    if(!buf)
+        return;
+
+    for(i = 0; i < LIBSSH2_PACKET_POOL_CLASSES; i++) {
+        if(size == pool->class_size[i])
+            break;
+    }
+
+    if(i == LIBSSH2_PACKET_POOL_CLASSES ||
+       pool->buf_count[i] >= pool->max_idle ||
+       pool->buf_bytes + size > pool->max_bytes) {
+        LIBSSH2_FREE(session, buf);
+        return;
+    }
+
+    /* the idle buffer doubles as its own list node */
+    _libssh2_list_add(&pool->bufs[i], (struct list_node *)(void *)buf);
+    pool->buf_count[i]++;
+    pool->buf_bytes += size;
+}
+
+/*
+ * _libssh2_packet_node_alloc
+ *
+ * Get a LIBSSH2_PACKET struct for the packet brigade.
+ */
+LIBSSH2_PACKET *
+_libssh2_packet_node_alloc(LIBSSH2_SESSION * session)
+{
+    struct packet_pool *pool = &session->packet_pool;
+    LIBSSH2_PACKET *packet = _libssh2_list_first(&pool->nodes);
+
+    if(packet) {
+        _libssh2_list_remove(&packet->node);
+        pool->node_count--;
+        pool->hits++;
+        return packet;
+    }
+
+    pool->misses++;
+    return LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+}
+
+/*
+ * _libssh2_packet_node_free
+ *
+ * Return a LIBSSH2_PACKET struct, already unlinked from any list, to the
+ * pool.
+ */
+void
+_libssh2_packet_node_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet)
+{
+    struct packet_pool *pool = &session->packet_pool;
+
+    if(pool->node_count >= pool->max_idle * LIBSSH2_PACKET_POOL_CLASSES) {
+        LIBSSH2_FREE(session, packet);
+        return;
+    }
+
+    _libssh2_list_add(&pool->nodes, &packet->node);
+    pool->node_count++;
+}
+
+/*
+ * _libssh2_packet_free
+ *
+ * Unlink a packet from the brigade and return both its data and the node to
+ * the pool.
+ */
+void
+_libssh2_packet_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet)
+{
+    _libssh2_list_remove(&packet->node);
+    _libssh2_packet_buf_free(session, packet->data, packet->data_size);
+    _libssh2_packet_node_free(session, packet);
+}
+
 /*
  * _libssh2_packet_add
  *
- * Create a new packet and attach it to the brigade. Called from the transport
- * layer when it has received a packet.
+ * Create a new packet and attach it to the brigade, or for channel data to
+ * the queues of its channel. Called from the transport layer when it has
+ * received a packet.
  *
  * The input pointer 'data' is pointing to allocated data that this function
- * will be freed unless return the code is LIBSSH2_ERROR_EAGAIN.
+ * will be freed unless return the code is LIBSSH2_ERROR_EAGAIN. 'data_size'
+ * is its size if it came from the packet pool, 0 if not.
  *
  * This function will always be called with 'datalen' greater than zero.
  */
 int
 _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                    size_t datalen, int macstate, uint32_t seq)
+                    size_t datalen, size_t data_size, int macstate,
+                    uint32_t seq)
 {
     int rc = 0;
     unsigned char *message = NULL;
@@ -653,7 +944,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             /* Bad MAC input, but no callback set or non-zero return from the
                callback */
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             return _libssh2_error(session, LIBSSH2_ERROR_INVALID_MAC,
                                   "Invalid MAC received");
         }
@@ -679,7 +970,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
         if(msg == SSH_MSG_KEXINIT) {
             if(!session->kex_strict) {
                 if(datalen < 17) {
-                    LIBSSH2_FREE(session, data);
+                    _libssh2_packet_buf_free(session, data, data_size);
                     session->packAdd_state = libssh2_NB_state_idle;
                     return _libssh2_error(session,
                                           LIBSSH2_ERROR_BUFFER_TOO_SMALL,
@@ -698,7 +989,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                     buf.dataptr += 17; /* advance past type and cookie */
 
                     if(_libssh2_get_string(&buf, &algs, &algs_len)) {
-                        LIBSSH2_FREE(session, data);
+                        _libssh2_packet_buf_free(session, data, data_size);
                         session->packAdd_state = libssh2_NB_state_idle;
                         return _libssh2_error(session,
                                               LIBSSH2_ERROR_BUFFER_TOO_SMALL,
@@ -713,7 +1004,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             }
 
             if(session->kex_strict && seq) {
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, data_size);
                 session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
                 session->packAdd_state = libssh2_NB_state_idle;
                 libssh2_session_disconnect(session, "strict KEX violation: "
@@ -727,7 +1018,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
         if(session->kex_strict && session->fullpacket_required_type &&
             session->fullpacket_required_type != msg) {
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
             session->packAdd_state = libssh2_NB_state_idle;
             libssh2_session_disconnect(session, "strict KEX violation: "
@@ -774,7 +1065,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                message, language));
             }
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
             session->packAdd_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
@@ -793,7 +1084,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             else if(session->ssh_msg_ignore) {
                 LIBSSH2_IGNORE(session, "", 0);
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -833,7 +1124,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
              */
             _libssh2_debug((session, LIBSSH2_TRACE_TRANS,
                            "Debug Packet: %s", message));
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -903,7 +1194,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                 }
             }
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -938,7 +1229,7 @@ libssh2_packet_add_jump_point5:
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -973,7 +1264,7 @@ libssh2_packet_add_jump_point5:
             if(!channelp) {
                 _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_UNKNOWN,
                                "Packet received for unknown channel");
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, data_size);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -995,7 +1286,7 @@ libssh2_packet_add_jump_point5:
                  LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE) &&
                 (msg == SSH_MSG_CHANNEL_EXTENDED_DATA)) {
                 /* Pretend we didn't receive this */
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, data_size);
 
                 _libssh2_debug((session, LIBSSH2_TRACE_CONN,
                               "Ignoring extended data and refunding %ld bytes",
@@ -1052,7 +1343,7 @@ libssh2_packet_add_jump_point1:
                 _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_WINDOW_EXCEEDED,
                                "The current receive window is full,"
                                " data ignored");
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, data_size);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -1072,6 +1363,7 @@ libssh2_packet_add_jump_point1:
              * updated once the data is actually read from the queue
              * from an upper layer */
             channelp->read_avail += datalen - data_head;
+            _libssh2_channel_window_sample(channelp);
 
             _libssh2_debug((session, LIBSSH2_TRACE_CONN,
                            "increasing read_avail by %ld bytes to %ld/%u",
@@ -1102,7 +1394,7 @@ libssh2_packet_add_jump_point1:
                                channelp->remote.id));
                 channelp->remote.eof = 1;
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -1204,7 +1496,7 @@ libssh2_packet_add_jump_point4:
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -1220,7 +1512,7 @@ libssh2_packet_add_jump_point4:
                                             _libssh2_ntohu32(data + 1));
             if(!channelp) {
                 /* We may have freed already, just quietly ignore this... */
-                LIBSSH2_FREE(session, data);
+                _libssh2_packet_buf_free(session, data, data_size);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -1232,7 +1524,7 @@ libssh2_packet_add_jump_point4:
             channelp->remote.close = 1;
             channelp->remote.eof = 1;
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -1294,7 +1586,7 @@ libssh2_packet_add_jump_authagent:
             if(rc == LIBSSH2_ERROR_EAGAIN)
                 return rc;
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -1323,7 +1615,7 @@ libssh2_packet_add_jump_authagent:
                                    channelp->local.window_size));
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
         default:
@@ -1334,20 +1626,30 @@ libssh2_packet_add_jump_authagent:
     }
 
     if(session->packAdd_state == libssh2_NB_state_sent) {
-        LIBSSH2_PACKET *packetp =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+        LIBSSH2_PACKET *packetp = _libssh2_packet_node_alloc(session);
         if(!packetp) {
             _libssh2_debug((session, LIBSSH2_ERROR_ALLOC,
                            "memory for packet"));
-            LIBSSH2_FREE(session, data);
+            _libssh2_packet_buf_free(session, data, data_size);
             session->packAdd_state = libssh2_NB_state_idle;
             return LIBSSH2_ERROR_ALLOC;
         }
         packetp->data = data;
         packetp->data_len = datalen;
         packetp->data_head = data_head;
+        packetp->data_size = data_size;
 
-        _libssh2_list_add(&session->packets, &packetp->node);
+        if(msg == SSH_MSG_CHANNEL_DATA) {
+            /* channel data is queued on its channel, not the session */
+            packetp->seq = channelp->data_seq++;
+            _libssh2_list_add(&channelp->data_packets, &packetp->node);
+        }
+        else if(msg == SSH_MSG_CHANNEL_EXTENDED_DATA) {
+            packetp->seq = channelp->data_seq++;
+            _libssh2_list_add(&channelp->ext_packets, &packetp->node);
+        }
+        else
+            _libssh2_list_add(&session->packets, &packetp->node);
 
         session->packAdd_state = libssh2_NB_state_sent1;
     }
@@ -1423,7 +1725,8 @@ _libssh2_packet_ask(LIBSSH2_SESSION * session, unsigned char packet_type,
             /* unlink struct from session->packets */
             _libssh2_list_remove(&packet->node);
 
-            LIBSSH2_FREE(session, packet);
+            /* the caller owns the data now and frees it as usual */
+            _libssh2_packet_node_free(session, packet);
 
             return 0;
         }
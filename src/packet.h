@@ -72,6 +72,20 @@ int _libssh2_packet_burn(LIBSSH2_SESSION * session,
 int _libssh2_packet_write(LIBSSH2_SESSION * session, unsigned char *data,
                           unsigned long data_len);
 int _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                        size_t datalen, int macstate, uint32_t seq);
+                        size_t datalen, size_t data_size, int macstate,
+                        uint32_t seq);
+
+void _libssh2_packet_pool_init(LIBSSH2_SESSION * session);
+void _libssh2_packet_pool_trim(LIBSSH2_SESSION * session);
+void _libssh2_packet_pool_resize(LIBSSH2_SESSION * session);
+void _libssh2_packet_pool_free(LIBSSH2_SESSION * session);
+unsigned char *_libssh2_packet_buf_alloc(LIBSSH2_SESSION * session,
+                                         size_t len, size_t *size);
+void _libssh2_packet_buf_free(LIBSSH2_SESSION * session, unsigned char *buf,
+                              size_t size);
+LIBSSH2_PACKET *_libssh2_packet_node_alloc(LIBSSH2_SESSION * session);
+void _libssh2_packet_node_free(LIBSSH2_SESSION * session,
+                               LIBSSH2_PACKET *packet);
+void _libssh2_packet_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet);
 
 #endif /* LIBSSH2_PACKET_H */
@@ -13,6 +13,21 @@
 
 #define POLY1305_KEYLEN 32
 #define POLY1305_TAGLEN 16
+#define POLY1305_BLOCKLEN 16
+
+/* incremental state, the message may be passed in pieces of any size */
+struct poly1305_ctx {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    size_t leftover;
+    u_char buffer[POLY1305_BLOCKLEN];
+    u_char final;
+};
+
+void poly1305_init(struct poly1305_ctx *st, const u_char key[POLY1305_KEYLEN]);
+void poly1305_update(struct poly1305_ctx *st, const u_char *m, size_t bytes);
+void poly1305_finish(struct poly1305_ctx *st, u_char mac[POLY1305_TAGLEN]);
 
 void poly1305_auth(u_char out[POLY1305_TAGLEN], const u_char *m, size_t inlen,
                    const u_char key[POLY1305_KEYLEN]);
@@ -143,6 +143,7 @@ banner_receive(LIBSSH2_SESSION * session)
                 session->socket_block_directions =
                     LIBSSH2_SESSION_BLOCK_INBOUND;
                 session->banner_TxRx_total_send = banner_len;
+                session->stats.eagain_recv++;
                 return LIBSSH2_ERROR_EAGAIN;
             }
 
@@ -156,6 +157,7 @@ banner_receive(LIBSSH2_SESSION * session)
             session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
             return LIBSSH2_ERROR_SOCKET_DISCONNECT;
         }
+        session->stats.bytes_recv++;
 
         if((c == '\r' || c == '\n') && banner_len == 0) {
             continue;
@@ -268,8 +270,12 @@ banner_send(LIBSSH2_SESSION * session)
             /* the whole packet could not be sent, save the what was */
             session->socket_block_directions =
                 LIBSSH2_SESSION_BLOCK_OUTBOUND;
-            if(ret > 0)
+            if(ret > 0) {
                 session->banner_TxRx_total_send += ret;
+                session->stats.bytes_sent += ret;
+            }
+            else
+                session->stats.eagain_send++;
             return LIBSSH2_ERROR_EAGAIN;
         }
         session->banner_TxRx_state = libssh2_NB_state_idle;
@@ -277,6 +283,8 @@ banner_send(LIBSSH2_SESSION * session)
         return LIBSSH2_ERROR_SOCKET_RECV;
     }
 
+    session->stats.bytes_sent += ret;
+
     /* Set the state back to idle */
     session->banner_TxRx_state = libssh2_NB_state_idle;
     session->banner_TxRx_total_send = 0;
@@ -473,6 +481,9 @@ libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
         session->state = LIBSSH2_STATE_INITIAL_KEX;
         session->fullpacket_required_type = 0;
         session->packet_read_timeout = LIBSSH2_DEFAULT_READ_TIMEOUT;
+        session->packet_buf_size = MAX_SSH_PACKET_LEN;
+        session->window_budget = LIBSSH2_WINDOW_BUDGET;
+        _libssh2_packet_pool_init(session);
         session->flag.quote_paths = 1; /* default behavior is to quote paths
                                           for the scp subsystem */
         session->kex = NULL;
@@ -607,6 +618,7 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
     int has_timeout;
     long ms_to_next = 0;
     long elapsed_ms;
+    libssh2_uint64_t start;
 
     /* since libssh2 often sets EAGAIN internally before this function is
        called, we can decrease some amount of confusion in user programs by
@@ -650,6 +662,8 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
     else
         has_timeout = 0;
 
+    start = _libssh2_now_us();
+
 #ifdef HAVE_POLL
     {
         struct pollfd sockets[1];
@@ -711,6 +725,7 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
                     has_timeout ? &tv : NULL);
     }
 #endif
+    session->stats.wait_time += _libssh2_now_us() - start;
     if(rc == 0) {
         return _libssh2_error(session, LIBSSH2_ERROR_TIMEOUT,
                               "Timed out waiting on socket");
@@ -756,6 +771,12 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
         }
         session->socket_fd = sock;
 
+        rc = _libssh2_transport_init(session);
+        if(rc) {
+            return _libssh2_error(session, rc,
+                                  "Unable to allocate transport buffers");
+        }
+
         session->socket_prev_blockstate =
             !get_socket_nonblocking(session->socket_fd);
 
@@ -784,6 +805,20 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
         session->banner_TxRx_state = libssh2_NB_state_idle;
     }
 
+    if(session->startup_state == libssh2_NB_state_sent &&
+       session->flag.kex_guess && !session->remote.banner &&
+       session->startup_key_state.state != libssh2_NB_state_sent1) {
+        /* Send our KEXINIT and the guessed key exchange init packet right
+           behind our banner, so that the server can answer them as soon
+           as it has read them */
+        rc = _libssh2_kex_exchange(session, 0, &session->startup_key_state);
+        if(rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        else if(rc)
+            return _libssh2_error(session, rc,
+                                  "Unable to exchange encryption keys");
+    }
+
     if(session->startup_state == libssh2_NB_state_sent) {
         do {
             rc = banner_receive(session);
@@ -962,6 +997,11 @@ session_free(LIBSSH2_SESSION *session)
         session->kex->cleanup(session,
                               &session->startup_key_state.key_state_low);
     }
+    else if(session->kex_guess && session->kex_guess->cleanup) {
+        /* freed before the server confirmed a guessed key exchange */
+        session->kex_guess->cleanup(session,
+                                    &session->startup_key_state.key_state_low);
+    }
 
     if(session->state & LIBSSH2_STATE_NEWKEYS) {
         /* hostkey */
@@ -1139,6 +1179,8 @@ session_free(LIBSSH2_SESSION *session)
         LIBSSH2_FREE(session, session->packet.payload);
     }
 
+    _libssh2_transport_free(session);
+
     /* Cleanup all remaining packets */
     /* !checksrc! disable EQUALSNULL 1 */
     while((pkg = _libssh2_list_first(&session->packets)) != NULL) {
@@ -1156,6 +1198,11 @@ session_free(LIBSSH2_SESSION *session)
     _libssh2_debug((session, LIBSSH2_TRACE_TRANS,
                    "Extra packets left %d", packets_left));
 
+    _libssh2_channel_index_free(session);
+    _libssh2_packet_pool_free(session);
+
+    _libssh2_kex_pregen_free(session);
+
     if(session->socket_prev_blockstate) {
         /* if the socket was previously blocking, put it back so */
         rc = session_nonblock(session->socket_fd, 0);
@@ -1313,6 +1360,14 @@ libssh2_session_methods(LIBSSH2_SESSION * session, int method_type)
         method = (const LIBSSH2_KEX_METHOD *) session->remote.comp;
         break;
 
+    case LIBSSH2_METHOD_KEX_SERVER:
+        method = session->kex_server_pref;
+        break;
+
+    case LIBSSH2_METHOD_HOSTKEY_SERVER:
+        method = (const LIBSSH2_KEX_METHOD *) session->hostkey_server_pref;
+        break;
+
     case LIBSSH2_METHOD_LANG_CS:
         return "";
 
@@ -1444,6 +1499,9 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     case LIBSSH2_FLAG_QUOTE_PATHS:
         session->flag.quote_paths = value;
         break;
+    case LIBSSH2_FLAG_KEX_GUESS:
+        session->flag.kex_guess = value;
+        break;
     default:
         /* unknown flag */
         return LIBSSH2_ERROR_INVAL;
@@ -1536,6 +1594,114 @@ libssh2_session_get_read_timeout(LIBSSH2_SESSION * session)
     return session->packet_read_timeout;
 }
 
+/* libssh2_session_set_max_packet_size
+ *
+ * Set the size of a session's transport buffers, which is also the largest
+ * packet the peer is asked to send on our channels. Must be called before
+ * the handshake. 0 restores the default of 35000 bytes.
+ */
+LIBSSH2_API int
+libssh2_session_set_max_packet_size(LIBSSH2_SESSION * session, size_t size)
+{
+    if(session->packet.buf || session->packet.outbuf)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Transport buffers are already allocated");
+
+    if(!size || size > MAX_SSH_PACKET_LEN)
+        size = MAX_SSH_PACKET_LEN;
+    else if(size < MIN_SSH_PACKET_LEN)
+        size = MIN_SSH_PACKET_LEN;
+
+    session->packet_buf_size = size;
+    _libssh2_packet_pool_resize(session);
+    return 0;
+}
+
+/* libssh2_session_get_max_packet_size
+ *
+ * Returns the size of a session's transport buffers. Default is 35000 bytes.
+ */
+LIBSSH2_API size_t
+libssh2_session_get_max_packet_size(LIBSSH2_SESSION * session)
+{
+    return session->packet_buf_size;
+}
+
+/* libssh2_session_set_packet_pool
+ *
+ * Set how many idle buffers of each size class, and how many bytes of them
+ * in total, a session keeps for reuse by incoming packets. 0 for either
+ * turns the pooling off.
+ */
+LIBSSH2_API int
+libssh2_session_set_packet_pool(LIBSSH2_SESSION * session, size_t max_idle,
+                                size_t max_bytes)
+{
+    session->packet_pool.max_idle = max_idle;
+    session->packet_pool.max_bytes = max_bytes;
+    session->packet_pool.user_limits = 1;
+    _libssh2_packet_pool_trim(session);
+    return 0;
+}
+
+/* libssh2_session_set_window_budget
+ *
+ * Set how many bytes of receive window all the channels of a session may
+ * hold between them. Channels opened from then on start with at most half
+ * of what is left of it, and grow their windows into the rest as their
+ * throughput needs. 0 restores the default.
+ */
+LIBSSH2_API int
+libssh2_session_set_window_budget(LIBSSH2_SESSION * session, size_t bytes)
+{
+    session->window_budget = bytes ? bytes : LIBSSH2_WINDOW_BUDGET;
+    /* the default pool limits follow the budget */
+    _libssh2_packet_pool_resize(session);
+    return 0;
+}
+
+/* libssh2_session_get_packet_pool_stats
+ *
+ * Get how many packet buffer and node allocations of a session were served
+ * from its pool ('hits') and from the heap ('misses'). Either pointer may be
+ * NULL.
+ */
+LIBSSH2_API void
+libssh2_session_get_packet_pool_stats(LIBSSH2_SESSION * session,
+                                      libssh2_uint64_t *hits,
+                                      libssh2_uint64_t *misses)
+{
+    if(hits)
+        *hits = session->packet_pool.hits;
+    if(misses)
+        *misses = session->packet_pool.misses;
+}
+
+/* libssh2_session_get_stats
+ *
+ * Copy the performance counters of a session to 'stats'. Comparing the time
+ * spent in crypt_time, mac_time and comp_time, in wait_time and in
+ * window_stall_time over a transfer tells if it is held back by the CPU,
+ * the network or the peer's channel window.
+ */
+LIBSSH2_API void
+libssh2_session_get_stats(LIBSSH2_SESSION * session,
+                          LIBSSH2_SESSION_STATS *stats)
+{
+    if(stats)
+        *stats = session->stats;
+}
+
+/* libssh2_session_reset_stats
+ *
+ * Set all the performance counters of a session back to zero.
+ */
+LIBSSH2_API void
+libssh2_session_reset_stats(LIBSSH2_SESSION * session)
+{
+    memset(&session->stats, 0, sizeof(session->stats));
+}
+
 /*
  * libssh2_poll_channel_read
  *
@@ -1545,35 +1711,13 @@ libssh2_session_get_read_timeout(LIBSSH2_SESSION * session)
 LIBSSH2_API int
 libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while(packet) {
-        if(packet->data_len < 5) {
-            return _libssh2_error(session, LIBSSH2_ERROR_BUFFER_TOO_SMALL,
-                                  "Packet too small");
-        }
-
-        if(channel->local.id == _libssh2_ntohu32(packet->data + 1)) {
-            if(extended == 1 &&
-                (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA
-                 || packet->data[0] == SSH_MSG_CHANNEL_DATA)) {
-                return 1;
-            }
-            else if(extended == 0 &&
-                    packet->data[0] == SSH_MSG_CHANNEL_DATA) {
-                return 1;
-            }
-            /* else - no data of any type is ready to be read */
-        }
-        packet = _libssh2_list_next(&packet->node);
-    }
+    /* extended asks for data of any type */
+    if(_libssh2_list_first(&channel->data_packets) ||
+       (extended == 1 && _libssh2_list_first(&channel->ext_packets)))
+        return 1;
 
     return 0;
 }
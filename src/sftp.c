@@ -45,6 +45,7 @@
 #include "channel.h"
 #include "session.h"
 #include "sftp.h"
+#include "transport.h"
 
 #include <assert.h>
 #include <stdlib.h>  /* strtol() */
@@ -1580,9 +1581,12 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
         sftp->read_state = libssh2_NB_state_idle;
 
         /* move through the READ packets that haven't been sent and send as
-           many as possible - remember that we don't block */
+           many as possible - remember that we don't block. They are corked
+           to go out together in as few send() calls as possible. */
         chunk = _libssh2_list_first(&handle->packet_list);
 
+        _libssh2_transport_cork(session);
+
         while(chunk) {
             if(chunk->lefttosend) {
 
@@ -1590,6 +1594,7 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                                             &chunk->packet[chunk->sent],
                                             chunk->lefttosend);
                 if(rc < 0) {
+                    _libssh2_transport_uncork(session);
                     sftp->read_state = libssh2_NB_state_sent;
                     return rc;
                 }
@@ -1614,6 +1619,13 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             /* move on to the next chunk with data to send */
             chunk = _libssh2_list_next(&chunk->node);
         }
+
+        /* the requests are queued, whatever isn't sent now goes out with
+           the reads below */
+        rc = _libssh2_transport_uncork(session);
+        if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc,
+                                  "Unable to send FXP_READ requests");
         LIBSSH2_FALLTHROUGH();
 
     case libssh2_NB_state_sent2:
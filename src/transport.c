@@ -118,8 +118,89 @@ debugdump(LIBSSH2_SESSION * session,
 #endif
 
 
-/* decrypt() decrypts 'len' bytes from 'source' to 'dest' in units of
- * blocksize.
+/* grow_buf() makes sure a transport buffer holds at least 'needed' bytes,
+ * keeping its contents.
+ *
+ * returns 0 on success and negative on failure
+ */
+static int
+grow_buf(LIBSSH2_SESSION * session, unsigned char **buf, size_t *size,
+         size_t needed)
+{
+    unsigned char *newbuf;
+
+    if(needed <= *size)
+        return LIBSSH2_ERROR_NONE;
+
+    newbuf = LIBSSH2_REALLOC(session, *buf, needed);
+    if(!newbuf)
+        return LIBSSH2_ERROR_ALLOC;
+
+    _libssh2_debug((session, LIBSSH2_TRACE_TRANS,
+                   "Transport buffer grown from %lu to %lu bytes",
+                   (unsigned long)*size, (unsigned long)needed));
+    *buf = newbuf;
+    *size = needed;
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * flush_queue() sends as much as possible of the packets queued in outbuf.
+ * They are laid out back to back so a single send() call takes them all.
+ *
+ * Returns LIBSSH2_ERROR_NONE once the queue is empty, LIBSSH2_ERROR_EAGAIN if
+ * some of it is left or LIBSSH2_ERROR_SOCKET_SEND.
+ */
+static int
+flush_queue(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    ssize_t length = p->ototal_num - p->osent;
+    ssize_t rc;
+
+    if(length) {
+        rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
+                          LIBSSH2_SOCKET_SEND_FLAGS(session));
+        if(rc < 0) {
+            _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
+                           "Error sending %ld bytes: %ld",
+                           (long)length, (long)-rc));
+            if(rc != -EAGAIN)
+                /* send failure! */
+                return LIBSSH2_ERROR_SOCKET_SEND;
+            session->stats.eagain_send++;
+            rc = 0;
+        }
+        else {
+            _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
+                           "Sent %ld/%ld bytes at %p+%lu", (long)rc,
+                           (long)length, (void *)p->outbuf,
+                           (unsigned long)p->osent));
+            debugdump(session, "libssh2_transport_write send()",
+                      &p->outbuf[p->osent], rc);
+        }
+
+        p->osent += rc;         /* we sent away this much data */
+        session->stats.bytes_sent += rc;
+
+        if(rc < length) {
+            session->socket_block_directions |=
+                LIBSSH2_SESSION_BLOCK_OUTBOUND;
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+    }
+
+    /* all sent, start over at the beginning of the buffer */
+    p->osent = 0;
+    p->ototal_num = 0;
+    session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
+
+    return LIBSSH2_ERROR_NONE;
+}
+
+/* decrypt() decrypts 'len' bytes from 'source' to 'dest'. The whole span is
+ * handed to the crypt method in a single call: the ciphertext is moved to
+ * 'dest' (unless it is already there) and decrypted in place.
  *
  * returns 0 on success and negative on failure
  */
@@ -130,47 +211,29 @@ decrypt(LIBSSH2_SESSION * session, unsigned char *source,
 {
     struct transportpacket *p = &session->packet;
     int blocksize = session->remote.crypt->blocksize;
+    libssh2_uint64_t start;
+    int rc;
 
     /* if we get called with a len that isn't an even number of blocksizes
        we risk losing those extra bytes. AAD is an exception, since those first
        few bytes aren't encrypted so it throws off the rest of the count. */
-    if(!CRYPT_FLAG_L(session, PKTLEN_AAD))
+    if(!CRYPT_FLAG_R(session, PKTLEN_AAD))
         assert((len % blocksize) == 0);
 
-    while(len > 0) {
-        /* normally decrypt up to blocksize bytes at a time */
-        ssize_t decryptlen = LIBSSH2_MIN(blocksize, len);
-        /* The first block is special (since it needs to be decoded to get the
-           length of the remainder of the block) and takes priority. When the
-           length finally gets to the last blocksize bytes, and there's no
-           more data to come, it's the end. */
-        int lowerfirstlast = IS_FIRST(firstlast) ? FIRST_BLOCK :
-            ((len <= blocksize) ? firstlast : MIDDLE_BLOCK);
-        /* If the last block would be less than a whole blocksize, combine it
-           with the previous block to make it larger. This ensures that the
-           whole MAC is included in a single decrypt call. */
-        if(CRYPT_FLAG_L(session, PKTLEN_AAD) && IS_LAST(firstlast)
-           && (len < blocksize*2)) {
-            decryptlen = len;
-            lowerfirstlast = LAST_BLOCK;
-        }
-
-        if(session->remote.crypt->crypt(session, 0, source, decryptlen,
-                                        &session->remote.crypt_abstract,
-                                        lowerfirstlast)) {
-            LIBSSH2_FREE(session, p->payload);
-            return LIBSSH2_ERROR_DECRYPT;
-        }
-
-        /* if the crypt() function would write to a given address it
-           wouldn't have to memcpy() and we could avoid this memcpy()
-           too */
-        memcpy(dest, source, decryptlen);
-
-        len -= decryptlen;       /* less bytes left */
-        dest += decryptlen;      /* advance write pointer */
-        source += decryptlen;    /* advance read pointer */
+    if(source != dest)
+        memcpy(dest, source, len);
+
+    start = _libssh2_now_us();
+    rc = session->remote.crypt->crypt(session, 0, dest, len,
+                                      &session->remote.crypt_abstract,
+                                      firstlast);
+    session->stats.crypt_time += _libssh2_now_us() - start;
+    if(rc) {
+        _libssh2_packet_buf_free(session, p->payload, p->payload_size);
+        p->payload = NULL;
+        return LIBSSH2_ERROR_DECRYPT;
     }
+
     return LIBSSH2_ERROR_NONE;         /* all is fine */
 }
 
@@ -202,6 +265,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
             /* Calculate MAC hash */
             int etm = remote_mac->etm;
             size_t mac_len = remote_mac->mac_len;
+            libssh2_uint64_t start = _libssh2_now_us();
             if(etm) {
                 /* store hash here */
                 remote_mac->hash(session, macbuf,
@@ -219,6 +283,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
                                  session->fullpacket_payload_len,
                                  &session->remote.mac_abstract);
             }
+            session->stats.mac_time += _libssh2_now_us() - start;
 
             /* Compare the calculated hash with the MAC we just read from
              * the network. The read one is at the very end of the payload
@@ -232,49 +297,26 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 
             }
             else if(etm) {
-                /* MAC was ok and we start by decrypting the first block that
-                   contains padding length since this allows us to decrypt
-                   all other blocks to the right location in memory
-                   avoiding moving a larger block of memory one byte. */
-                unsigned char first_block[MAX_BLOCKSIZE];
-                ssize_t decrypt_size;
-                unsigned char *decrypt_buffer;
-                int blocksize = session->remote.crypt->blocksize;
-
-                rc = decrypt(session, p->payload + 4,
-                             first_block, blocksize, FIRST_BLOCK);
+                /* MAC was ok, decrypt everything after the plain packet
+                   length field in place in a single pass */
+                rc = decrypt(session, p->payload + 4, p->payload + 4,
+                             p->total_num - mac_len - 4,
+                             FIRST_BLOCK | LAST_BLOCK);
                 if(rc) {
+                    p->payload = NULL;
                     return rc;
                 }
 
-                /* we need buffer for decrypt */
-                decrypt_size = p->total_num - mac_len - 4;
-                decrypt_buffer = LIBSSH2_ALLOC(session, decrypt_size);
-                if(!decrypt_buffer) {
-                    return LIBSSH2_ERROR_ALLOC;
-                }
-
-                /* grab padding length and copy anything else
-                   into target buffer */
-                p->padding_length = first_block[0];
-                if(blocksize > 1) {
-                    memcpy(decrypt_buffer, first_block + 1, blocksize - 1);
-                }
-
-                /* decrypt all other blocks packet */
-                if(blocksize < decrypt_size) {
-                    rc = decrypt(session, p->payload + blocksize + 4,
-                                 decrypt_buffer + blocksize - 1,
-                                 decrypt_size - blocksize, LAST_BLOCK);
-                    if(rc) {
-                        LIBSSH2_FREE(session, decrypt_buffer);
-                        return rc;
-                    }
+                /* grab padding length and move the rest down to the start
+                   of the payload buffer */
+                p->padding_length = p->payload[4];
+                if(p->padding_length > p->packet_length - 1) {
+                    _libssh2_packet_buf_free(session, p->payload,
+                                             p->payload_size);
+                    p->payload = NULL;
+                    return LIBSSH2_ERROR_DECRYPT;
                 }
-
-                /* replace encrypted payload with plain text payload */
-                LIBSSH2_FREE(session, p->payload);
-                p->payload = decrypt_buffer;
+                memmove(p->payload, p->payload + 5, p->packet_length - 1);
             }
         }
         else if(encrypted && CRYPT_FLAG_R(session, REQUIRES_FULL_PACKET)) {
@@ -283,6 +325,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
         }
 
         session->remote.seqno++;
+        session->stats.packets_recv++;
 
         /* ignore the padding */
         session->fullpacket_payload_len -= p->padding_length;
@@ -302,17 +345,20 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 
             unsigned char *data;
             size_t data_len;
+            libssh2_uint64_t start = _libssh2_now_us();
             rc = session->remote.comp->decomp(session,
                                               &data, &data_len,
                                               LIBSSH2_PACKET_MAXDECOMP,
                                               p->payload,
                                               session->fullpacket_payload_len,
                                               &session->remote.comp_abstract);
-            LIBSSH2_FREE(session, p->payload);
+            session->stats.comp_time += _libssh2_now_us() - start;
+            _libssh2_packet_buf_free(session, p->payload, p->payload_size);
             if(rc)
                 return rc;
 
             p->payload = data;
+            p->payload_size = 0;
             session->fullpacket_payload_len = data_len;
         }
 
@@ -327,6 +373,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     if(session->fullpacket_state == libssh2_NB_state_created) {
         rc = _libssh2_packet_add(session, p->payload,
                                  session->fullpacket_payload_len,
+                                 p->payload_size,
                                  session->fullpacket_macstate, seq);
         if(rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
@@ -410,6 +457,15 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             return rc;
     }
 
+    /* Send what has been queued before waiting for the peer to answer it,
+       unless the queue is corked while more gets added */
+    if(p->ototal_num && (!p->ocork ||
+                         (session->state & LIBSSH2_STATE_EXCHANGING_KEYS))) {
+        rc = flush_queue(session);
+        if(rc && rc != LIBSSH2_ERROR_EAGAIN)
+            return rc;
+    }
+
     /*
      * =============================== NOTE ===============================
      * I know this is very ugly and not a really good use of "goto", but
@@ -467,6 +523,13 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                little data to deal with, read more */
             ssize_t nread;
 
+            if(CRYPT_FLAG_R(session, REQUIRES_FULL_PACKET)) {
+                /* the whole packet has to fit in the buffer at once */
+                rc = grow_buf(session, &p->buf, &p->buf_size, p->total_num);
+                if(rc)
+                    return rc;
+            }
+
             /* move any remainder to the start of the buffer so
                that we can do a full refill */
             if(remainbuf) {
@@ -481,7 +544,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
             /* now read a big chunk from the network into the temp buffer */
             nread = LIBSSH2_RECV(session, &p->buf[remainbuf],
-                                 PACKETBUFSIZE - remainbuf,
+                                 p->buf_size - remainbuf,
                                  LIBSSH2_SOCKET_RECV_FLAGS(session));
             if(nread <= 0) {
                 /* check if this is due to EAGAIN and return the special
@@ -489,23 +552,25 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 if((nread < 0) && (nread == -EAGAIN)) {
                     session->socket_block_directions |=
                         LIBSSH2_SESSION_BLOCK_INBOUND;
+                    session->stats.eagain_recv++;
                     return LIBSSH2_ERROR_EAGAIN;
                 }
                 _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
                                "Error recving %ld bytes (got %ld)",
-                               (long)(PACKETBUFSIZE - remainbuf),
+                               (long)(p->buf_size - remainbuf),
                                (long)-nread));
                 return LIBSSH2_ERROR_SOCKET_RECV;
             }
             _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
                            "Recved %ld/%ld bytes to %p+%ld", (long)nread,
-                           (long)(PACKETBUFSIZE - remainbuf), (void *)p->buf,
+                           (long)(p->buf_size - remainbuf), (void *)p->buf,
                            (long)remainbuf));
 
             debugdump(session, "libssh2_transport_read() raw",
                       &p->buf[remainbuf], nread);
             /* advance write pointer */
             p->writeidx += nread;
+            session->stats.bytes_recv += nread;
 
             /* update remainbuf counter */
             remainbuf = p->writeidx - p->readidx;
@@ -541,10 +606,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 /* etm size field is not encrypted */
                 memcpy(block, &p->buf[p->readidx], 4);
                 memcpy(p->init, &p->buf[p->readidx], 4);
+                p->packet_length = _libssh2_ntohu32(block);
             }
             else if(encrypted && session->remote.crypt->get_len) {
                 unsigned int len = 0;
                 unsigned char *ptr = NULL;
+                libssh2_uint64_t start = _libssh2_now_us();
 
                 rc = session->remote.crypt->get_len(session,
                                             session->remote.seqno,
@@ -552,11 +619,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                                             numbytes,
                                             &len,
                                             &session->remote.crypt_abstract);
+                session->stats.crypt_time += _libssh2_now_us() - start;
 
                 if(rc != LIBSSH2_ERROR_NONE) {
                     p->total_num = 0;   /* no packet buffer available */
-                    if(p->payload)
-                        LIBSSH2_FREE(session, p->payload);
+                    _libssh2_packet_buf_free(session, p->payload,
+                                             p->payload_size);
                     p->payload = NULL;
                     return rc;
                 }
@@ -607,7 +675,6 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 if(etm) {
                     /* we collect entire undecrypted packet including the
                        packet length field that we run MAC over */
-                    p->packet_length = _libssh2_ntohu32(block);
                     total_num = 4 + p->packet_length +
                     remote_mac->mac_len;
                 }
@@ -667,7 +734,8 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
             /* Get a packet handle put data into. We get one to
                hold all data, including padding and MAC. */
-            p->payload = LIBSSH2_ALLOC(session, total_num);
+            p->payload = _libssh2_packet_buf_alloc(session, total_num,
+                                                   &p->payload_size);
             if(!p->payload) {
                 return LIBSSH2_ERROR_ALLOC;
             }
@@ -689,8 +757,9 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                         }
                     }
                     else {
-                        if(p->payload)
-                            LIBSSH2_FREE(session, p->payload);
+                        _libssh2_packet_buf_free(session, p->payload,
+                                                 p->payload_size);
+                        p->payload = NULL;
                         return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
                     }
                 }
@@ -790,12 +859,14 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
         if(numdecrypt > 0) {
             /* now decrypt the lot */
             if(CRYPT_FLAG_R(session, REQUIRES_FULL_PACKET)) {
+                libssh2_uint64_t start = _libssh2_now_us();
                 rc = session->remote.crypt->crypt(session,
                                                session->remote.seqno,
                                                &p->buf[p->readidx],
                                                numdecrypt,
                                                &session->remote.crypt_abstract,
                                                0);
+                session->stats.crypt_time += _libssh2_now_us() - start;
 
                 if(rc != LIBSSH2_ERROR_NONE) {
                     p->total_num = 0;   /* no packet buffer available */
@@ -848,8 +919,9 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 memcpy(p->wptr, &p->buf[p->readidx], numbytes);
             }
             else {
-                if(p->payload)
-                    LIBSSH2_FREE(session, p->payload);
+                _libssh2_packet_buf_free(session, p->payload,
+                                         p->payload_size);
+                p->payload = NULL;
                 return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
             }
 
@@ -897,13 +969,53 @@ libssh2_transport_read_point1:
     return LIBSSH2_ERROR_SOCKET_RECV; /* we never reach this point */
 }
 
+/*
+ * queue_room() makes room for 'needed' more bytes at the end of the queue in
+ * outbuf, by moving the unsent data to the start of the buffer, by sending
+ * some of it or, with nothing queued, by growing the buffer.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if there isn't room yet.
+ */
+static int
+queue_room(LIBSSH2_SESSION *session, size_t needed)
+{
+    struct transportpacket *p = &session->packet;
+    int rc;
+
+    if(p->outbuf_size - p->ototal_num >= needed)
+        return LIBSSH2_ERROR_NONE;
+
+    if(p->osent) {
+        memmove(p->outbuf, &p->outbuf[p->osent], p->ototal_num - p->osent);
+        p->ototal_num -= p->osent;
+        p->osent = 0;
+
+        if(p->outbuf_size - p->ototal_num >= needed)
+            return LIBSSH2_ERROR_NONE;
+    }
+
+    if(p->ototal_num) {
+        rc = flush_queue(session);
+        if(rc)
+            return rc;
+    }
+
+    /* The outgoing buffer is sized for the configured maximum packet size,
+       let it grow up to the protocol limit for the odd larger packet */
+    return grow_buf(session, &p->outbuf, &p->outbuf_size, needed);
+}
+
+/*
+ * send_existing() completes an earlier call that queued packets but could
+ * not send them all. Only that caller, identified by 'data' and 'data_len',
+ * may go on while there is such a call to complete.
+ */
 static int
 send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
               size_t data_len, ssize_t *ret)
 {
-    ssize_t rc;
-    ssize_t length;
     struct transportpacket *p = &session->packet;
+    int rc;
 
     if(!p->olen) {
         *ret = 0;
@@ -924,69 +1036,90 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
 
     *ret = 1;                   /* set to make our parent return */
 
-    /* number of bytes left to send */
-    length = p->ototal_num - p->osent;
+    rc = flush_queue(session);
+    if(rc)
+        return rc;
 
-    rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
-                      LIBSSH2_SOCKET_SEND_FLAGS(session));
-    if(rc < 0)
-        _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %ld bytes: %ld",
-                       (long)length, (long)-rc));
-    else {
-        _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
-                       "Sent %ld/%ld bytes at %p+%lu", (long)rc, (long)length,
-                       (void *)p->outbuf, (unsigned long)p->osent));
-        debugdump(session, "libssh2_transport_write send()",
-                  &p->outbuf[p->osent], rc);
-    }
+    /* the remainder of the package was sent */
+    p->odata = NULL;
+    p->olen = 0;
+    /* we leave *ret set so that the parent returns as we MUST return back
+       a send success now, so that we don't risk sending EAGAIN later
+       which then would confuse the parent function */
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * send_queued() sends the queued packets on behalf of the caller identified
+ * by 'data' and 'data_len', unless the queue is corked. If they can't all be
+ * sent right away, that caller has to call again to complete it.
+ */
+static int
+send_queued(LIBSSH2_SESSION *session, const unsigned char *data,
+            size_t data_len)
+{
+    struct transportpacket *p = &session->packet;
+    int rc;
 
-    if(rc == length) {
-        /* the remainder of the package was sent */
-        p->ototal_num = 0;
-        p->olen = 0;
-        /* we leave *ret set so that the parent returns as we MUST return back
-           a send success now, so that we don't risk sending EAGAIN later
-           which then would confuse the parent function */
+    /* key exchange packets are never held back, the peer is waiting */
+    if(p->ocork && !(session->state & LIBSSH2_STATE_EXCHANGING_KEYS))
         return LIBSSH2_ERROR_NONE;
 
+    rc = flush_queue(session);
+    if(rc == LIBSSH2_ERROR_EAGAIN) {
+        /* the whole packet could not be sent, save the rest */
+        p->odata = data;
+        p->olen = data_len;
     }
-    else if(rc < 0) {
-        /* nothing was sent */
-        if(rc != -EAGAIN)
-            /* send failure! */
-            return LIBSSH2_ERROR_SOCKET_SEND;
+    return rc;
+}
 
-        session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-        return LIBSSH2_ERROR_EAGAIN;
-    }
+/*
+ * fill_padding() copies 'len' random bytes for packet padding to 'dest'.
+ *
+ * They come from a per-session pool that the DRBG refills
+ * LIBSSH2_PADDING_POOL bytes at a time, rather than from one DRBG call per
+ * packet.
+ */
+static int
+fill_padding(LIBSSH2_SESSION *session, unsigned char *dest, size_t len)
+{
+    struct transportpacket *p = &session->packet;
+
+    while(len) {
+        size_t n;
+
+        if(!p->orandom_left) {
+            if(_libssh2_random(p->orandom, sizeof(p->orandom)))
+                return _libssh2_error(session, LIBSSH2_ERROR_RANDGEN,
+                                      "Unable to get random bytes for "
+                                      "packet padding");
+            p->orandom_left = sizeof(p->orandom);
+        }
 
-    p->osent += rc;         /* we sent away this much data */
+        n = LIBSSH2_MIN(len, p->orandom_left);
+        memcpy(dest, &p->orandom[sizeof(p->orandom) - p->orandom_left], n);
+        p->orandom_left -= n;
+        dest += n;
+        len -= n;
+    }
 
-    return rc < length ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_NONE;
+    return 0;
 }
 
 /*
- * libssh2_transport_send
- *
- * Send a packet, encrypting it and adding a MAC code if necessary
- * Returns 0 on success, non-zero on failure.
- *
- * The data is provided as _two_ data areas that are combined by this
- * function.  The 'data' part is sent immediately before 'data2'. 'data2' may
- * be set to NULL to only use a single part.
+ * queue_packet() builds and encrypts a single packet out of 'data' and
+ * 'data2' and adds it to the end of the outgoing queue. Once queued the
+ * packet is committed: the sequence number and the cipher, MAC and
+ * compression states have moved on and it has to be sent.
  *
- * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
- * not sent yet. If it does so, the caller should call this function again as
- * soon as it is likely that more data can be sent, and this function MUST
- * then be called with the same argument set (same data pointer and same
- * data_len) until ERROR_NONE or failure is returned.
- *
- * This function DOES NOT call _libssh2_error() on any errors.
+ * Returns LIBSSH2_ERROR_EAGAIN, without queueing anything, if there is no
+ * room for it until more of the queue has been sent.
  */
-int _libssh2_transport_send(LIBSSH2_SESSION *session,
-                            const unsigned char *data, size_t data_len,
-                            const unsigned char *data2, size_t data2_len)
+static int
+queue_packet(LIBSSH2_SESSION *session,
+             const unsigned char *data, size_t data_len,
+             const unsigned char *data2, size_t data2_len)
 {
     int blocksize =
         (session->state & LIBSSH2_STATE_NEWKEYS) ?
@@ -996,54 +1129,19 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     ssize_t total_length;
 #ifdef LIBSSH2_RANDOM_PADDING
     int rand_max;
-    int seed = data[0];         /* FIXME: make this random */
+    unsigned char seed;
 #endif
     struct transportpacket *p = &session->packet;
     int encrypted;
     int compressed;
     int etm;
-    ssize_t ret;
     int rc;
-    const unsigned char *orgdata = data;
+    unsigned char *pkt;     /* where this packet goes in outbuf */
+    size_t room;
     const LIBSSH2_MAC_METHOD *local_mac = NULL;
     unsigned int auth_len = 0;
-    size_t orgdata_len = data_len;
     size_t crypt_offset, etm_crypt_offset;
 
-    /*
-     * If the last read operation was interrupted in the middle of a key
-     * exchange, we must complete that key exchange before continuing to write
-     * further data.
-     *
-     * See the similar block in _libssh2_transport_read for more details.
-     */
-    if(session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
-        !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
-        /* Don't write any new packets if we're still in the middle of a key
-         * exchange. */
-        _libssh2_debug((session, LIBSSH2_TRACE_TRANS, "Redirecting into the"
-                       " key re-exchange from _libssh2_transport_send"));
-        rc = _libssh2_kex_exchange(session, 1, &session->startup_key_state);
-        if(rc)
-            return rc;
-    }
-
-    debugdump(session, "libssh2_transport_write plain", data, data_len);
-    if(data2)
-        debugdump(session, "libssh2_transport_write plain2", data2, data2_len);
-
-    /* FIRST, check if we have a pending write to complete. send_existing
-       only sanity-check data and data_len and not data2 and data2_len! */
-    rc = send_existing(session, data, data_len, &ret);
-    if(rc)
-        return rc;
-
-    session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
-
-    if(ret)
-        /* set by send_existing if data was sent */
-        return rc;
-
     encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
 
     if(encrypted && session->local.crypt &&
@@ -1061,16 +1159,26 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                  ((session->state & LIBSSH2_STATE_AUTHENTICATED) ||
                   session->local.comp->use_in_auth);
 
+    rc = queue_room(session,
+                    LIBSSH2_MIN(data_len + data2_len + SSH_PACKET_OVERHEAD,
+                                (size_t)MAX_SSH_PACKET_LEN));
+    if(rc)
+        return rc;
+
+    pkt = &p->outbuf[p->ototal_num];
+    room = p->outbuf_size - p->ototal_num;
+
     if(encrypted && compressed && session->local.comp_abstract) {
         /* the idea here is that these function must fail if the output gets
            larger than what fits in the assigned buffer so thus they don't
            check the input size as we don't know how much it compresses */
-        size_t dest_len = MAX_SSH_PACKET_LEN-5-256;
+        size_t dest_len = room - 5 - SSH_PACKET_OVERHEAD;
         size_t dest2_len = dest_len;
+        libssh2_uint64_t start = _libssh2_now_us();
 
         /* compress directly to the target buffer */
         rc = session->local.comp->comp(session,
-                                       &p->outbuf[5], &dest_len,
+                                       &pkt[5], &dest_len,
                                        data, data_len,
                                        &session->local.comp_abstract);
         if(rc)
@@ -1082,28 +1190,29 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             dest2_len -= dest_len;
 
             rc = session->local.comp->comp(session,
-                                           &p->outbuf[5 + dest_len],
+                                           &pkt[5 + dest_len],
                                            &dest2_len,
                                            data2, data2_len,
                                            &session->local.comp_abstract);
         }
         else
             dest2_len = 0;
+        session->stats.comp_time += _libssh2_now_us() - start;
         if(rc)
             return rc;     /* compression failure */
 
         data_len = dest_len + dest2_len; /* use the combined length */
     }
     else {
-        if((data_len + data2_len) >= (MAX_SSH_PACKET_LEN-0x100))
-            /* too large packet, return error for this until we make this
-               function split it up and send multiple SSH packets */
+        if((data_len + data2_len) > (room - SSH_PACKET_OVERHEAD))
+            /* too large packet and not channel data that could have been
+               split up into multiple SSH packets */
             return LIBSSH2_ERROR_INVAL;
 
         /* copy the payload data */
-        memcpy(&p->outbuf[5], data, data_len);
+        memcpy(&pkt[5], data, data_len);
         if(data2 && data2_len)
-            memcpy(&p->outbuf[5 + data_len], data2, data2_len);
+            memcpy(&pkt[5 + data_len], data2, data2_len);
         data_len += data2_len; /* use the combined length */
     }
 
@@ -1143,6 +1252,9 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     /* now we can add 'blocksize' to the padding_length N number of times
        (to "help thwart traffic analysis") but it must be less than 255 in
        total */
+    rc = fill_padding(session, &seed, 1);
+    if(rc)
+        return rc;
     rand_max = (255 - padding_length) / blocksize + 1;
     padding_length += blocksize * (seed % rand_max);
 #endif
@@ -1157,18 +1269,18 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     /* store packet_length, which is the size of the whole packet except
        the MAC and the packet_length field itself */
-    _libssh2_htonu32(p->outbuf, (uint32_t)(packet_length - 4));
+    _libssh2_htonu32(pkt, (uint32_t)(packet_length - 4));
     /* store padding_length */
-    p->outbuf[4] = (unsigned char)padding_length;
+    pkt[4] = (unsigned char)padding_length;
 
     /* fill the padding area with random junk */
-    if(_libssh2_random(p->outbuf + 5 + data_len, padding_length)) {
-        return _libssh2_error(session, LIBSSH2_ERROR_RANDGEN,
-                              "Unable to get random bytes for packet padding");
-    }
+    rc = fill_padding(session, pkt + 5 + data_len, (size_t)padding_length);
+    if(rc)
+        return rc;
 
     if(encrypted) {
-        size_t i;
+        libssh2_uint64_t start = _libssh2_now_us();
+        libssh2_uint64_t now;
 
         /* Calculate MAC hash. Put the output at index packet_length,
            since that size includes the whole packet. The MAC is
@@ -1177,18 +1289,21 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
            INTEGRATED_MAC case, where the crypto algorithm also does its
            own hash. */
         if(!etm && local_mac && !CRYPT_FLAG_L(session, INTEGRATED_MAC)) {
-            if(local_mac->hash(session, p->outbuf + packet_length,
-                               session->local.seqno, p->outbuf,
+            if(local_mac->hash(session, pkt + packet_length,
+                               session->local.seqno, pkt,
                                packet_length, NULL, 0,
                                &session->local.mac_abstract))
                 return _libssh2_error(session, LIBSSH2_ERROR_MAC_FAILURE,
                                       "Failed to calculate MAC");
+            now = _libssh2_now_us();
+            session->stats.mac_time += now - start;
+            start = now;
         }
 
         if(CRYPT_FLAG_L(session, REQUIRES_FULL_PACKET)) {
             if(session->local.crypt->crypt(session,
                                            session->local.seqno,
-                                           p->outbuf,
+                                           pkt,
                                            packet_length,
                                            &session->local.crypt_abstract,
                                            0)) {
@@ -1196,44 +1311,22 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             }
         }
         else {
-            /* Encrypt the whole packet data, one block size at a time.
-               The MAC field is not encrypted unless INTEGRATED_MAC. */
-            /* Some crypto back-ends could handle a single crypt() call for
-               encryption, but (presumably) others cannot, so break it up
-               into blocksize-sized chunks to satisfy them all. */
-            for(i = etm_crypt_offset; i < packet_length;
-                i += session->local.crypt->blocksize) {
-                unsigned char *ptr = &p->outbuf[i];
-                size_t bsize = LIBSSH2_MIN(session->local.crypt->blocksize,
-                                           (int)(packet_length-i));
-                /* The INTEGRATED_MAC case always has an extra call below, so
-                   it will never be LAST_BLOCK up here. */
-                int firstlast = i == 0 ? FIRST_BLOCK :
-                (!CRYPT_FLAG_L(session, INTEGRATED_MAC)
-                 && (i == packet_length - session->local.crypt->blocksize)
-                 ? LAST_BLOCK : MIDDLE_BLOCK);
-                /* In the AAD case, the last block would be only 4 bytes
-                   because everything is offset by 4 since the initial
-                   packet_length isn't encrypted. In this case, combine that
-                   last short packet with the previous one since AES-GCM
-                   crypt() assumes that the entire MAC is available in that
-                   packet so it can set that to the authentication tag. */
-                if(!CRYPT_FLAG_L(session, INTEGRATED_MAC))
-                    if(i > packet_length - 2*bsize) {
-                        /* increase the final block size */
-                        bsize = packet_length - i;
-                        /* advance the loop counter by the extra amount */
-                        i += bsize - session->local.crypt->blocksize;
-                    }
-                _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
-                                "crypting bytes %lu-%lu", (unsigned long)i,
-                                (unsigned long)(i + bsize - 1)));
-                if(session->local.crypt->crypt(session, 0, ptr,
-                                               bsize,
-                                               &session->local.crypt_abstract,
-                                               firstlast))
-                    return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
-            }
+            /* Encrypt the whole packet data in a single call. The MAC field
+               is not encrypted unless INTEGRATED_MAC, in which case the
+               packet is not complete until the call below has filled in the
+               MAC. */
+            int firstlast = CRYPT_FLAG_L(session, INTEGRATED_MAC) ?
+                FIRST_BLOCK : (FIRST_BLOCK | LAST_BLOCK);
+            _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
+                            "crypting bytes %lu-%lu",
+                            (unsigned long)etm_crypt_offset,
+                            (unsigned long)(packet_length - 1)));
+            if(session->local.crypt->crypt(session, 0,
+                                           &pkt[etm_crypt_offset],
+                                           packet_length - etm_crypt_offset,
+                                           &session->local.crypt_abstract,
+                                           firstlast))
+                return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
 
             /* Call crypt() one last time so it can be filled in with the
                MAC */
@@ -1243,7 +1336,7 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                        packet_length + session->local.crypt->blocksize);
                 if(session->local.crypt->crypt(session,
                                                0,
-                                               &p->outbuf[packet_length],
+                                               &pkt[packet_length],
                                                authlen,
                                                &session->local.crypt_abstract,
                                                LAST_BLOCK))
@@ -1251,56 +1344,266 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             }
         }
 
+        now = _libssh2_now_us();
+        session->stats.crypt_time += now - start;
+
         if(etm) {
             /* Calculate MAC hash. Put the output at index packet_length,
                since that size includes the whole packet. The MAC is
                calculated on the entire packet (length plain the rest
                encrypted), including all fields except the MAC field
                itself. */
-            if(local_mac->hash(session, p->outbuf + packet_length,
-                               session->local.seqno, p->outbuf,
+            if(local_mac->hash(session, pkt + packet_length,
+                               session->local.seqno, pkt,
                                packet_length, NULL, 0,
                                &session->local.mac_abstract))
                 return _libssh2_error(session, LIBSSH2_ERROR_MAC_FAILURE,
                                       "Failed to calculate MAC");
+            session->stats.mac_time += _libssh2_now_us() - now;
         }
     }
 
     session->local.seqno++;
+    session->stats.packets_sent++;
 
     if(session->kex_strict && data[0] == SSH_MSG_NEWKEYS) {
         session->local.seqno = 0;
     }
 
-    ret = LIBSSH2_SEND(session, p->outbuf, total_length,
-                       LIBSSH2_SOCKET_SEND_FLAGS(session));
-    if(ret < 0)
-        _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %ld bytes: %ld",
-                       (long)total_length, (long)-ret));
-    else {
-        _libssh2_debug((session, LIBSSH2_TRACE_SOCKET,
-                       "Sent %ld/%ld bytes at %p",
-                       (long)ret, (long)total_length, (void *)p->outbuf));
-        debugdump(session, "libssh2_transport_write send()", p->outbuf, ret);
+    /* the packet is queued, it goes out with the ones before it */
+    p->ototal_num += total_length;
+
+    return LIBSSH2_ERROR_NONE;         /* all is good */
+}
+
+/*
+ * is_channel_data() tells if 'data' is the header of a channel data message
+ * whose contents are all passed as 'data2'. Only such messages can be split
+ * over several packets.
+ */
+static int
+is_channel_data(const unsigned char *data, size_t data_len,
+                size_t data2_len)
+{
+    if(!((data_len == 9 && data[0] == SSH_MSG_CHANNEL_DATA) ||
+         (data_len == 13 && data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)))
+        return 0;
+
+    /* the data length field ends the header */
+    return _libssh2_ntohu32(data + data_len - 4) == data2_len;
+}
+
+/*
+ * libssh2_transport_send
+ *
+ * Send a packet, encrypting it and adding a MAC code if necessary
+ * Returns 0 on success, non-zero on failure.
+ *
+ * The data is provided as _two_ data areas that are combined by this
+ * function.  The 'data' part is sent immediately before 'data2'. 'data2' may
+ * be set to NULL to only use a single part.
+ *
+ * Channel data larger than what fits in a packet of this session is split up
+ * and sent as several consecutive messages, each with its own copy of the
+ * header in 'data'.
+ *
+ * Packets are added to an outgoing queue that is sent with as few send()
+ * calls as possible, see _libssh2_transport_cork(). A queued packet is
+ * committed and goes out before any later one.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
+ * not sent yet. If it does so, the caller should call this function again as
+ * soon as it is likely that more data can be sent, and this function MUST
+ * then be called with the same argument set (same data pointer and same
+ * data_len) until ERROR_NONE or failure is returned.
+ *
+ * This function DOES NOT call _libssh2_error() on any errors.
+ */
+int _libssh2_transport_send(LIBSSH2_SESSION *session,
+                            const unsigned char *data, size_t data_len,
+                            const unsigned char *data2, size_t data2_len)
+{
+    struct transportpacket *p = &session->packet;
+    unsigned char header[13];
+    size_t max_payload;
+    ssize_t ret;
+    int rc;
+
+    /*
+     * If the last read operation was interrupted in the middle of a key
+     * exchange, we must complete that key exchange before continuing to write
+     * further data.
+     *
+     * See the similar block in _libssh2_transport_read for more details.
+     */
+    if(session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
+        !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
+        /* Don't write any new packets if we're still in the middle of a key
+         * exchange. */
+        _libssh2_debug((session, LIBSSH2_TRACE_TRANS, "Redirecting into the"
+                       " key re-exchange from _libssh2_transport_send"));
+        rc = _libssh2_kex_exchange(session, 1, &session->startup_key_state);
+        if(rc)
+            return rc;
     }
 
-    if(ret != total_length) {
-        if(ret >= 0 || ret == -EAGAIN) {
-            /* the whole packet could not be sent, save the rest */
-            session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-            p->odata = orgdata;
-            p->olen = orgdata_len;
-            p->osent = ret <= 0 ? 0 : ret;
-            p->ototal_num = total_length;
-            return LIBSSH2_ERROR_EAGAIN;
+    debugdump(session, "libssh2_transport_write plain", data, data_len);
+    if(data2)
+        debugdump(session, "libssh2_transport_write plain2", data2, data2_len);
+
+    /* FIRST, check if we have a pending write to complete. send_existing
+       only sanity-check data and data_len and not data2 and data2_len! */
+    rc = send_existing(session, data, data_len, &ret);
+    if(rc)
+        return rc;
+
+    if(ret && !p->osplit)
+        /* set by send_existing if data was sent */
+        return rc;
+
+    max_payload = _libssh2_transport_max_payload(session);
+
+    if((data_len + data2_len) <= max_payload ||
+       !is_channel_data(data, data_len, data2_len)) {
+        rc = queue_packet(session, data, data_len, data2, data2_len);
+        if(rc)
+            /* on EAGAIN nothing was queued, the caller tries again later */
+            return rc;
+
+        return send_queued(session, data, data_len);
+    }
+
+    /* Queue the channel data in fragments that fit, picking up after the
+       ones already queued in previous calls. osplit counts the bytes of
+       data2 queued so far. */
+    memcpy(header, data, data_len);
+
+    while(p->osplit < data2_len) {
+        size_t frag_len = LIBSSH2_MIN(data2_len - p->osplit,
+                                      max_payload - data_len);
+        unsigned char *s = &header[data_len - 4];
+
+        _libssh2_store_u32(&s, (uint32_t)frag_len);
+
+        _libssh2_debug((session, LIBSSH2_TRACE_TRANS,
+                       "Sending bytes %lu-%lu of %lu as a separate packet",
+                       (unsigned long)p->osplit,
+                       (unsigned long)(p->osplit + frag_len - 1),
+                       (unsigned long)data2_len));
+
+        rc = queue_packet(session, header, data_len,
+                          data2 + p->osplit, frag_len);
+        if(rc) {
+            if(rc != LIBSSH2_ERROR_EAGAIN)
+                p->osplit = 0;
+            else if(p->osplit) {
+                /* some fragments are already on their way, the caller
+                   has to come back to complete the rest */
+                p->odata = data;
+                p->olen = data_len;
+            }
+            return rc;
         }
-        return LIBSSH2_ERROR_SOCKET_SEND;
+
+        p->osplit += frag_len;
     }
 
-    /* the whole thing got sent away */
-    p->odata = NULL;
-    p->olen = 0;
+    p->osplit = 0;
 
-    return LIBSSH2_ERROR_NONE;         /* all is good */
+    return send_queued(session, data, data_len);
+}
+
+/*
+ * _libssh2_transport_cork
+ *
+ * Hold back sending of the packets queued by _libssh2_transport_send()
+ * until the matching _libssh2_transport_uncork(), so that a burst of small
+ * packets goes out in as few send() calls as possible. Calls nest.
+ */
+void _libssh2_transport_cork(LIBSSH2_SESSION *session)
+{
+    session->packet.ocork++;
+}
+
+/*
+ * _libssh2_transport_uncork
+ *
+ * Undo a _libssh2_transport_cork() call and, at the outermost level, start
+ * sending the queued packets. They are all committed, so whatever can't be
+ * sent right away goes out with the next send or read on the session.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if some of the queue is left.
+ */
+int _libssh2_transport_uncork(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if(p->ocork && --p->ocork)
+        return LIBSSH2_ERROR_NONE;
+
+    return flush_queue(session);
+}
+
+/*
+ * _libssh2_transport_flush
+ *
+ * Send what is left of the queue after _libssh2_transport_uncork() returned
+ * LIBSSH2_ERROR_EAGAIN, for callers that have to wait until it is all gone.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if some of it is still left.
+ */
+int _libssh2_transport_flush(LIBSSH2_SESSION *session)
+{
+    return flush_queue(session);
+}
+
+/*
+ * _libssh2_transport_init
+ *
+ * Allocate the transport buffers. The incoming one is only a staging area
+ * for reading big chunks from the network, unless the cipher needs whole
+ * packets, in which case it grows on demand. The outgoing one holds a
+ * whole packet.
+ */
+int _libssh2_transport_init(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if(!p->buf) {
+        p->buf = LIBSSH2_ALLOC(session, session->packet_buf_size);
+        if(!p->buf)
+            return LIBSSH2_ERROR_ALLOC;
+        p->buf_size = session->packet_buf_size;
+    }
+
+    if(!p->outbuf) {
+        p->outbuf = LIBSSH2_ALLOC(session, session->packet_buf_size);
+        if(!p->outbuf)
+            return LIBSSH2_ERROR_ALLOC;
+        p->outbuf_size = session->packet_buf_size;
+    }
+
+    return LIBSSH2_ERROR_NONE;
+}
+
+void _libssh2_transport_free(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if(p->buf) {
+        LIBSSH2_FREE(session, p->buf);
+        p->buf = NULL;
+        p->buf_size = 0;
+    }
+
+    if(p->outbuf) {
+        LIBSSH2_FREE(session, p->outbuf);
+        p->outbuf = NULL;
+        p->outbuf_size = 0;
+    }
+}
+
+size_t _libssh2_transport_max_payload(LIBSSH2_SESSION *session)
+{
+    return session->packet_buf_size - SSH_PACKET_OVERHEAD;
 }
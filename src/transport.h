@@ -55,6 +55,10 @@
  * function.  The 'data' part is sent immediately before 'data2'. 'data2' can
  * be set to NULL (or data2_len to 0) to only use a single part.
  *
+ * Packets are added to an outgoing queue that is sent with as few send()
+ * calls as possible, see _libssh2_transport_cork(). A queued packet is
+ * committed and goes out before any later one.
+ *
  * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
  * not sent yet. If it does so, the caller should call this function again as
  * soon as it is likely that more data can be sent, and this function MUST
@@ -67,6 +71,32 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                             const unsigned char *data, size_t data_len,
                             const unsigned char *data2, size_t data2_len);
 
+/*
+ * _libssh2_transport_cork
+ *
+ * Hold back sending of queued packets until the matching
+ * _libssh2_transport_uncork(), to send a burst of packets in as few send()
+ * calls as possible. Calls nest.
+ */
+void _libssh2_transport_cork(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_uncork
+ *
+ * Undo a _libssh2_transport_cork() call, at the outermost level start
+ * sending the queued packets. Returns LIBSSH2_ERROR_EAGAIN if some are left,
+ * they go out with the next send or read on the session.
+ */
+int _libssh2_transport_uncork(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_flush
+ *
+ * Send as much as the socket takes of what an uncorked queue has left.
+ * Returns LIBSSH2_ERROR_EAGAIN if some of it is still left.
+ */
+int _libssh2_transport_flush(LIBSSH2_SESSION *session);
+
 /*
  * _libssh2_transport_read
  *
@@ -84,4 +114,29 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
  */
 int _libssh2_transport_read(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_transport_init
+ *
+ * Allocate the incoming and outgoing transport buffers, sized from the
+ * session's configured maximum packet size. Called at handshake time.
+ *
+ * Returns 0 on success or LIBSSH2_ERROR_ALLOC.
+ */
+int _libssh2_transport_init(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_free
+ *
+ * Free the transport buffers.
+ */
+void _libssh2_transport_free(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_max_payload
+ *
+ * Returns the largest payload a single packet is meant to carry with the
+ * session's configured maximum packet size.
+ */
+size_t _libssh2_transport_max_payload(LIBSSH2_SESSION *session);
+
 #endif /* LIBSSH2_TRANSPORT_H */
@@ -2100,6 +2100,197 @@ libssh2_userauth_publickey(LIBSSH2_SESSION *session,
     return rc;
 }
 
+static int
+sign_privkey(LIBSSH2_SESSION *session, unsigned char **sig, size_t *sig_len,
+             const unsigned char *data, size_t data_len, void **abstract)
+{
+    LIBSSH2_PRIVKEY *privkey = (LIBSSH2_PRIVKEY *) (*abstract);
+    const LIBSSH2_HOSTKEY_METHOD **hostkey_methods_avail =
+        libssh2_hostkey_methods();
+    const LIBSSH2_HOSTKEY_METHOD *privkeyobj = privkey->method;
+    struct iovec datavec;
+
+    /* the signature algorithm may have been upgraded from the one of the
+       key (rsa-sha2-256 for an ssh-rsa key), pick the method that reads
+       keys of the same kind under that name */
+    while(*hostkey_methods_avail && (*hostkey_methods_avail)->name) {
+        if((*hostkey_methods_avail)->initPEMFromMemory ==
+           privkey->method->initPEMFromMemory
+           && (*hostkey_methods_avail)->signv
+           && strlen((*hostkey_methods_avail)->name) ==
+              session->userauth_pblc_method_len
+           && memcmp((*hostkey_methods_avail)->name,
+                     session->userauth_pblc_method,
+                     session->userauth_pblc_method_len) == 0) {
+            privkeyobj = *hostkey_methods_avail;
+            break;
+        }
+        hostkey_methods_avail++;
+    }
+    if(!privkeyobj->signv) {
+        return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NONE,
+                              "No handler for specified private key");
+    }
+
+    libssh2_prepare_iovec(&datavec, 1);
+    datavec.iov_base = (void *)LIBSSH2_UNCONST(data);
+    datavec.iov_len  = data_len;
+
+    if(privkeyobj->signv(session, sig, sig_len, 1, &datavec,
+                         &privkey->method_abstract)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static LIBSSH2_PRIVKEY *
+privkey_new(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_PRIVKEY *privkey;
+
+    privkey = LIBSSH2_CALLOC(session, sizeof(*privkey));
+    if(!privkey) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for private key");
+        return NULL;
+    }
+    privkey->free = session->free;
+    privkey->abstract = session->abstract;
+
+    return privkey;
+}
+
+/* libssh2_privkey_frommemory
+ * Load a private key from memory for use with
+ * libssh2_userauth_publickey_privkey()
+ */
+LIBSSH2_API LIBSSH2_PRIVKEY *
+libssh2_privkey_frommemory(LIBSSH2_SESSION *session,
+                           const char *privatekeyfiledata,
+                           size_t privatekeyfiledata_len,
+                           const char *passphrase)
+{
+    LIBSSH2_PRIVKEY *privkey;
+    unsigned char *method = NULL;
+    size_t method_len = 0;
+    int rc;
+
+    if(!session || !privatekeyfiledata)
+        return NULL;
+
+    if(!passphrase)
+        passphrase = "";
+
+    privkey = privkey_new(session);
+    if(!privkey)
+        return NULL;
+
+    rc = _libssh2_pub_priv_keyfilememory(session, &method, &method_len,
+                                         &privkey->pubkeydata,
+                                         &privkey->pubkeydata_len,
+                                         privatekeyfiledata,
+                                         privatekeyfiledata_len,
+                                         passphrase);
+    if(!rc)
+        rc = memory_read_privatekey(session, &privkey->method,
+                                    &privkey->method_abstract,
+                                    method, method_len,
+                                    privatekeyfiledata,
+                                    privatekeyfiledata_len, passphrase);
+    if(method)
+        LIBSSH2_FREE(session, method);
+    if(rc) {
+        libssh2_privkey_free(privkey);
+        return NULL;
+    }
+
+    return privkey;
+}
+
+/* libssh2_privkey_fromfile
+ * Load a private key from a file for use with
+ * libssh2_userauth_publickey_privkey()
+ */
+LIBSSH2_API LIBSSH2_PRIVKEY *
+libssh2_privkey_fromfile(LIBSSH2_SESSION *session,
+                         const char *privatekey,
+                         const char *passphrase)
+{
+    LIBSSH2_PRIVKEY *privkey;
+    unsigned char *method = NULL;
+    size_t method_len = 0;
+    int rc;
+
+    if(!session || !privatekey)
+        return NULL;
+
+    if(!passphrase)
+        passphrase = "";
+
+    privkey = privkey_new(session);
+    if(!privkey)
+        return NULL;
+
+    rc = _libssh2_pub_priv_keyfile(session, &method, &method_len,
+                                   &privkey->pubkeydata,
+                                   &privkey->pubkeydata_len,
+                                   privatekey, passphrase);
+    if(!rc)
+        rc = file_read_privatekey(session, &privkey->method,
+                                  &privkey->method_abstract,
+                                  method, method_len,
+                                  privatekey, passphrase);
+    if(method)
+        LIBSSH2_FREE(session, method);
+    if(rc) {
+        libssh2_privkey_free(privkey);
+        return NULL;
+    }
+
+    return privkey;
+}
+
+/* libssh2_privkey_free
+ * Free a private key loaded with libssh2_privkey_frommemory() or
+ * libssh2_privkey_fromfile()
+ */
+LIBSSH2_API void
+libssh2_privkey_free(LIBSSH2_PRIVKEY *privkey)
+{
+    if(!privkey)
+        return;
+
+    if(privkey->method && privkey->method->dtor)
+        privkey->method->dtor(NULL, &privkey->method_abstract);
+    if(privkey->pubkeydata)
+        privkey->free(privkey->pubkeydata, &privkey->abstract);
+    privkey->free(privkey, &privkey->abstract);
+}
+
+/* libssh2_userauth_publickey_privkey
+ * Authenticate using a previously loaded private key
+ */
+LIBSSH2_API int
+libssh2_userauth_publickey_privkey(LIBSSH2_SESSION *session,
+                                   const char *user,
+                                   size_t user_len,
+                                   LIBSSH2_PRIVKEY *privkey)
+{
+    void *abstract = privkey;
+    int rc;
+
+    if(!session || !privkey)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, session,
+                 _libssh2_userauth_publickey(session, user, user_len,
+                                             privkey->pubkeydata,
+                                             privkey->pubkeydata_len,
+                                             sign_privkey, &abstract));
+    return rc;
+}
+
 
 
 /*